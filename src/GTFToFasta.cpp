@@ -44,7 +44,8 @@ GTFToFasta::GTFToFasta(std::string gtf_fname, std::string genome_fname)
     }
     std::cout << "Reading the annotation file: " << gtf_fname_ << std::endl;
     gtfReader_.init(gtf_fhandle_, true); //load recognizable transcript features only
-    gtfReader_.readAll();  
+    gtfReader_.setThreads(num_cpus);
+    gtfReader_.readAllCached(gtf_fname_.c_str());  
     
     genome_fname_ = genome_fname;
     
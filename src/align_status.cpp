@@ -30,6 +30,7 @@ AlignStatus::AlignStatus()
   _indelFreeAlignment = false;
   _unannotatedSpliceFreeAlignment = false;
   _edit_dist = 0xFF;
+  _qual_penalty = 0xFFFF;
 } 
 
 /**
@@ -42,6 +43,7 @@ AlignStatus::AlignStatus(const BowtieHit& bh, const JunctionSet& gtf_junctions)
   _indelFreeAlignment = true;
   _unannotatedSpliceFreeAlignment = true;
   _edit_dist = bh.edit_dist();
+  _qual_penalty = bh.qual_penalty();
   int j = bh.left();
   for (size_t c = 0 ; c < cigar.size(); ++c)
     {
@@ -74,6 +76,99 @@ AlignStatus::AlignStatus(const BowtieHit& bh, const JunctionSet& gtf_junctions)
     }
 }
 
+/**
+ * Same as above, for hit i of a batch whose splices have already been
+ * looked up in the GTF junctions.
+ */
+AlignStatus::AlignStatus(const HitBatch& batch, size_t i)
+{
+  _aligned = batch.has(i, HitBatch::ALIGNED);
+  _indelFreeAlignment = !batch.has(i, HitBatch::INDEL);
+  _unannotatedSpliceFreeAlignment = !batch.has(i, HitBatch::UNANNOTATED_SPLICE);
+  _edit_dist = batch.edit_dists[i];
+  _qual_penalty = batch.qual_penalties[i];
+}
+
+void HitBatch::assign(const HitsForRead& hits_for_read, const JunctionSet* gtf_junctions)
+{
+  const vector<BowtieHit>& hits = hits_for_read.hits;
+  size_t num_hits = hits.size();
+
+  ref_ids.resize(num_hits);
+  lefts.resize(num_hits);
+  rights.resize(num_hits);
+  edit_dists.resize(num_hits);
+  qual_penalties.resize(num_hits);
+  flags.resize(num_hits);
+  longest_ref_skips.resize(num_hits);
+
+  for (size_t i = 0; i < num_hits; ++i)
+    {
+      const BowtieHit& bh = hits[i];
+      const vector<CigarOp>& cigar = bh.cigar();
+
+      uint8_t f = 0;
+      if (cigar.size() > 0)
+	f |= ALIGNED;
+      if (bh.contiguous())
+	f |= CONTIGUOUS;
+      if (bh.antisense_align())
+	f |= ANTISENSE_ALIGN;
+      if (bh.antisense_splice())
+	f |= ANTISENSE_SPLICE;
+
+      bool spliced = false;
+      int longest_ref_skip = 0;
+      int j = bh.left();
+      for (size_t c = 0; c < cigar.size(); ++c)
+	{
+	  switch(cigar[c].opcode)
+	    {
+	    case REF_SKIP:
+	      {
+		Junction junc;
+		junc.refid = bh.ref_id();
+		junc.left = j;
+		junc.right = junc.left + cigar[c].length;
+		junc.antisense = bh.antisense_splice();
+		j += cigar[c].length;
+		
+		if (!gtf_junctions || gtf_junctions->find(junc) == gtf_junctions->end())
+		  f |= UNANNOTATED_SPLICE;
+		
+		// BowtieHit::gaps() reports a skip as a closed interval, so 
+		// its length there is one less than the op's
+		int gap_len = min((int)cigar[c].length - 1, 0x7FFFF);
+		if (!spliced || gap_len > longest_ref_skip)
+		  longest_ref_skip = gap_len;
+		spliced = true;
+	      }
+	      break;
+	    case MATCH:
+	      j += cigar[c].length;
+	      break;
+	    case DEL:
+	      j += cigar[c].length;
+	      f |= INDEL;
+	      break;
+	    case INS:
+	      f |= INDEL;
+	      break;
+	    default:
+	      break;
+	    }
+	}
+
+      ref_ids[i] = bh.ref_id();
+      lefts[i] = bh.left();
+      rights[i] = j;
+      edit_dists[i] = bh.edit_dist();
+      qual_penalties[i] = bh.qual_penalty();
+      flags[i] = f;
+      longest_ref_skips[i] = longest_ref_skip;
+    }
+}
+
 /**
  * Establish an ordering on alignments.
  * Prefer aligned reads over unaligned reads
@@ -81,7 +176,9 @@ AlignStatus::AlignStatus(const BowtieHit& bh, const JunctionSet& gtf_junctions)
  * prefer splice-free reads over splice reads, and
  * indel-free reads over indel reads.
  * If a read can either be indel-free or splice-free,
- * prefer the indel-free alignment
+ * prefer the indel-free alignment.
+ * Any remaining tie goes to the lower quality-weighted penalty, which is
+ * zero for every hit unless --qual-scoring is in effect.
  */
 bool AlignStatus::operator<(const AlignStatus& rhs) const
 {
@@ -95,7 +192,9 @@ bool AlignStatus::operator<(const AlignStatus& rhs) const
 	//int rhs_value = rhs._aligned ? 1 : 0;
 	int rhs_value = rhs._indelFreeAlignment ? 4 : 0;
 	rhs_value += rhs._unannotatedSpliceFreeAlignment ? 2 : 0;
-	return lhs_value < rhs_value;
+	if (lhs_value != rhs_value)
+	  return lhs_value < rhs_value;
+	return rhs._qual_penalty < _qual_penalty;
 }
 
 /**
@@ -105,7 +204,8 @@ bool AlignStatus::operator==(const AlignStatus& rhs) const
 {
 	return ((_aligned == rhs._aligned) && (rhs._edit_dist ==_edit_dist) &&
 		(_indelFreeAlignment == rhs._indelFreeAlignment) &&
-		(_unannotatedSpliceFreeAlignment == rhs._unannotatedSpliceFreeAlignment));
+		(_unannotatedSpliceFreeAlignment == rhs._unannotatedSpliceFreeAlignment) &&
+		(_qual_penalty == rhs._qual_penalty));
 }
 
 bool AlignStatus::operator!=(const AlignStatus& rhs) const
@@ -113,5 +213,29 @@ bool AlignStatus::operator!=(const AlignStatus& rhs) const
 	return !((*this) == rhs);
 }
 
+template <class Penalty>
+static void score_hit_quals(HitsForRead& hits, const RefSequenceTable& ref_seqs)
+{
+  for (size_t i = 0; i < hits.hits.size(); ++i)
+    {
+      BowtieHit& bh = hits.hits[i];
+      const RefSequenceTable::Sequence* ref = ref_seqs.get_seq(bh.ref_id());
+      uint32_t penalty = ref ? hit_qual_penalty<Penalty>(bh, *ref) : 0;
+      bh.qual_penalty((unsigned short)min(penalty, (uint32_t)0xFFFF));
+    }
+}
 
-
+void score_hit_quals(HitsForRead& hits, const RefSequenceTable& ref_seqs)
+{
+  switch(qual_scoring)
+    {
+    case QUAL_SCORING_PHRED:
+      score_hit_quals<SimplePhredPenalty>(hits, ref_seqs);
+      break;
+    case QUAL_SCORING_MAQ:
+      score_hit_quals<MaqPhredPenalty>(hits, ref_seqs);
+      break;
+    default:
+      break;
+    }
+}
@@ -17,11 +17,127 @@
 #include <bam/sam.h>
 #include "common.h"
 #include "junctions.h"
+#include "qual.h"
 
 
 using namespace std;
 
 
+/**
+ * The facts the alignment grades need about each of a read's hits, taken
+ * from the hits' CIGARs once per hit group and stored column by column, so
+ * grading every hit (or every pair of mate hits) is a loop over flat arrays
+ * instead of repeated walks over each hit's CIGAR.
+ */
+struct HitBatch
+{
+  enum
+    {
+      ALIGNED = 0x01,
+      CONTIGUOUS = 0x02,
+      INDEL = 0x04,
+      UNANNOTATED_SPLICE = 0x08,
+      ANTISENSE_ALIGN = 0x10,
+      ANTISENSE_SPLICE = 0x20
+    };
+
+  HitBatch() {}
+  // Without gtf_junctions, every splice counts as unannotated
+  HitBatch(const HitsForRead& hits, const JunctionSet* gtf_junctions = NULL)
+  {
+    assign(hits, gtf_junctions);
+  }
+
+  void assign(const HitsForRead& hits, const JunctionSet* gtf_junctions = NULL);
+
+  size_t size() const { return ref_ids.size(); }
+  bool has(size_t i, uint8_t flag) const { return (flags[i] & flag) != 0; }
+
+  vector<uint32_t> ref_ids;
+  vector<int> lefts;
+  vector<int> rights;
+  vector<unsigned char> edit_dists;
+  vector<unsigned short> qual_penalties;
+  vector<uint8_t> flags;
+  // Length of the longest REF_SKIP, as InsertAlignmentGrade measures it
+  vector<int> longest_ref_skips;
+};
+
+/**
+ * Quality-weighted penalty of a hit against its reference sequence, in one
+ * pass over the CIGAR, the read and the packed reference.  Penalty is one of
+ * the qual.h policies (SimplePhredPenalty, MaqPhredPenalty) and the hit's
+ * qualities are Phred+33.  A mismatched (or N) base costs mmPenalty of its
+ * quality, each inserted base insPenalty of the qualities flanking the
+ * insertion and each deleted base delPenalty of the quality of the read base
+ * following the deletion.  Hits without a sequence and quality score 0.
+ */
+template <class Penalty>
+uint32_t hit_qual_penalty(const BowtieHit& bh, const RefSequenceTable::Sequence& ref)
+{
+  const string& seq = bh.seq();
+  const string& qual = bh.qual();
+  const vector<CigarOp>& cigar = bh.cigar();
+  size_t read_len = seq.length();
+  if (read_len == 0 || qual.length() < read_len)
+    return 0;
+
+  typedef seqan::Iterator<const RefSequenceTable::Sequence>::Type RefIter;
+  size_t ref_len = seqan::length(ref);
+  size_t ref_pos = bh.left();
+  size_t read_pos = 0;
+  uint32_t penalty = 0;
+  for (size_t c = 0; c < cigar.size(); ++c)
+    {
+      uint32_t len = cigar[c].length;
+      switch(cigar[c].opcode)
+	{
+	case MATCH:
+	  {
+	    if (ref_pos + len > ref_len || read_pos + len > read_len)
+	      return penalty;
+	    RefIter r = seqan::begin(ref) + ref_pos;
+	    for (uint32_t j = 0; j < len; ++j, ++r, ++read_pos)
+	      {
+		int read_base = seqan::ordValue((seqan::Dna5)seq[read_pos]);
+		if (read_base == 4 || read_base != (int)seqan::ordValue((seqan::Dna5)*r))
+		  penalty += Penalty::mmPenalty(phredCharToPhredQual(qual[read_pos]));
+	      }
+	    ref_pos += len;
+	  }
+	  break;
+	case INS:
+	  {
+	    uint8_t q_left = phredCharToPhredQual(qual[read_pos > 0 ? read_pos - 1 : 0]);
+	    uint8_t q_right = phredCharToPhredQual(qual[min(read_pos + len, read_len - 1)]);
+	    penalty += len * Penalty::insPenalty(q_left, q_right);
+	    read_pos += len;
+	  }
+	  break;
+	case DEL:
+	  penalty += len * Penalty::delPenalty(phredCharToPhredQual(qual[min(read_pos, read_len - 1)]));
+	  ref_pos += len;
+	  break;
+	case REF_SKIP:
+	  ref_pos += len;
+	  break;
+	case SOFT_CLIP:
+	  read_pos += len;
+	  break;
+	default:
+	  break;
+	}
+    }
+  return penalty;
+}
+
+/**
+ * Stores the qual_scoring penalty of each hit of a read in the hit, so
+ * that grading can break ties with it for free.  ref_seqs must hold the
+ * sequences of the hits' references; hits on other references score 0.
+ */
+void score_hit_quals(HitsForRead& hits, const RefSequenceTable& ref_seqs);
+
 /**
  * The main purpose of this struct is to provide a
  * (fairly primitive) method for ranking competing alignments
@@ -51,9 +167,11 @@ private:
 	 */
 	bool _aligned;
   unsigned char _edit_dist;
+  unsigned short _qual_penalty;
 public:
   AlignStatus();
   AlignStatus(const BowtieHit& bh, const JunctionSet& gtf_junctions);
+  AlignStatus(const HitBatch& batch, size_t i);
 
   bool operator<(const AlignStatus& rhs) const;
   bool operator==(const AlignStatus& rhs) const;
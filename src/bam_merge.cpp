@@ -72,16 +72,19 @@ int main(int argc, char *argv[])
                fprintf(stderr, ERR_BAM_OPEN, argv[i]);
                return 1;
                }
+       srcfiles[fno]=fp;
        bam1_t *b = bam_init1();
        if (samread(fp, b) > 0) {
-    	  srcfiles[fno]=fp;
           lines.Add(new CBamLine(fno, b));
           }
+       else bam_destroy1(b);
        }
     if (lines.Count()==0) {
       GMessage("Warning: no input BAM records found.\n");
       }
-    fw=samopen(outfname, "wb", srcfiles[lines[0]->fileno]->header);
+    //inputs may be empty (e.g. read ID ranges without alignments),
+    //but they all share the same header
+    fw=samopen(outfname, "wb", srcfiles[0]->header);
     if (fw==NULL)
     	GError("Error creating output file %s\n", outfname);
     int last;
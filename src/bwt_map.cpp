@@ -18,12 +18,35 @@
 #include <vector>
 #include <cmath>
 
+#include <seqan/file.h>
+
 #include "common.h"
 #include "bwt_map.h"
 #include "tokenize.h"
 #include "reads.h"
 
 using namespace std;
+using namespace seqan;
+
+void get_seqs(istream& ref_stream,
+	      RefSequenceTable& rt,
+	      bool keep_seqs)
+{
+  while(ref_stream.good() && !ref_stream.eof())
+    {
+      RefSequenceTable::Sequence* ref_str = new RefSequenceTable::Sequence();
+      string name;
+      readMeta(ref_stream, name, Fasta());
+      string::size_type space_pos = name.find_first_of(" \t\r");
+      if (space_pos != string::npos)
+	name.resize(space_pos);
+      seqan::read(ref_stream, *ref_str, Fasta());
+
+      rt.get_id(name, keep_seqs ? ref_str : NULL, 0);
+      if (!keep_seqs)
+	delete ref_str;
+    }
+}
 
 void HitTable::add_hit(const BowtieHit& bh, bool check_uniqueness)
 {
@@ -112,9 +135,13 @@ void LineHitFactory::rewind(HitStream& hs)
 bool LineHitFactory::next_record(HitStream& hs, const char*& buf, size_t& buf_size) {
      FILE* f=(FILE *)(hs._hit_file);
      bool new_rec = (fgets(_hit_buf,  _hit_buf_max_sz - 1, f)!=NULL);
-     if (!new_rec || feof(f)) {
-             hs._eof=true;
-             return false;
+     while (!new_rec || feof(f)) {
+             //a segment map streamed from Bowtie may not be complete yet
+             if (!fz_wait_for_data(f, new_rec ? strlen(_hit_buf) : 0)) {
+                  hs._eof=true;
+                  return false;
+                  }
+             new_rec = (fgets(_hit_buf,  _hit_buf_max_sz - 1, f)!=NULL);
              }
      ++_line_num;
      char* nl = strrchr(_hit_buf, '\n');
@@ -152,7 +179,6 @@ void BAMHitFactory::openStream(HitStream& hs) {
          err_die("Error opening SAM file %s\n", hs._hit_file_name.c_str());
      if (sam_file->header == NULL)
          err_die("Error: no SAM header found for file %s\n", hs._hit_file_name.c_str());
-     memset(&_next_hit, 0, sizeof(_next_hit));
      //_beginning = bgzf_tell(sam_file->x.bam);
      _sam_header=sam_file->header;
      if (inspect_header(hs) == false)
@@ -161,14 +187,155 @@ void BAMHitFactory::openStream(HitStream& hs) {
      }
 }
 
+BAMReadAhead::BAMReadAhead(samfile_t* sam_file) :
+  _sam_file(sam_file), _curr(0), _pos(0), _draining(false), _stop(false)
+{
+  for (int b = 0; b < 2; ++b)
+    {
+      _batches[b].recs.resize(batch_size);
+      _batches[b].bytes.resize(batch_size);
+      for (size_t i = 0; i < batch_size; ++i)
+        _batches[b].recs[i] = bam_init1();
+    }
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+  if (pthread_create(&_thread, NULL, fill_thread, this) != 0)
+    err_die("Error: could not create BAM read-ahead thread\n");
+}
+
+BAMReadAhead::~BAMReadAhead()
+{
+  pthread_mutex_lock(&_lock);
+  _stop = true;
+  pthread_cond_broadcast(&_cond);
+  pthread_mutex_unlock(&_lock);
+  pthread_join(_thread, NULL);
+
+  for (int b = 0; b < 2; ++b)
+    for (size_t i = 0; i < batch_size; ++i)
+      bam_destroy1(_batches[b].recs[i]);
+  pthread_mutex_destroy(&_lock);
+  pthread_cond_destroy(&_cond);
+}
+
+void* BAMReadAhead::fill_thread(void* read_ahead)
+{
+  ((BAMReadAhead*)read_ahead)->fill_batches();
+  return NULL;
+}
+
+void BAMReadAhead::fill_batches()
+{
+  // A batch shorter than batch_size marks the end of the file
+  for (int b = 0; ; b ^= 1)
+    {
+      Batch& batch = _batches[b];
+      pthread_mutex_lock(&_lock);
+      while (batch.full && !_stop)
+        pthread_cond_wait(&_cond, &_lock);
+      bool stop = _stop;
+      pthread_mutex_unlock(&_lock);
+      if (stop)
+        return;
+
+      batch.count = 0;
+      while (batch.count < batch_size)
+        {
+          int bytes_read = samread(_sam_file, batch.recs[batch.count]);
+          if (bytes_read <= 0)
+            break;
+          batch.bytes[batch.count++] = bytes_read;
+        }
+      bool last = batch.count < batch_size;
+
+      pthread_mutex_lock(&_lock);
+      batch.full = true;
+      pthread_cond_broadcast(&_cond);
+      pthread_mutex_unlock(&_lock);
+      if (last)
+        return;
+    }
+}
+
+bam1_t* BAMReadAhead::next(int& bytes)
+{
+  if (_draining)
+    {
+      Batch& batch = _batches[_curr];
+      if (_pos < batch.count)
+        {
+          bytes = batch.bytes[_pos];
+          return batch.recs[_pos++];
+        }
+      if (batch.count < batch_size)
+        return NULL;
+
+      // Hand the drained batch back to the reader and move to the other one
+      pthread_mutex_lock(&_lock);
+      batch.full = false;
+      pthread_cond_broadcast(&_cond);
+      pthread_mutex_unlock(&_lock);
+      _curr ^= 1;
+      _draining = false;
+    }
+
+  Batch& batch = _batches[_curr];
+  pthread_mutex_lock(&_lock);
+  while (!batch.full)
+    pthread_cond_wait(&_cond, &_lock);
+  pthread_mutex_unlock(&_lock);
+  _draining = true;
+  _pos = 0;
+  if (batch.count == 0)
+    return NULL;
+  bytes = batch.bytes[_pos];
+  return batch.recs[_pos++];
+}
+
+BAMHitFactory::~BAMHitFactory() {
+  for (map<void*, BAMReadAhead*>::iterator itr = _read_aheads.begin();
+       itr != _read_aheads.end(); ++itr)
+      delete itr->second;
+  free(_next_hit.data);
+}
+
 void BAMHitFactory::closeStream(HitStream& hs) {
   if (hs._hit_file) {
+        // stop the reader before the file goes away under it
+        map<void*, BAMReadAhead*>::iterator ra = _read_aheads.find(hs._hit_file);
+        if (ra != _read_aheads.end()) {
+            delete ra->second;
+            _read_aheads.erase(ra);
+            }
+        bam_header_t* header=((samfile_t*)(hs._hit_file))->header;
+        _tid_ref_ids.erase(header);
+        if (_tid_header==header) {
+            _tid_header=NULL;
+            _tid_ids=NULL;
+            }
         samclose((samfile_t*)(hs._hit_file));
         }
   hs._hit_file=NULL;
   _sam_header=NULL;
 }
 
+uint32_t BAMHitFactory::ref_id_for_tid(int tid) {
+  if (_tid_header != _sam_header) {
+      // the left and right streams of a factory take turns
+      _tid_ids = &_tid_ref_ids[_sam_header];
+      if (_tid_ids->empty())
+          _tid_ids->assign(_sam_header->n_targets, 0);
+      _tid_header = _sam_header;
+      }
+  if (tid >= (int)_tid_ids->size())
+      err_die("Error: BAM record refers to target %d, header has only %d\n",
+              tid, (int)_tid_ids->size());
+  uint32_t& id = (*_tid_ids)[tid];
+  if (id == 0)
+      id = _ref_table.get_id(_sam_header->target_name[tid], NULL, 0);
+  return id;
+}
+
 void BAMHitFactory::rewind(HitStream& hs)
 {
   /*
@@ -191,30 +358,57 @@ string BAMHitFactory::hitfile_rec(HitStream& hs, const char* hit_buf) {
   }
 
 bool BAMHitFactory::next_record(HitStream& hs, const char*& buf, size_t& buf_size) {
-  if (_next_hit.data) {
-      free(_next_hit.data);
-      _next_hit.data = NULL;
-      }
   _sam_header=((samfile_t*)(hs._hit_file))->header; //needed by get_hit_from_buf later on
   if (hs.eof() || !hs.ready()) return false;
 
   //mark_curr_pos();
 
-  memset(&_next_hit, 0, sizeof(_next_hit));
-
-  int bytes_read = samread((samfile_t*)(hs._hit_file), &_next_hit);
-  if (bytes_read <= 0) {
+  // samread() reuses and grows _next_hit.data, so there is nothing to free
+  // between records; with more than one cpu the records are read ahead on
+  // a helper thread instead
+  bam1_t* rec = &_next_hit;
+  int bytes_read = 0;
+  if (num_cpus > 1) {
+      BAMReadAhead*& read_ahead = _read_aheads[hs._hit_file];
+      if (read_ahead == NULL)
+          read_ahead = new BAMReadAhead((samfile_t*)(hs._hit_file));
+      rec = read_ahead->next(bytes_read);
+      }
+  else
+      bytes_read = samread((samfile_t*)(hs._hit_file), rec);
+  if (rec == NULL || bytes_read <= 0) {
       hs._eof = true;
       return false;
       }
-  buf = (const char*)&_next_hit;
+  buf = (const char*)rec;
   buf_size = bytes_read;
   return true;
   }
 
 
-BowtieHit HitFactory::create_hit(const string& insert_name, 
-				 const string& ref_name,
+BowtieHit HitFactory::create_hit(const char* insert_name, 
+				 const char* ref_name,
+				 int left,
+				 const vector<CigarOp>& cigar,
+				 bool antisense_aln,
+				 bool antisense_splice,
+				 unsigned char edit_dist,
+				 unsigned char splice_mms,
+				 bool end)
+{
+	return create_hit(insert_name,
+			  ref_id(ref_name),
+			  left,
+			  cigar,
+			  antisense_aln,
+			  antisense_splice,
+			  edit_dist,
+			  splice_mms,
+			  end);
+}
+
+BowtieHit HitFactory::create_hit(const char* insert_name, 
+				 uint32_t reference_id,
 				 int left,
 				 const vector<CigarOp>& cigar,
 				 bool antisense_aln,
@@ -224,7 +418,6 @@ BowtieHit HitFactory::create_hit(const string& insert_name,
 				 bool end)
 {
 	uint64_t insert_id = _insert_table.get_id(insert_name);
-	uint32_t reference_id = _ref_table.get_id(ref_name, NULL, 0);
 	
 	return BowtieHit(reference_id,
 			 insert_id, 
@@ -237,8 +430,25 @@ BowtieHit HitFactory::create_hit(const string& insert_name,
 			 end);
 }
 
-BowtieHit HitFactory::create_hit(const string& insert_name, 
-				 const string& ref_name,
+BowtieHit HitFactory::create_hit(const char* insert_name, 
+				 const char* ref_name,
+				 uint32_t left,
+				 uint32_t read_len,
+				 bool antisense_aln,
+				 unsigned char edit_dist,
+				 bool end)
+{
+	return create_hit(insert_name,
+			  ref_id(ref_name),
+			  left,
+			  read_len,
+			  antisense_aln,
+			  edit_dist,
+			  end);
+}
+
+BowtieHit HitFactory::create_hit(const char* insert_name, 
+				 uint32_t reference_id,
 				 uint32_t left,
 				 uint32_t read_len,
 				 bool antisense_aln,
@@ -246,7 +456,6 @@ BowtieHit HitFactory::create_hit(const string& insert_name,
 				 bool end)
 {
 	uint64_t insert_id = _insert_table.get_id(insert_name);
-	uint32_t reference_id = _ref_table.get_id(ref_name, NULL, 0);
 	
 	return BowtieHit(reference_id,
 			 insert_id, 
@@ -347,7 +556,8 @@ bool BowtieHitFactory::get_hit_from_buf(const char* orig_bwt_buf,
 	// Bowtie map
 
 	//vector<string> mismatch_toks;
-	char* pch = strtok (mismatches,",");
+	char* mm_save = NULL;
+	char* pch = strtok_r (mismatches, ",", &mm_save);
 	unsigned char num_mismatches = 0;
 	while (pch != NULL)
 	{
@@ -357,7 +567,7 @@ bool BowtieHitFactory::get_hit_from_buf(const char* orig_bwt_buf,
 			num_mismatches++;
 		}
 		//mismatch_toks.push_back(pch);
-		pch = strtok (NULL, ",");
+		pch = strtok_r (NULL, ",", &mm_save);
 	}
 	
 	bh = create_hit(name,
@@ -551,7 +761,8 @@ bool SplicedBowtieHitFactory::get_hit_from_buf(const char* orig_bwt_buf,
 				return false;
 			}
 			
-			char* pch = strtok( mismatches, ",");
+			char* mm_save = NULL;
+			char* pch = strtok_r( mismatches, ",", &mm_save);
 			unsigned char num_mismatches = 0;
 
 			/*
@@ -591,7 +802,7 @@ bool SplicedBowtieHitFactory::get_hit_from_buf(const char* orig_bwt_buf,
 					  return false; 
 					}
 				}
-				pch = strtok (NULL, ",");
+				pch = strtok_r (NULL, ",", &mm_save);
 			}
 			
 			
@@ -611,7 +822,7 @@ bool SplicedBowtieHitFactory::get_hit_from_buf(const char* orig_bwt_buf,
 			 * in an insertion
 			 */
 			bh = create_hit(name,
-					contig,
+					contig.c_str(),
 					left, 
 					cigar,
 					orientation == '-', 
@@ -659,7 +870,8 @@ bool SplicedBowtieHitFactory::get_hit_from_buf(const char* orig_bwt_buf,
 		      }
 		    
 		    //vector<string> mismatch_toks;
-		    char* pch = strtok (mismatches,",");
+		    char* mm_save = NULL;
+		    char* pch = strtok_r (mismatches, ",", &mm_save);
 		    int mismatches_in_anchor = 0;
 		    unsigned char num_mismatches = 0;
 		    while (pch != NULL)
@@ -675,7 +887,7 @@ bool SplicedBowtieHitFactory::get_hit_from_buf(const char* orig_bwt_buf,
 			      mismatches_in_anchor++;
 			  }
 			//mismatch_toks.push_back(pch);
-			pch = strtok (NULL, ",");
+			pch = strtok_r (NULL, ",", &mm_save);
 		      }
 		    
 		    // FIXME: we probably should exclude these hits somewhere, but this
@@ -690,7 +902,7 @@ bool SplicedBowtieHitFactory::get_hit_from_buf(const char* orig_bwt_buf,
 		    cigar.push_back(CigarOp(MATCH, right_splice_pos));
 		    
 		    bh = create_hit(name,
-				    contig,
+				    contig.c_str(),
 				    left, 
 				    cigar,
 				    orientation == '-', 
@@ -722,8 +934,18 @@ bool SAMHitFactory::get_hit_from_buf(const char* orig_bwt_buf,
 {
 	if (!orig_bwt_buf || !*orig_bwt_buf)
 		return false;
-	char bwt_buf[2048];
-	strcpy(bwt_buf, orig_bwt_buf);
+	// Records longer than the stack buffer (long reads, many tags) are
+	// copied to the heap instead
+	char stack_buf[2048];
+	string long_buf;
+	char* bwt_buf = stack_buf;
+	size_t rec_len = strlen(orig_bwt_buf);
+	if (rec_len >= sizeof(stack_buf))
+	{
+		long_buf.resize(rec_len + 1);
+		bwt_buf = &long_buf[0];
+	}
+	memcpy(bwt_buf, orig_bwt_buf, rec_len + 1);
 	// Are we still in the header region?
 	if (bwt_buf[0] == '@')
 		return false;
@@ -1028,8 +1250,7 @@ bool BAMHitFactory::get_hit_from_buf(const char* orig_bwt_buf,
 		return true;
 	}
 	
-	//string text_name = ((samfile_t*)(hs._hit_file))->header->target_name[target_id];
-	string text_name = _sam_header->target_name[target_id];
+	uint32_t reference_id = ref_id_for_tid(target_id);
 	for (int i = 0; i < hit_buf->core.n_cigar; ++i) 
 	{
 		//char* t;
@@ -1067,13 +1288,8 @@ bool BAMHitFactory::get_hit_from_buf(const char* orig_bwt_buf,
 			cigar.push_back(CigarOp(opcode, length));
 	}
 	
-	string mrnm;
 	if (mate_target_id >= 0) {
-		if (mate_target_id == target_id) {
-			//mrnm = ((samfile_t*)(hs._hit_file))->header->target_name[mate_target_id];
-		    mrnm = _sam_header->target_name[mate_target_id];
-		    }
-		else {
+		if (mate_target_id != target_id) {
 			//fprintf(stderr, "Trans-spliced mates are not currently supported, skipping\n");
 			return false;
 		    }
@@ -1114,7 +1330,7 @@ bool BAMHitFactory::get_hit_from_buf(const char* orig_bwt_buf,
       //  fprintf(stderr, "BAM record error: found spliced alignment without XS attribute\n");
       //  }
       bh = create_hit(qname,
-                      text_name,
+                      reference_id,
                       text_offset,  // BAM files are 0-indexed
                       cigar,
                       sam_flag & 0x0010,
@@ -1128,7 +1344,7 @@ bool BAMHitFactory::get_hit_from_buf(const char* orig_bwt_buf,
       //assert(_rg_props.strandedness() == STRANDED_PROTOCOL || source_strand == CUFF_STRAND_UNKNOWN);
       //assert(cigar.size() == 1 && cigar[0].opcode == MATCH);
       bh = create_hit(qname,
-                        text_name,
+                        reference_id,
                         text_offset,  // BAM files are 0-indexed
                         cigar,
                         sam_flag & 0x0010,
@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
+#include <iostream>
 #include <map>
 #include <vector>
 #include <cassert>
@@ -61,6 +62,7 @@ struct BowtieHit
 		_antisense_aln(false),
 		_edit_dist(0),
 		_splice_mms(0),
+		_qual_penalty(0),
 		_end(false){}
 	
 	BowtieHit(uint32_t ref_id,
@@ -78,6 +80,7 @@ struct BowtieHit
 		_antisense_aln(antisense),
 		_edit_dist(edit_dist),
 		_splice_mms(0),
+		_qual_penalty(0),
 		_end(end)
 	{
 		assert(_cigar.capacity() == _cigar.size());
@@ -100,6 +103,7 @@ struct BowtieHit
 		_antisense_aln(antisense_aln),
 		_edit_dist(edit_dist),
 		_splice_mms(splice_mms),
+		_qual_penalty(0),
 		_end(end)
 	{
 		assert(_cigar.capacity() == _cigar.size());
@@ -204,6 +208,10 @@ struct BowtieHit
 
 	unsigned char edit_dist() const		{ return _edit_dist;		}
 	unsigned char splice_mms() const	{ return _splice_mms;		}
+
+	// Quality-weighted mismatch penalty, see score_hit_quals()
+	unsigned short qual_penalty() const	{ return _qual_penalty;		}
+	void qual_penalty(unsigned short p)	{ _qual_penalty = p;		}
 	
 	// For convenience, if you just want a copy of the gap intervals
 	// for this hit.
@@ -266,6 +274,7 @@ private:
   
   unsigned char _edit_dist;  // Total mismatches (note this is not including insertions or deletions as mismatches, ie, not equivalent to NM field of a SAM record)
   unsigned char _splice_mms; // Mismatches within min_anchor_len of a splice junction
+  unsigned short _qual_penalty; // Quality-weighted mismatches (0 unless --qual-scoring)
   string _hitfile_rec; // Points to the buffer for the record from which this hit came
   string _seq;
   string _qual;
@@ -282,7 +291,12 @@ public:
 	// This function should NEVER return zero
 	ReadID get_id(const string& name)
 	{
-		uint32_t _id = atoi(name.c_str());
+		return get_id(name.c_str());
+	}
+	
+	ReadID get_id(const char* name)
+	{
+		uint32_t _id = atoi(name);
 		//assert(_id);
 		_next_id = max(_next_id, (size_t)_id);
 		return _id;
@@ -363,18 +377,26 @@ public:
 					Sequence* seq,
                     uint32_t len)
 	{
-		uint32_t _id = hash_string(name.c_str());
-		pair<InvertedIDTable::iterator, bool> ret = 
-		_by_id.insert(make_pair(_id, SequenceInfo(_next_id, NULL, NULL, 0)));
-		if (ret.second == true)
-		{			
+		return get_id(name.c_str(), seq, len);
+	}
+	
+	uint32_t get_id(const char* name,
+					Sequence* seq,
+                    uint32_t len)
+	{
+		uint32_t _id = hash_string(name);
+		if (get_info(_id) == NULL)
+		{
+			pair<InvertedIDTable::iterator, bool> ret = 
+			_by_id.insert(make_pair(_id, SequenceInfo(_next_id, NULL, NULL, 0)));
 			char* _name = NULL;
 			if (_keep_names)
-				_name = strdup(name.c_str());
+				_name = strdup(name);
 			ret.first->second.name  = _name;
 			ret.first->second.seq	= seq;
             ret.first->second.len   = len;
 			++_next_id;
+			index_info(_id, &ret.first->second);
 		}
 		assert (_id);
 		return _id;
@@ -382,52 +404,41 @@ public:
 	
 	const char* get_name(uint32_t ID) const
 	{
-		InvertedIDTable::const_iterator itr = _by_id.find(ID);
-		if (itr != _by_id.end())
-			return itr->second.name;
-		else
-			return NULL;
+		const SequenceInfo* info = get_info(ID);
+		return info ? info->name : NULL;
 	}
     
     uint32_t get_len(uint32_t ID) const
 	{
-		InvertedIDTable::const_iterator itr = _by_id.find(ID);
-		if (itr != _by_id.end())
-			return itr->second.len;
-		else
-			return 0;
+		const SequenceInfo* info = get_info(ID);
+		return info ? info->len : 0;
 	}
 	
 	Sequence* get_seq(uint32_t ID) const
 	{
-		InvertedIDTable::const_iterator itr = _by_id.find(ID);
-		if (itr != _by_id.end())
-			return itr->second.seq;
-		else
-			return NULL;
+		const SequenceInfo* info = get_info(ID);
+		return info ? info->seq : NULL;
 	}
 	
+	// Ids are name hashes already, so they index the flat _slots table
+	// directly (with linear probing) instead of walking _by_id
 	const SequenceInfo* get_info(uint32_t ID) const
 	{
-		
-		InvertedIDTable::const_iterator itr = _by_id.find(ID);
-		if (itr != _by_id.end())
+		if (_slots.empty())
+			return NULL;
+		size_t mask = _slots.size() - 1;
+		for (size_t i = ID & mask; _slots[i].first != 0; i = (i + 1) & mask)
 		{
-			return &(itr->second);
+			if (_slots[i].first == ID)
+				return _slots[i].second;
 		}
-		else
-			return NULL;
+		return NULL;
 	}
 	
 	int observation_order(uint32_t ID) const
 	{
-		InvertedIDTable::const_iterator itr = _by_id.find(ID);
-		if (itr != _by_id.end())
-		{
-			return itr->second.observation_order;
-		}
-		else
-			return -1;
+		const SequenceInfo* info = get_info(ID);
+		return info ? (int)info->observation_order : -1;
 	}
 	
 	iterator begin() { return _by_id.begin(); }
@@ -442,6 +453,7 @@ public:
 	{
 		//_by_name.clear();
 		_by_id.clear();
+		_slots.clear();
 	}
 
 	// daehwan
@@ -458,13 +470,48 @@ public:
 	}
 	
 private:
+	// _slots points into _by_id, so the table can't be copied
+	RefSequenceTable(const RefSequenceTable&);
+	RefSequenceTable& operator=(const RefSequenceTable&);
+	
+	// Adds the new entry ID of _by_id to _slots, keeping the slots at
+	// most half full
+	void index_info(uint32_t ID, SequenceInfo* info)
+	{
+		if (2 * _by_id.size() > _slots.size())
+		{
+			size_t num_slots = 16;
+			while (num_slots < 4 * _by_id.size())
+				num_slots <<= 1;
+			_slots.assign(num_slots, make_pair(0U, (SequenceInfo*)NULL));
+			for (InvertedIDTable::iterator itr = _by_id.begin(); itr != _by_id.end(); ++itr)
+				add_slot(itr->first, &itr->second);
+		}
+		else
+			add_slot(ID, info);
+	}
+	
+	void add_slot(uint32_t ID, SequenceInfo* info)
+	{
+		size_t mask = _slots.size() - 1;
+		size_t i = ID & mask;
+		while (_slots[i].first != 0)
+			i = (i + 1) & mask;
+		_slots[i] = make_pair(ID, info);
+	}
 	
 	//IDTable _by_name;
 	uint32_t _next_id;
 	bool _keep_names;
 	InvertedIDTable _by_id;
+	vector<pair<uint32_t, SequenceInfo*> > _slots;
 };
 
+// Reads every record of the FASTA ref_stream into rt, naming each by the
+// first word of its header; the sequences are only kept when keep_seqs is set
+void get_seqs(istream& ref_stream,
+	      RefSequenceTable& rt,
+	      bool keep_seqs = true);
 
 bool hit_insert_id_lt(const BowtieHit& h1, const BowtieHit& h2);
 
@@ -523,14 +570,15 @@ class HitFactory {
   public:
     HitFactory(ReadTable& insert_table, 
                RefSequenceTable& reference_table) : 
-    _insert_table(insert_table), _ref_table(reference_table)
+    _insert_table(insert_table), _ref_table(reference_table),
+    _last_ref_id(0)
                  {}
     virtual ~HitFactory() {}
     virtual void openStream(HitStream& hs)=0;
     virtual void rewind(HitStream& hs)=0;
     virtual void closeStream(HitStream& hs)=0;
-    BowtieHit create_hit(const string& insert_name, 
-                 const string& ref_name,
+    BowtieHit create_hit(const char* insert_name, 
+                 const char* ref_name,
                  int left,
                  const vector<CigarOp>& cigar,
                  bool antisense_aln,
@@ -539,13 +587,46 @@ class HitFactory {
                  unsigned char splice_mms,
                  bool end);
     
-    BowtieHit create_hit(const string& insert_name, 
-                 const string& ref_name,
+    BowtieHit create_hit(const char* insert_name, 
+                 const char* ref_name,
                  uint32_t left,
                  uint32_t read_len,
                  bool antisense_aln,
                  unsigned char edit_dist,
                  bool end);
+    
+    // Same as above, for a reference whose id has already been looked up
+    BowtieHit create_hit(const char* insert_name, 
+                 uint32_t ref_id,
+                 int left,
+                 const vector<CigarOp>& cigar,
+                 bool antisense_aln,
+                 bool antisense_splice,
+                 unsigned char edit_dist,
+                 unsigned char splice_mms,
+                 bool end);
+    
+    BowtieHit create_hit(const char* insert_name, 
+                 uint32_t ref_id,
+                 uint32_t left,
+                 uint32_t read_len,
+                 bool antisense_aln,
+                 unsigned char edit_dist,
+                 bool end);
+    
+    // Returns the reference table id for ref_name.  Consecutive hits are
+    // nearly always on the same reference, so the last name looked up is
+    // remembered and a repeat costs a string compare instead of a hash 
+    // and a table lookup.
+    uint32_t ref_id(const char* ref_name)
+    {
+      if (_last_ref_id == 0 || _last_ref_name.compare(ref_name) != 0)
+        {
+          _last_ref_id = _ref_table.get_id(ref_name, NULL, 0);
+          _last_ref_name = ref_name;
+        }
+      return _last_ref_id;
+    }
   
    virtual string hitfile_rec(HitStream& hs, const char* hit_buf)=0;
    virtual bool next_record(HitStream& hs, const char*& buf, size_t& buf_size) = 0;
@@ -561,6 +642,8 @@ class HitFactory {
     ReadTable& _insert_table;
     RefSequenceTable& _ref_table;
     HitStream* _hit_stream;
+    string _last_ref_name;
+    uint32_t _last_ref_id;
 };//class HitFactory
 
 
@@ -640,6 +723,50 @@ class SAMHitFactory : public LineHitFactory {
 /******************************************************************************
  BAMHitFactory turns SAM alignments into BowtieHits
  *******************************************************************************/
+/*
+ * Reads the records of one SAM/BAM file on a helper thread, one batch
+ * ahead of the consumer, so decompression and record decoding overlap with
+ * whatever the caller does with each hit.  The two batches are swapped
+ * between the threads and their bam1_t buffers are reused, so steady-state
+ * reading does no allocation.
+ */
+class BAMReadAhead
+{
+public:
+  BAMReadAhead(samfile_t* sam_file);
+  ~BAMReadAhead();
+
+  // Returns the next record and sets bytes to the size samread() reported
+  // for it, or returns NULL at the end of the file.  The record stays valid
+  // until the following call.
+  bam1_t* next(int& bytes);
+
+private:
+  static const size_t batch_size = 256;
+
+  struct Batch
+  {
+    Batch() : count(0), full(false) {}
+    vector<bam1_t*> recs;
+    vector<int> bytes;
+    size_t count;
+    bool full;
+  };
+
+  static void* fill_thread(void* read_ahead);
+  void fill_batches();
+
+  samfile_t* _sam_file;
+  Batch _batches[2];
+  int _curr;        // batch being drained by the consumer
+  size_t _pos;      // next record in the current batch
+  bool _draining;   // the consumer holds the current batch
+  bool _stop;
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  pthread_t _thread;
+};
+
 class BAMHitFactory : public HitFactory {
   public:
 
@@ -648,8 +775,16 @@ class BAMHitFactory : public HitFactory {
         HitFactory(insert_table, reference_table)
         {
          _sam_header=NULL;
+         _tid_header=NULL;
+         _tid_ids=NULL;
+         memset(&_next_hit, 0, sizeof(_next_hit));
         }
+    ~BAMHitFactory();
     void openStream(HitStream& hs);
+
+    // Sets the header used by get_hit_from_buf() for records that were
+    // read outside of a HitStream (e.g. handed over by another thread)
+    void set_header(bam_header_t* header) { _sam_header = header; }
     void rewind(HitStream& hs);
     void closeStream(HitStream& hs);
 
@@ -679,9 +814,19 @@ class BAMHitFactory : public HitFactory {
 private:
 	//int64_t _curr_pos;
 	//int64_t _beginning;
-	bam1_t _next_hit; 
+	bam1_t _next_hit; // reused record buffer, grown by samread() as needed
 	bam_header_t* _sam_header;
     bool inspect_header(HitStream& hs);
+
+    // Read-ahead readers by open samfile_t*, used when num_cpus > 1
+    map<void*, BAMReadAhead*> _read_aheads;
+    
+    // Reference table ids by BAM target id (0 until looked up), for each
+    // open stream's header; _tid_ids are the ones of _tid_header
+    uint32_t ref_id_for_tid(int tid);
+    map<bam_header_t*, vector<uint32_t> > _tid_ref_ids;
+    bam_header_t* _tid_header;
+    vector<uint32_t>* _tid_ids;
 };
 
 
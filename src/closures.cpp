@@ -155,10 +155,16 @@ class CovMapIntronFinder
   std::set<SpliceMotif> _tmp_hits;
   vector<SpliceMotif> _hits;
   RefSequenceTable::Sequence* _ref_seq;
+  uint32_t _ref_id;
+  const SpliceMotifIndex* _motifs;
 public:
-  CovMapIntronFinder() : _ref_seq(NULL) {}
-  CovMapIntronFinder(RefSequenceTable::Sequence* ref_seq) : 
+  CovMapIntronFinder() : _ref_seq(NULL), _ref_id(0), _motifs(NULL) {}
+  CovMapIntronFinder(RefSequenceTable::Sequence* ref_seq,
+		     uint32_t ref_id = 0,
+		     const SpliceMotifIndex* motifs = NULL) : 
     _ref_seq(ref_seq), 
+    _ref_id(ref_id),
+    _motifs(motifs),
     _lms(vector<bool>(length(*ref_seq), false)),
     _rms(vector<bool>(length(*ref_seq), false)){}
   
@@ -168,8 +174,29 @@ public:
 			    const string& right_motif)
   {
     size_t l_start = max(0,left); 
+    int l_end = min(right, (int)length(*_ref_seq) - 2);
+    if ((int)l_start >= l_end)
+      return;
+
+    int left_id = splice_motif_id(left_motif);
+    int right_id = splice_motif_id(right_motif);
+    if (_motifs && left_id >= 0 && right_id >= 0 && left_id != right_id &&
+	_motifs->has_ref(_ref_id, length(*_ref_seq)))
+      {
+	vector<uint32_t> positions;
+	_motifs->find(_ref_id, left_id, l_start, l_end, positions);
+	for (size_t p = 0; p < positions.size(); ++p)
+	  _lms[positions[p]] = true;
+
+	positions.clear();
+	_motifs->find(_ref_id, right_id, l_start, l_end, positions);
+	for (size_t p = 0; p < positions.size(); ++p)
+	  _rms[positions[p]] = true;
+	return;
+      }
+
     for (int i = l_start; 
-	 i < min(right, (int)length(*_ref_seq) - 2); 
+	 i < l_end; 
 	 ++i)
       {
 	seqan::Infix<RefSequenceTable::Sequence>::Type curr
@@ -226,26 +253,24 @@ class CoverageMapVisitor
 {
 public:
   map<uint32_t, RefCIF> finders;
+  SpliceMotifIndex motifs;
   
   CoverageMapVisitor(istream& ref_stream, 
+		     const string& ref_fasta,
 		     RefSequenceTable& rt)
   {
+    get_seqs(ref_stream, rt, true);
+    load_splice_motif_index(motifs, ref_fasta, rt);
     
-    while(ref_stream.good() && 
-	  !ref_stream.eof()) 
+    for (RefSequenceTable::iterator itr = rt.begin(); itr != rt.end(); ++itr)
       {
-	RefSequenceTable::Sequence* ref_str = new RefSequenceTable::Sequence;
-	string name;
-	readMeta(ref_stream, name, Fasta());
-	string::size_type space_pos = name.find_first_of(" \t\r");
-	if (space_pos != string::npos)
-	  {
-	    name.resize(space_pos);
-	  }
-	read(ref_stream, *ref_str, Fasta());
-	
-	uint32_t ref_id = rt.get_id(name, NULL, 0);
-	finders[ref_id] = RefCIF(CIF(ref_str), CIF(ref_str), ref_str);
+	RefSequenceTable::Sequence* ref_str = itr->second.seq;
+	if (ref_str == NULL)
+	  continue;
+	uint32_t ref_id = itr->first;
+	finders[ref_id] = RefCIF(CIF(ref_str, ref_id, &motifs), 
+				 CIF(ref_str, ref_id, &motifs), 
+				 ref_str);
       }
   }
   
@@ -408,6 +433,29 @@ public:
       }
   }
   
+  ~JunctionMapVisitor()
+  {
+    for (map<uint32_t, pair<JunctionTable, JunctionTable> >::iterator itr = _finders.begin();
+	 itr != _finders.end();
+	 ++itr)
+      {
+	delete itr->second.first.jf;
+	delete itr->second.second.jf;
+      }
+  }
+  
+  // Adds the number of pairs this visitor searched and closed to the totals
+  void add_counts(uint32_t& num_searched, uint32_t& num_closed) const
+  {
+    for (map<uint32_t, pair<JunctionTable, JunctionTable> >::const_iterator itr = _finders.begin();
+	 itr != _finders.end();
+	 ++itr)
+      {
+	num_searched += itr->second.first.jf->searched() + itr->second.second.jf->searched();
+	num_closed += itr->second.first.jf->closed() + itr->second.second.jf->closed();
+      }
+  }
+  
   
   void visit(BestPairingHits& pairings)
   {
@@ -437,20 +485,67 @@ public:
   }
 };
 
+typedef vector<pair<HitsForRead, HitsForRead> > ReadPairBatch;
+
+// Searches for closures of every num_workers-th pair in a batch, starting
+// with first_pair.  Each worker has its own visitor, so the junction finders
+// and the junction sets they fill are never shared between threads.
+struct ClosureSearchWorker
+{
+  ClosureSearchWorker(JunctionMapVisitor* _visitor,
+		      ReadPairBatch* _batch,
+		      size_t _first_pair,
+		      size_t _num_workers) :
+    visitor(_visitor),
+    batch(_batch),
+    first_pair(_first_pair),
+    num_workers(_num_workers) {}
+  
+  void operator()()
+  {
+    for (size_t i = first_pair; i < batch->size(); i += num_workers)
+      visit_best_pairing((*batch)[i].first, (*batch)[i].second, *visitor);
+  }
+  
+  JunctionMapVisitor* visitor;
+  ReadPairBatch* batch;
+  size_t first_pair;
+  size_t num_workers;
+};
+
+void search_closure_batch(vector<JunctionMapVisitor*>& visitors,
+			  ReadPairBatch& batch)
+{
+  vector<ClosureSearchWorker> workers;
+  for (size_t i = 0; i < visitors.size(); ++i)
+    workers.push_back(ClosureSearchWorker(visitors[i], &batch, i, visitors.size()));
+  run_tasks(workers);
+  batch.clear();
+}
+
+void merge_closure_juncs(ClosureJunctionSet& juncs,
+			 const ClosureJunctionSet& thread_juncs)
+{
+  juncs.insert(thread_juncs.begin(), thread_juncs.end());
+  while (juncs.size() > max_strand_closure_juncs)
+    juncs.erase(*juncs.rbegin());
+}
+
 void closure_driver(vector<FZPipe>& map1, 
 		    vector<FZPipe>& map2, 
 		    ifstream& ref_stream, 
+		    const string& ref_fasta,
 		    FILE* juncs_file)
 {
   typedef RefSequenceTable::Sequence Reference;
   
   ReadTable it;
-  RefSequenceTable rt(true);
+  RefSequenceTable rt(true, true);
   
   BowtieHitFactory hit_factory(it,rt);
   
   fprintf (stderr, "Finding near-covered motifs...");
-  CoverageMapVisitor cov_map_visitor(ref_stream, rt);
+  CoverageMapVisitor cov_map_visitor(ref_stream, ref_fasta, rt);
   uint32_t coverage_attempts = 0;
   
   assert(map1.size() == map2.size());
@@ -511,7 +606,23 @@ void closure_driver(vector<FZPipe>& map1,
   ClosureJunctionSet fwd_splices;
   ClosureJunctionSet rev_splices;
   
-  JunctionMapVisitor junc_map_visitor(fwd_splices, rev_splices, cov_map_visitor.finders);
+  // The second pass reads pairs on this thread in batches and searches
+  // them on num_cpus threads, each with its own junction sets.
+  int num_workers = max(num_cpus, 1);
+  vector<ClosureJunctionSet> thread_fwd_splices(num_workers);
+  vector<ClosureJunctionSet> thread_rev_splices(num_workers);
+  vector<JunctionMapVisitor*> junc_map_visitors;
+  for (int i = 0; i < num_workers; ++i)
+    {
+      junc_map_visitors.push_back(new JunctionMapVisitor(thread_fwd_splices[i], 
+							 thread_rev_splices[i], 
+							 cov_map_visitor.finders));
+    }
+  
+  static const size_t closure_batch_size = 50000;
+  ReadPairBatch batch;
+  batch.reserve(closure_batch_size);
+  
   fprintf (stderr, "Searching for closures...");
   uint32_t closure_attempts = 0;
   
@@ -558,7 +669,9 @@ void closure_driver(vector<FZPipe>& map1,
 	    {	
 	      if (closure_attempts++ % 1000 == 0)
 		fprintf (stderr, "Trying to close pair %d\n", closure_attempts); 
-	      visit_best_pairing(curr_left_hit_group, curr_right_hit_group, junc_map_visitor);
+	      batch.push_back(make_pair(curr_left_hit_group, curr_right_hit_group));
+	      if (batch.size() == closure_batch_size)
+		search_closure_batch(junc_map_visitors, batch);
 	      left_hs.next_read_hits(curr_left_hit_group);
 	      curr_left_obs_order = it.observation_order(curr_left_hit_group.insert_id);
 	      
@@ -568,21 +681,28 @@ void closure_driver(vector<FZPipe>& map1,
 	}
     }
 
+  search_closure_batch(junc_map_visitors, batch);
+
   for (size_t num = 0; num < map1.size(); ++num)
     {
       map1[num].close();
       map2[num].close();
     }
   
+  for (int i = 0; i < num_workers; ++i)
+    {
+      merge_closure_juncs(fwd_splices, thread_fwd_splices[i]);
+      merge_closure_juncs(rev_splices, thread_rev_splices[i]);
+      junc_map_visitors[i]->add_counts(searched, closed);
+      delete junc_map_visitors[i];
+    }
+  
   fprintf(stderr, "%lu Forward strand splices\n", fwd_splices.size());
   fprintf(stderr, "%lu Reverse strand splices\n", rev_splices.size());
   
   fprintf (stderr, "done\n");
   uint32_t num_potential_splices = 0;
   fprintf (stderr, "Reporting possible junctions...");
-  map<uint32_t, pair<JunctionMapVisitor::JunctionTable, JunctionMapVisitor::JunctionTable> >::iterator f_itr;
-  f_itr = junc_map_visitor._finders.begin();
-  
   ClosureJunctionSet::iterator j_itr;
   j_itr = fwd_splices.begin();
   while (j_itr != fwd_splices.end())
@@ -663,6 +783,7 @@ int main(int argc, char** argv)
 		  left_file_names[i].c_str());
 	  exit(1);
         }
+      seg_file.spool();
       left_files.push_back(seg_file);
     }
 
@@ -685,6 +806,7 @@ int main(int argc, char** argv)
 		  right_file_names[i].c_str());
 	  exit(1);
 	}
+      seg_file.spool();
       right_files.push_back(seg_file);
     }
 
@@ -701,6 +823,7 @@ int main(int argc, char** argv)
   closure_driver(left_files,
 		 right_files,
 		 ref_stream,
+		 ref_fasta,
 		 splice_db);
   
   return 0;
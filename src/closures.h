@@ -17,6 +17,7 @@
 
 #include "common.h"
 #include "junctions.h"
+#include "splice_motifs.h"
 
 struct SpliceMotif
 {
@@ -61,7 +62,7 @@ public:
 		}
 	}
 	
-	const vector<size_t>& hits() const { return _hits; }
+	const vector<SpliceMotif>& hits() const { return _hits; }
 };
 
 uint32_t searched = 0;
@@ -69,10 +70,96 @@ uint32_t closed = 0;
 
 typedef std::set<Junction, skip_count_lt > ClosureJunctionSet;
 
+// The most junctions kept from a single strand
+static const uint32_t max_strand_closure_juncs = 7500000;
+
+/*
+ Short-term memo for the closure search: for each motif, the path 
+ distances to the search target already found from it.  All the lists share
+ one pool of entries that is reused from search to search, and a list only
+ counts as non-empty if it was stamped with the current generation, so 
+ starting a new search doesn't have to touch the per-motif slots at all.
+ */
+class ClosureMemo
+{
+public:
+	ClosureMemo() : _generation(0) {}
+	
+	void resize(size_t num_motifs) { _slots.resize(num_motifs); }
+	
+	void new_generation()
+	{
+		_pool.clear();
+		if (++_generation == 0)
+		{
+			fill(_slots.begin(), _slots.end(), Slot());
+			_generation = 1;
+		}
+	}
+	
+	void push_back(size_t motif, int dist)
+	{
+		Slot& slot = _slots[motif];
+		int entry = _pool.size();
+		_pool.push_back(Entry(dist));
+		if (slot.generation != _generation)
+		{
+			slot.generation = _generation;
+			slot.head = entry;
+		}
+		else
+		{
+			_pool[slot.tail].next = entry;
+		}
+		slot.tail = entry;
+	}
+	
+	// Returns the first distance from motif that brings a path of length 
+	// curr_path_distance within tolerance of target_path_distance, or -1
+	int check(size_t motif, 
+			  int curr_path_distance, 
+			  int target_path_distance,
+			  int tolerance) const
+	{
+		const Slot& slot = _slots[motif];
+		if (slot.generation != _generation)
+			return -1;
+		for (int e = slot.head; e != -1; e = _pool[e].next)
+		{
+			int dist = _pool[e].dist;
+			if (abs(curr_path_distance + dist - target_path_distance) < tolerance)
+				return dist;
+		}
+		return -1;
+	}
+	
+private:
+	struct Slot
+	{
+		Slot() : generation(0), head(-1), tail(-1) {}
+		uint32_t generation;
+		int head;
+		int tail;
+	};
+	
+	struct Entry
+	{
+		Entry(int d) : dist(d), next(-1) {}
+		int dist;
+		int next;
+	};
+	
+	vector<Slot> _slots;
+	vector<Entry> _pool;
+	uint32_t _generation;
+};
+
 template<typename TStr, typename IntronFinder>
 class JunctionFinder
 {
 public:
+	// The intron finder's motif hits are referenced, not copied, so it 
+	// has to outlive the JunctionFinder.
 	JunctionFinder(const IntronFinder& intron_finder,
 				   uint32_t inner_dist_mean,
 				   uint32_t inner_dist_std_dev,
@@ -80,7 +167,7 @@ public:
 				   uint32_t min_exon_length,
 				   uint32_t bowtie_overlap_padding = 0, 
 				   uint32_t max_gap = 0,
-				   uint32_t max_juncs = 7500000 /*this is the max juncs from a single strand*/) :
+				   uint32_t max_juncs = max_strand_closure_juncs) :
 	_inner_dist_mean(inner_dist_mean),
 	_inner_dist_std_dev(inner_dist_std_dev),
 	_min_intron_len(min_intron_length),
@@ -88,7 +175,9 @@ public:
 	_motif_hits(intron_finder.hits()),
 	_padding(bowtie_overlap_padding),
 	_max_gap(max_gap),
-	_max_juncs(max_juncs)
+	_max_juncs(max_juncs),
+	_searched(0),
+	_closed(0)
 	{
 		_left_memo.resize(_motif_hits.size());
 		_right_memo.resize(_motif_hits.size());
@@ -134,16 +223,19 @@ public:
 		if (abs(inner_dist - expected_inner_dist) <= (int)_inner_dist_std_dev)
 			return;
 		
-		++searched;
+		++_searched;
 		
 		if (search(potential_splices, h1.ref_id(), minor_hit_end, major_hit_start, expected_inner_dist))
-			++closed;
+			++_closed;
 	}
+	
+	uint32_t searched() const { return _searched; }
+	uint32_t closed() const { return _closed; }
 		
 private:
 	
-	vector<SpliceMotif>::const_iterator _motif_upper_bound;
-	vector<SpliceMotif>::const_iterator _motif_lower_bound;
+	size_t _motif_upper_bound;
+	size_t _motif_lower_bound;
 	
 	/* The following computation identifies possible splice sites.
 	 
@@ -186,14 +278,15 @@ private:
 	 possible 'closure' if its length is approximately equal to the expected
 	 inner distance between mate pairs for this library.
 	 
-	 To actually perform the search, this class uses two recursive functions
-	 that call each other in an alternating fashion.  search_hop_left_motif takes
-	 a genomic coordinate lstart and finds paths to ref_target that start with 
-	 a "GT" that occurs in (lstart, ref_target].  search_hop_right_motif takes a 
-	 genomic coordinate rstart and finds paths to ref_target that start with an 
-	 "AG" that occurs in (rstart, ref_target].  A valid path from start to 
-	 ref_target must have a "GT" on the left and an "AG" on the right, so valid 
-	 paths may only be found in a call to search_hop_right_motif. 
+	 To actually perform the search, this class alternates between two kinds
+	 of hops, kept on an explicit stack of SearchFrames so that dense motif 
+	 regions can't overflow the call stack.  hop_left_motif takes a genomic 
+	 coordinate lstart and finds paths to ref_target that start with a "GT"
+	 that occurs in (lstart, ref_target].  hop_right_motif takes a genomic 
+	 coordinate rstart and finds paths to ref_target that start with an "AG"
+	 that occurs in (rstart, ref_target].  A valid path from start to 
+	 ref_target must have a "GT" on the left and an "AG" on the right, so 
+	 valid paths may only be found in a right hop. 
 	 
 	 */
 	
@@ -212,51 +305,29 @@ private:
 		
 		_motif_lower_bound = lower_bound(_motif_hits.begin(), 
 										 _motif_hits.end(), 
-										 left_start);
+										 left_start) - _motif_hits.begin();
 		
 		_motif_upper_bound = upper_bound(_motif_hits.begin(), 
 										 _motif_hits.end(), 
-										 right_end);
+										 right_end) - _motif_hits.begin();
 		
 		//fprintf(stderr, "Curr junctions = %d\n", splices.size());
 		
 		/* TODO: consider some kind of long-term memo.  Closures found at the
-		 top level of recursion here can be saved and potentially reused in 
+		 top level of the search here can be saved and potentially reused in 
 		 future searches on overlapping intervals.
 		 */
-		bool c = false;
-		if (search_hop_left_motif(splices,
-								  ref_id,
-								  _motif_lower_bound, 
-								  right_end_pos, 
-								  expected_inner_dist, 
-								  0,
-								  true) != -1)
-			c = true;
-		
-		/* Clear left short-term memo */
-		vector<vector<int> >::iterator _lm_begin = _left_memo.begin() + 
-		(_motif_lower_bound - _motif_hits.begin());
-		
-		vector<vector<int> >::iterator _lm_end = _left_memo.begin() + 
-		(_motif_upper_bound - _motif_hits.begin()) + 1;
-		
-		_lm_end = min(_lm_end, _left_memo.end());
-		
-		/* Clear right short-term memo */
-		vector<vector<int> >::iterator _rm_begin = _right_memo.begin() + 
-		(_motif_lower_bound - _motif_hits.begin());
-		
-		vector<vector<int> >::iterator _rm_end = _right_memo.begin() + 
-		(_motif_upper_bound - _motif_hits.begin()) + 1;
 		
-		_rm_end = min(_rm_end, _right_memo.end());
+		// Starting a new generation empties the short-term memos
+		_left_memo.new_generation();
+		_right_memo.new_generation();
 		
-		if (_lm_begin < _lm_end)
-			fill(_lm_begin, _lm_end, vector<int>());
-		
-		if (_rm_begin < _rm_end)
-			fill(_rm_begin, _rm_end, vector<int>());
+		bool c = false;
+		if (search_hops(splices,
+						ref_id,
+						right_end_pos, 
+						expected_inner_dist) != -1)
+			c = true;
 		
 		while(splices.size() > _max_juncs)
 		{
@@ -266,196 +337,230 @@ private:
 		return c;
 	}
 	
-	inline int _abs(int x)
+	/*
+	 A pending call of the search: a hop from the motif at index start, with
+	 the path length accumulated so far.  next is the index of the motif 
+	 the hop is currently looking at, which, while the frame has a child
+	 on the stack, is the motif the child hop starts from.
+	 */
+	struct SearchFrame
 	{
-		return (x > 0) ? x : -x;
-	}
+		SearchFrame(bool left, size_t s, int path_length, bool initial) :
+			left_hop(left), initial_hop(initial), entered(false), 
+			start(s), next(0), curr_path_length(path_length), 
+			in_valid_path(-1) {}
+		
+		bool left_hop;
+		bool initial_hop;
+		bool entered;
+		size_t start;
+		size_t next;
+		int curr_path_length;
+		int in_valid_path;
+	};
 	
-	inline int check_memo(const vector<vector<int> >& memo, 
-						  size_t motif_pos, 
-						  int curr_path_distance, 
-						  int target_path_distance,
-						  int tolerance)
+	// Runs the alternating left/right hops from _motif_lower_bound with an 
+	// explicit stack, returning what the initial left hop would have.
+	int search_hops(ClosureJunctionSet& splices,
+					uint32_t ref_id,
+					int ref_target,
+					int expected_inner_dist)
 	{
-		const vector<int>& distances = memo[motif_pos];
-		for (size_t i = 0; i < distances.size(); ++i)
+		_frames.clear();
+		_frames.push_back(SearchFrame(true, _motif_lower_bound, 0, true));
+		
+		SearchFrame child(false, 0, 0, false);
+		bool child_returned = false;
+		int child_ret = -1;
+		
+		while (!_frames.empty())
 		{
-			int dist = distances[i];
-			if (_abs(curr_path_distance + dist - target_path_distance) < tolerance)
-				return dist;
+			SearchFrame& f = _frames.back();
+			bool descend;
+			if (f.left_hop)
+				descend = hop_left_motif(f, ref_target, expected_inner_dist,
+										 child_returned, child_ret, child);
+			else
+				descend = hop_right_motif(splices, ref_id, f, ref_target, 
+										  expected_inner_dist,
+										  child_returned, child_ret, child);
+			if (descend)
+			{
+				_frames.push_back(child);
+				child_returned = false;
+			}
+			else
+			{
+				child_ret = f.in_valid_path;
+				child_returned = true;
+				_frames.pop_back();
+			}
 		}
-		return -1;
+		
+		return child_ret;
 	}
 	
-	int search_hop_left_motif(ClosureJunctionSet& splices,
-							  uint32_t ref_id,
-							  vector<SpliceMotif>::const_iterator start, 
-							  int ref_target,
-							  int expected_inner_dist,
-							  uint32_t curr_path_length,
-							  bool initial_hop = false)
+	// Advances a left hop: looks for a "GT" after f.start and continues 
+	// with a right hop from it.  Returns true, with the hop to take in 
+	// child, when the frame has to wait on another hop, and false once 
+	// f.in_valid_path is final.
+	bool hop_left_motif(SearchFrame& f,
+						int ref_target,
+						int expected_inner_dist,
+						bool child_returned,
+						int child_ret,
+						SearchFrame& child)
 	{
-		int in_valid_path = -1;
-//		SpliceMotif left_bound(start + (initial_hop ? 0 : _min_exon_len), true);
-//		SpliceMotif right_bound(start + (expected_inner_dist - curr_path_length) + (2 * _padding) + _max_gap, true);
-		
-		vector<SpliceMotif>::const_iterator lb_left = start;
+		size_t num_hits = _motif_hits.size();
+		int tolerance = _inner_dist_std_dev +  2 * _padding + _max_gap;
 		
-		while (lb_left <= _motif_upper_bound && 
-			   lb_left < _motif_hits.end() &&
-			   (lb_left->pos - start->pos < (initial_hop ? 0 :(int) _min_exon_len)  || !lb_left->left_motif))
+		if (!f.entered)
 		{
-			lb_left++;
+			f.entered = true;
+			size_t lb_left = f.start;
+			while (lb_left <= _motif_upper_bound && 
+				   lb_left < num_hits &&
+				   (_motif_hits[lb_left].pos - _motif_hits[f.start].pos < (f.initial_hop ? 0 :(int) _min_exon_len)  || 
+					!_motif_hits[lb_left].left_motif))
+			{
+				lb_left++;
+			}
+			f.next = lb_left;
+		}
+		else if (child_returned)
+		{
+			if (child_ret != -1)
+			{
+				int dist = (int)_motif_hits[f.next].pos - (int)_motif_hits[f.start].pos;
+				f.in_valid_path = child_ret + dist;
+				_left_memo.push_back(f.next, f.in_valid_path);
+			}
+			++f.next;
 		}
 		
-		
-		for (vector<SpliceMotif>::const_iterator li = lb_left; 
-			 li != _motif_hits.end(); 
-			 ++li)
+		for (; f.next < num_hits; ++f.next)
 		{
-			if (!li->left_motif) //skip over the right motifs
+			const SpliceMotif& li = _motif_hits[f.next];
+			if (!li.left_motif) //skip over the right motifs
 				continue;
-			//assert (*li >= SpliceMotif(start, true) || initial_hop);
-			int dist = (int)li->pos - (int)start->pos;
-			int next_path_len = curr_path_length + dist;
-			
-			int tolerance = _inner_dist_std_dev +  2 * _padding + _max_gap;
+			int dist = (int)li.pos - (int)_motif_hits[f.start].pos;
+			int next_path_len = f.curr_path_length + dist;
 			
 			if (next_path_len - expected_inner_dist > tolerance)
-			{
-				return in_valid_path;
-			}
+				return false;
 			
-			int next = li->pos;
-			//assert(next + _min_intron_len <= ref_target);
+			int next = li.pos;
 			if(next + (int)_min_intron_len <= ref_target)
 			{
-				int ret = -1;
-				ret = check_memo(_left_memo, 
-								 li - _motif_hits.begin(), 
-								 curr_path_length + dist, 
-								 expected_inner_dist, 
-								 tolerance);
+				int ret = _left_memo.check(f.next, 
+										   next_path_len, 
+										   expected_inner_dist, 
+										   tolerance);
 				if (ret != -1)
 				{
-					in_valid_path = ret + dist;
-					_left_memo[li - _motif_hits.begin()].push_back(in_valid_path);
+					f.in_valid_path = ret + dist;
+					_left_memo.push_back(f.next, f.in_valid_path);
 				}
 				else
 				{
-					ret = search_hop_right_motif(splices,
-												 ref_id,
-												 li,
-												 ref_target,
-												 expected_inner_dist,
-												 next_path_len);
-					if (ret != -1)
-					{
-						in_valid_path = ret + dist;
-						_left_memo[li - _motif_hits.begin()].push_back(in_valid_path);
-					}
+					child = SearchFrame(false, f.next, next_path_len, false);
+					return true;
 				}
 			}
-			
 		}
 		
-		return in_valid_path;
-		
+		return false;
 	}
 	
-	int search_hop_right_motif(ClosureJunctionSet& splices,
-							   uint32_t ref_id,
-							   vector<SpliceMotif>::const_iterator start, 
-							   int ref_target,
-							   int expected_inner_dist,
-							   uint32_t curr_path_length)
+	// Advances a right hop: looks for an "AG" after f.start that either 
+	// closes the path at ref_target or continues it with a left hop, and
+	// records the junction ending at each one that works.  Returns as 
+	// hop_left_motif does.
+	bool hop_right_motif(ClosureJunctionSet& splices,
+						 uint32_t ref_id,
+						 SearchFrame& f,
+						 int ref_target,
+						 int expected_inner_dist,
+						 bool child_returned,
+						 int child_ret,
+						 SearchFrame& child)
 	{
-		int in_valid_path = -1;
+		size_t num_hits = _motif_hits.size();
+		int tolerance = _inner_dist_std_dev +  2 * _padding + _max_gap;
+		int start_pos = _motif_hits[f.start].pos;
 		
-//		SpliceMotif left_start(start + _min_intron_len - 2, false);
-//		SpliceMotif right_start(ref_target, false);
-		if (ref_target < start->pos)
+		if (!f.entered)
 		{
-			return in_valid_path;
+			f.entered = true;
+			if (ref_target < start_pos)
+				return false;
+			
+			size_t lb_right = f.start;
+			while (lb_right <= _motif_upper_bound && 
+				   lb_right < num_hits &&
+				   (_motif_hits[lb_right].pos - start_pos < (int)_min_intron_len - 2 || 
+					_motif_hits[lb_right].left_motif))
+			{
+				lb_right++;
+			}
+			f.next = lb_right;
 		}
-		vector<SpliceMotif>::const_iterator lb_right = start;
-		while (lb_right <= _motif_upper_bound && 
-			   lb_right < _motif_hits.end() &&
-			   (lb_right->pos - start->pos < (int)_min_intron_len - 2 || lb_right->left_motif))
+		else if (child_returned)
 		{
-			lb_right++;
+			if (child_ret != -1)
+			{
+				int next = _motif_hits[f.next].pos + 2;
+				splices.insert(Junction(ref_id,
+										start_pos - 1,
+										next,
+										false,
+										start_pos - 1 - next));
+				f.in_valid_path = child_ret;
+				_right_memo.push_back(f.next, child_ret);
+			}
+			++f.next;
 		}
-			
-		for (vector<SpliceMotif>::const_iterator ri = lb_right; 
-			 ri != _motif_hits.end(); 
-			 ++ri)
+		
+		for (; f.next < num_hits; ++f.next)
 		{
-			if (ri->left_motif) //skip over the left motifs
+			const SpliceMotif& ri = _motif_hits[f.next];
+			if (ri.left_motif) //skip over the left motifs
 				continue;
-			if (ri->pos > ref_target)
-			{
-				return in_valid_path;
-			}
-			int next = ri->pos + 2;
-			int final_hop_dist = (int)ref_target - (int)next;
-			int final_path_len = curr_path_length + final_hop_dist;
+			if (ri.pos > ref_target)
+				return false;
 			
-			int tolerance = _inner_dist_std_dev +  2 * _padding + _max_gap;
+			int next = ri.pos + 2;
+			int final_hop_dist = (int)ref_target - (int)next;
+			int final_path_len = f.curr_path_length + final_hop_dist;
 			
+			int ret;
 			if (abs(expected_inner_dist - final_path_len) <= tolerance)
 			{
-				splices.insert(Junction(ref_id,
-										start->pos - 1,
-										next,
-										false,
-										start->pos - 1 - next));
-				in_valid_path = final_hop_dist;
-				_right_memo[ri - _motif_hits.begin()].push_back(final_hop_dist);
+				ret = final_hop_dist;
 			}
 			else 
 			{
-				int ret = -1;
-				ret = check_memo(_right_memo, 
-								 ri - _motif_hits.begin(), 
-								 curr_path_length, 
-								 expected_inner_dist, 
-								 tolerance);
-				if (ret != -1)
+				ret = _right_memo.check(f.next, 
+										f.curr_path_length, 
+										expected_inner_dist, 
+										tolerance);
+				if (ret == -1)
 				{
-					splices.insert(Junction(ref_id,
-											start->pos - 1,
-											next,
-											false,
-											start->pos - 1 - next));
-					
-					in_valid_path = ret;
-					_right_memo[ri - _motif_hits.begin()].push_back(ret);
-				}
-				else
-				{
-					
-					ret = search_hop_left_motif(splices,
-												ref_id,
-												ri,
-												ref_target,
-												expected_inner_dist,
-												curr_path_length);
-					if (ret != -1)
-					{
-						splices.insert(Junction(ref_id,
-												start->pos - 1,
-												next,
-												false,
-												start->pos - 1 - next));
-						
-						in_valid_path = ret;
-						_right_memo[ri - _motif_hits.begin()].push_back(in_valid_path);
-					}
+					child = SearchFrame(true, f.next, f.curr_path_length, false);
+					return true;
 				}
 			}
+			
+			splices.insert(Junction(ref_id,
+									start_pos - 1,
+									next,
+									false,
+									start_pos - 1 - next));
+			f.in_valid_path = ret;
+			_right_memo.push_back(f.next, ret);
 		}
 		
-		return in_valid_path;
+		return false;
 	}
 	
 	uint32_t _inner_dist_mean;
@@ -463,14 +568,18 @@ private:
 	uint32_t _min_intron_len;
 	uint32_t _min_exon_len;
 	
-	vector<SpliceMotif> _motif_hits;
+	const vector<SpliceMotif>& _motif_hits;
 	uint32_t _padding;
 	uint32_t _max_gap;
 	uint32_t _max_juncs;
-	vector<vector<int> > _left_memo;
-	vector<vector<int> > _right_memo;
+	ClosureMemo _left_memo;
+	ClosureMemo _right_memo;
+	vector<SearchFrame> _frames;
+	uint32_t _searched;
+	uint32_t _closed;
 };
 
+
 typedef std::set<pair<size_t, size_t> > CoordSet;
 void check_mates(const HitList& hits1_in_ref,
 				 const HitList& hits2_in_ref,
@@ -14,7 +14,12 @@
 #include <iostream>
 #include <sstream>
 #include <cstdarg>
+#include <cstdlib>
+#include <map>
+#include <unistd.h>
 #include <getopt.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
 #include "common.h"
 
@@ -135,6 +140,26 @@ bool color_out = false;
 
 string gtf_juncs = "";
 
+string junction_store = "";
+int min_junc_support = 0;
+
+eQUAL_SCORING qual_scoring = QUAL_SCORING_NONE;
+string reference_fasta = "";
+
+uint32_t read_id_first = 0;
+uint32_t read_id_last = VMAXINT32;
+
+string accepted_juncs = "";
+bool filter_juncs_only = false;
+bool merge_chunks = false;
+
+string flank_cache = "";
+int annotated_juncs = 0;
+
+int sample_reads = 0;
+
+int bam_compression_level = -1;
+
 string flt_reads = "";
 string flt_mappings = "";
 
@@ -274,7 +299,19 @@ enum
     OPT_AUX_OUT,
     OPT_GTF_JUNCS,
     OPT_FILTER_READS,
-    OPT_FILTER_HITS
+    OPT_FILTER_HITS,
+    OPT_JUNCTION_STORE,
+    OPT_MIN_JUNC_SUPPORT,
+    OPT_QUAL_SCORING,
+    OPT_REFERENCE_FASTA,
+    OPT_READ_IDS,
+    OPT_ACCEPTED_JUNCS,
+    OPT_FILTER_JUNCS_ONLY,
+    OPT_MERGE_CHUNKS,
+    OPT_FLANK_CACHE,
+    OPT_ANNOTATED_JUNCS,
+    OPT_SAMPLE_READS,
+    OPT_BAM_COMPRESSION_LEVEL
   };
 
 static struct option long_options[] = {
@@ -325,6 +362,18 @@ static struct option long_options[] = {
 {"gtf-juncs", required_argument, 0, OPT_GTF_JUNCS},
 {"flt-reads",required_argument, 0, OPT_FILTER_READS},
 {"flt-hits",required_argument, 0, OPT_FILTER_HITS},
+{"junction-store", required_argument, 0, OPT_JUNCTION_STORE},
+{"min-junc-support", required_argument, 0, OPT_MIN_JUNC_SUPPORT},
+{"qual-scoring", required_argument, 0, OPT_QUAL_SCORING},
+{"reference-fasta", required_argument, 0, OPT_REFERENCE_FASTA},
+{"read-ids", required_argument, 0, OPT_READ_IDS},
+{"accepted-juncs", required_argument, 0, OPT_ACCEPTED_JUNCS},
+{"filter-juncs-only", no_argument, 0, OPT_FILTER_JUNCS_ONLY},
+{"merge-chunks", no_argument, 0, OPT_MERGE_CHUNKS},
+{"flank-cache", required_argument, 0, OPT_FLANK_CACHE},
+{"annotated-juncs", required_argument, 0, OPT_ANNOTATED_JUNCS},
+{"sample-reads", required_argument, 0, OPT_SAMPLE_READS},
+{"bam-compression-level", required_argument, 0, OPT_BAM_COMPRESSION_LEVEL},
 {0, 0, 0, 0} // terminator
 };
 
@@ -509,6 +558,72 @@ int parse_options(int argc, char** argv, void (*print_usage)())
     case OPT_FILTER_HITS:
       flt_mappings = optarg;
       break;
+    case OPT_JUNCTION_STORE:
+      junction_store = optarg;
+      break;
+    case OPT_MIN_JUNC_SUPPORT:
+      min_junc_support = parseIntOpt(0, "--min-junc-support must be at least 0", print_usage);
+      break;
+    case OPT_QUAL_SCORING:
+      if (strcmp(optarg, "phred") == 0)
+	qual_scoring = QUAL_SCORING_PHRED;
+      else if (strcmp(optarg, "maq") == 0)
+	qual_scoring = QUAL_SCORING_MAQ;
+      else
+	{
+	  fprintf(stderr, "--qual-scoring must be phred or maq\n");
+	  print_usage();
+	  return 1;
+	}
+      break;
+    case OPT_REFERENCE_FASTA:
+      reference_fasta = optarg;
+      break;
+    case OPT_READ_IDS:
+      {
+	char* dash = strchr(optarg, '-');
+	if (dash == NULL)
+	  {
+	    fprintf(stderr, "--read-ids must be <first>-[<last>]\n");
+	    print_usage();
+	    return 1;
+	  }
+	read_id_first = (uint32_t)strtoul(optarg, NULL, 10);
+	read_id_last = dash[1] ? (uint32_t)strtoul(dash + 1, NULL, 10) : VMAXINT32;
+	if (read_id_last < read_id_first)
+	  {
+	    fprintf(stderr, "--read-ids: empty range %s\n", optarg);
+	    print_usage();
+	    return 1;
+	  }
+      }
+      break;
+    case OPT_ACCEPTED_JUNCS:
+      accepted_juncs = optarg;
+      break;
+    case OPT_FILTER_JUNCS_ONLY:
+      filter_juncs_only = true;
+      break;
+    case OPT_MERGE_CHUNKS:
+      merge_chunks = true;
+      break;
+    case OPT_FLANK_CACHE:
+      flank_cache = optarg;
+      break;
+    case OPT_ANNOTATED_JUNCS:
+      annotated_juncs = parseIntOpt(0, "--annotated-juncs arg must be at least 0", print_usage);
+      break;
+    case OPT_SAMPLE_READS:
+      sample_reads = parseIntOpt(1, "--sample-reads arg must be at least 1", print_usage);
+      break;
+    case OPT_BAM_COMPRESSION_LEVEL:
+      bam_compression_level = parseIntOpt(0, "--bam-compression-level arg must be at least 0", print_usage);
+      if (bam_compression_level > 9) {
+        fprintf(stderr, "--bam-compression-level arg must be at most 9\n");
+        print_usage();
+        exit(1);
+      }
+      break;
     default:
       print_usage();
       return 1;
@@ -599,6 +714,159 @@ void FZPipe::rewind() {
     }
  }
 
+// spill files made by FZPipe::spool(), by the name of the file they decode
+static map<string, string> fz_spills;
+
+static void remove_fz_spills()
+{
+  for (map<string, string>::iterator s = fz_spills.begin(); s != fz_spills.end(); ++s)
+    unlink(s->second.c_str());
+}
+
+// A spill that is still being written from a FIFO by its feeder thread;
+// readers of the spill wait at its end until the feeder has committed more
+// data or has reached the end of the FIFO.
+struct FZFeed {
+  FILE* in;
+  string pipecmd;
+  string filename;
+  FILE* spill;
+  string spill_name;
+  dev_t dev;
+  ino_t ino;
+  off_t committed;
+  bool done;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+};
+
+static vector<FZFeed*> fz_feeds;
+
+static void* fz_feed_thread(void* arg)
+{
+  FZFeed* feed = (FZFeed*)arg;
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), feed->in)) > 0) {
+    if (fwrite(buf, 1, n, feed->spill) != n || fflush(feed->spill) != 0)
+      err_die("Error: cannot write spill file %s\n", feed->spill_name.c_str());
+    pthread_mutex_lock(&feed->lock);
+    feed->committed += n;
+    pthread_cond_broadcast(&feed->cond);
+    pthread_mutex_unlock(&feed->lock);
+  }
+  int status = feed->pipecmd.empty() ? fclose(feed->in) : pclose(feed->in);
+  if (status != 0)
+    err_die("Error: failed reading %s\n", feed->filename.c_str());
+  if (fclose(feed->spill) != 0)
+    err_die("Error: cannot write spill file %s\n", feed->spill_name.c_str());
+  pthread_mutex_lock(&feed->lock);
+  feed->done = true;
+  pthread_cond_broadcast(&feed->cond);
+  pthread_mutex_unlock(&feed->lock);
+  return NULL;
+}
+
+bool fz_wait_for_data(FILE* f, size_t partial)
+{
+  if (fz_feeds.empty())
+    return false;
+  struct stat st;
+  if (fstat(fileno(f), &st) != 0)
+    return false;
+  FZFeed* feed = NULL;
+  for (size_t i = 0; i < fz_feeds.size() && feed == NULL; ++i)
+    if (fz_feeds[i]->ino == st.st_ino && fz_feeds[i]->dev == st.st_dev)
+      feed = fz_feeds[i];
+  if (feed == NULL)
+    return false;
+  off_t pos = ftello(f);
+  pthread_mutex_lock(&feed->lock);
+  while (!feed->done && feed->committed <= pos)
+    pthread_cond_wait(&feed->cond, &feed->lock);
+  bool more = feed->committed > pos;
+  pthread_mutex_unlock(&feed->lock);
+  if (!more)
+    return false;
+  // re-read the unterminated line that was cut off by the end of the data
+  fseeko(f, pos - (off_t)partial, SEEK_SET);
+  clearerr(f);
+  return true;
+}
+
+static bool is_fifo(const string& fname)
+{
+  struct stat st;
+  return stat(fname.c_str(), &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+void FZPipe::spool() {
+  if (is_bam || file == NULL)
+    return;
+  bool streamed = is_fifo(filename);
+  if (pipecmd.empty() && !streamed)
+    return;
+  map<string, string>::iterator s = fz_spills.find(filename);
+  if (s == fz_spills.end()) {
+    string spill_name = filename + ".spill.XXXXXX";
+    vector<char> tmpl(spill_name.begin(), spill_name.end());
+    tmpl.push_back(0);
+    int fd = mkstemp(&tmpl[0]);
+    if (fd < 0)
+      err_die("Error: cannot create spill file for %s\n", filename.c_str());
+    if (fz_spills.empty())
+      atexit(remove_fz_spills);
+    s = fz_spills.insert(make_pair(filename, string(&tmpl[0]))).first;
+    FILE* spill = fdopen(fd, "w");
+    if (streamed) {
+      // the hits are still being written to the FIFO, so copy them in the
+      // background and let the readers follow the spill as it grows
+      FZFeed* feed = new FZFeed;
+      struct stat st;
+      fstat(fd, &st);
+      feed->in = file;
+      feed->pipecmd = pipecmd;
+      feed->filename = filename;
+      feed->spill = spill;
+      feed->spill_name = s->second;
+      feed->dev = st.st_dev;
+      feed->ino = st.st_ino;
+      feed->committed = 0;
+      feed->done = false;
+      pthread_mutex_init(&feed->lock, NULL);
+      pthread_cond_init(&feed->cond, NULL);
+      fz_feeds.push_back(feed);
+      if (pthread_create(&feed->thread, NULL, fz_feed_thread, feed) != 0)
+        err_die("Error: could not create feeder thread for %s\n", filename.c_str());
+      file = NULL;
+      pipecmd.clear();
+      filename = s->second;
+      file = fopen(filename.c_str(), "r");
+      if (file == NULL)
+        err_die("Error: cannot open spill file %s\n", filename.c_str());
+      return;
+    }
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+      if (fwrite(buf, 1, n, spill) != n)
+        err_die("Error: cannot write spill file %s\n", s->second.c_str());
+    }
+    if (fclose(spill) != 0)
+      err_die("Error: cannot write spill file %s\n", s->second.c_str());
+    int status = pclose(file);
+    file = NULL;
+    if (status != 0)
+      err_die("Error: '%s' failed on %s\n", pipecmd.c_str(), filename.c_str());
+  }
+  this->close();
+  pipecmd.clear();
+  filename = s->second;
+  file = fopen(filename.c_str(), "r");
+  if (file == NULL)
+    err_die("Error: cannot open spill file %s\n", filename.c_str());
+}
 
 string getFext(const string& s) {
    string r("");
@@ -743,6 +1011,253 @@ uint8_t* dupalloc_bdata(bam1_t *b, int size) {
   return odata; //user must FREE this after
 }
 
+// BGZF block layout, as in samtools' bgzf.c
+static const size_t BGZF_BLOCK_SIZE = 0xff00; // uncompressed bytes per block
+static const size_t BGZF_MAX_BLOCK_SIZE = 0x10000;
+static const size_t BGZF_HEADER_SIZE = 18;
+static const size_t BGZF_FOOTER_SIZE = 8;
+
+static const uint8_t bgzf_eof[28] = {
+  0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0, 0x42, 0x43, 0x02, 0,
+  0x1b, 0, 0x03, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+struct BgzfPoolWriter::Block {
+  uint8_t in[BGZF_BLOCK_SIZE];
+  size_t in_len;
+  uint8_t out[BGZF_MAX_BLOCK_SIZE];
+  size_t out_len;
+  bool done;
+};
+
+static void put_le16(uint8_t* p, uint32_t v)
+{
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+}
+
+static void put_le32(uint8_t* p, uint32_t v)
+{
+  put_le16(p, v & 0xffff);
+  put_le16(p + 2, v >> 16);
+}
+
+BgzfPoolWriter::BgzfPoolWriter(FILE* f, int level, int num_threads) :
+  _file(f), _level(level), _ok(true), _closing(false), _num_blocks(1)
+{
+  _current = new Block;
+  _current->in_len = 0;
+  _max_blocks = 4 * (size_t)max(num_threads, 1);
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_work, NULL);
+  pthread_cond_init(&_written, NULL);
+  if (num_threads < 2)
+    return;
+  _threads.resize(num_threads);
+  for (int i = 0; i < num_threads; ++i)
+    if (pthread_create(&_threads[i], NULL, worker_thread, this) != 0)
+      err_die("Error: could not start BAM compression thread\n");
+}
+
+BgzfPoolWriter::~BgzfPoolWriter()
+{
+  if (_file != NULL)
+    close();
+  delete _current;
+  for (size_t i = 0; i < _free.size(); ++i)
+    delete _free[i];
+  pthread_mutex_destroy(&_lock);
+  pthread_cond_destroy(&_work);
+  pthread_cond_destroy(&_written);
+}
+
+void BgzfPoolWriter::write(const void* data, size_t len)
+{
+  const uint8_t* p = (const uint8_t*)data;
+  while (len > 0) {
+    size_t n = min(len, BGZF_BLOCK_SIZE - _current->in_len);
+    memcpy(_current->in + _current->in_len, p, n);
+    _current->in_len += n;
+    p += n;
+    len -= n;
+    if (_current->in_len == BGZF_BLOCK_SIZE)
+      submit();
+  }
+}
+
+void BgzfPoolWriter::write_header(const bam_header_t* h)
+{
+  write("BAM\1", 4);
+  write(&h->l_text, 4);
+  if (h->l_text)
+    write(h->text, h->l_text);
+  write(&h->n_targets, 4);
+  for (int32_t i = 0; i < h->n_targets; ++i) {
+    int32_t name_len = strlen(h->target_name[i]) + 1;
+    write(&name_len, 4);
+    write(h->target_name[i], name_len);
+    write(&h->target_len[i], 4);
+  }
+  submit();
+}
+
+void BgzfPoolWriter::write_record(const bam1_t* b)
+{
+  const bam1_core_t& c = b->core;
+  uint32_t block_len = b->data_len + 32;
+  uint32_t x[8];
+  x[0] = c.tid;
+  x[1] = c.pos;
+  x[2] = (uint32_t)c.bin << 16 | c.qual << 8 | c.l_qname;
+  x[3] = (uint32_t)c.flag << 16 | c.n_cigar;
+  x[4] = c.l_qseq;
+  x[5] = c.mtid;
+  x[6] = c.mpos;
+  x[7] = c.isize;
+  // like bam_write1(), start a new block rather than split a small record
+  if (_current->in_len + 4 + block_len > BGZF_BLOCK_SIZE)
+    submit();
+  write(&block_len, 4);
+  write(x, 32);
+  write(b->data, b->data_len);
+}
+
+bool BgzfPoolWriter::close()
+{
+  if (_file == NULL)
+    return _ok;
+  submit();
+  if (!_threads.empty()) {
+    pthread_mutex_lock(&_lock);
+    _closing = true;
+    pthread_cond_broadcast(&_work);
+    pthread_mutex_unlock(&_lock);
+    for (size_t i = 0; i < _threads.size(); ++i)
+      pthread_join(_threads[i], NULL);
+    _threads.clear();
+  }
+  if (fwrite(bgzf_eof, 1, sizeof(bgzf_eof), _file) != sizeof(bgzf_eof))
+    _ok = false;
+  if (_file == stdout) {
+    if (fflush(_file) != 0)
+      _ok = false;
+  }
+  else if (fclose(_file) != 0)
+    _ok = false;
+  _file = NULL;
+  return _ok;
+}
+
+void BgzfPoolWriter::submit()
+{
+  if (_current->in_len == 0)
+    return;
+  if (_threads.empty()) {
+    deflate_block(_current);
+    if (fwrite(_current->out, 1, _current->out_len, _file) != _current->out_len)
+      _ok = false;
+    _current->in_len = 0;
+    return;
+  }
+  pthread_mutex_lock(&_lock);
+  _current->done = false;
+  _todo.push_back(_current);
+  _order.push_back(_current);
+  pthread_cond_signal(&_work);
+  _current = get_block();
+  pthread_mutex_unlock(&_lock);
+}
+
+void BgzfPoolWriter::deflate_block(Block* block)
+{
+  z_stream zs;
+  zs.zalloc = NULL;
+  zs.zfree = NULL;
+  zs.opaque = NULL;
+  if (deflateInit2(&zs, _level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    err_die("Error: deflateInit2() failed for BAM output\n");
+  zs.next_in = block->in;
+  zs.avail_in = block->in_len;
+  zs.next_out = block->out + BGZF_HEADER_SIZE;
+  zs.avail_out = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+  // a full block of incompressible data still fits in stored deflate blocks
+  if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+    err_die("Error: BAM block did not fit after compression\n");
+  size_t deflated = zs.total_out;
+  deflateEnd(&zs);
+
+  uint8_t* p = block->out;
+  static const uint8_t header[16] = {
+    0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0, 0x42, 0x43, 0x02, 0
+  };
+  memcpy(p, header, sizeof(header));
+  block->out_len = BGZF_HEADER_SIZE + deflated + BGZF_FOOTER_SIZE;
+  put_le16(p + 16, block->out_len - 1);
+  p += BGZF_HEADER_SIZE + deflated;
+  put_le32(p, crc32(crc32(0L, NULL, 0), block->in, block->in_len));
+  put_le32(p + 4, block->in_len);
+}
+
+// Writes out the deflated blocks at the front of the file order; called
+// with _lock held, so that only one thread writes at a time.
+void BgzfPoolWriter::write_done_blocks()
+{
+  bool written = false;
+  while (!_order.empty() && _order.front()->done) {
+    Block* block = _order.front();
+    _order.pop_front();
+    if (fwrite(block->out, 1, block->out_len, _file) != block->out_len)
+      _ok = false;
+    block->in_len = 0;
+    _free.push_back(block);
+    written = true;
+  }
+  if (written)
+    pthread_cond_broadcast(&_written);
+}
+
+// Returns an empty block, waiting for one to be written if too many are
+// already in flight; called with _lock held.
+BgzfPoolWriter::Block* BgzfPoolWriter::get_block()
+{
+  while (_free.empty() && _num_blocks >= _max_blocks)
+    pthread_cond_wait(&_written, &_lock);
+  if (_free.empty()) {
+    ++_num_blocks;
+    Block* block = new Block;
+    block->in_len = 0;
+    return block;
+  }
+  Block* block = _free.back();
+  _free.pop_back();
+  return block;
+}
+
+void* BgzfPoolWriter::worker_thread(void* arg)
+{
+  ((BgzfPoolWriter*)arg)->worker();
+  return NULL;
+}
+
+void BgzfPoolWriter::worker()
+{
+  pthread_mutex_lock(&_lock);
+  while (true) {
+    while (_todo.empty() && !_closing)
+      pthread_cond_wait(&_work, &_lock);
+    if (_todo.empty())
+      break;
+    Block* block = _todo.front();
+    _todo.pop_front();
+    pthread_mutex_unlock(&_lock);
+    deflate_block(block);
+    pthread_mutex_lock(&_lock);
+    block->done = true;
+    write_done_blocks();
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
 extern unsigned short bam_char2flag_table[];
 
 GBamRecord::GBamRecord(const char* qname, int32_t gseq_tid,
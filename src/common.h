@@ -15,6 +15,8 @@
 #include <cstdio>
 #include <string>
 #include <vector>
+#include <deque>
+#include <pthread.h>
 #include "bam/bam.h"
 #include "bam/sam.h"
 
@@ -96,6 +98,50 @@ extern bool color;
 extern bool color_out;
 extern std::string gtf_juncs;
 
+// binary junction store written by tophat_reports and merge_juncs
+extern std::string junction_store;
+// merge_juncs: drop junctions supported by fewer hits across all inputs
+extern int min_junc_support;
+
+// tophat_reports: break ties between equally good alignments of a read
+// by quality-weighted mismatches against reference_fasta
+enum eQUAL_SCORING
+  {
+    QUAL_SCORING_NONE = 0,
+    QUAL_SCORING_PHRED, // SimplePhredPenalty
+    QUAL_SCORING_MAQ    // MaqPhredPenalty
+  };
+
+extern eQUAL_SCORING qual_scoring;
+extern std::string reference_fasta;
+
+// long_spanning_reads, tophat_reports: only process reads whose numeric
+// IDs fall in [read_id_first, read_id_last] (--read-ids <first>-[<last>]),
+// so that one sample can be split over several processes
+extern uint32_t read_id_first;
+extern uint32_t read_id_last;
+
+// tophat_reports: the junction set filtered once over all reads, written
+// by --filter-juncs-only and reused by the per-range runs
+extern std::string accepted_juncs;
+extern bool filter_juncs_only;
+// tophat_reports: combine the junctions, insertions and deletions of the
+// per-range runs into the final tracks
+extern bool merge_chunks;
+
+// juncs_db: the flanks of the junctions in the first annotated_juncs splice
+// coordinate files persist in a cache under the file prefix flank_cache
+extern std::string flank_cache;
+extern int annotated_juncs;
+
+// prep_reads: keep only a sample of this many reads (0 keeps all), chosen
+// by read ID so that both mates of a pair are kept or dropped together
+extern int sample_reads;
+
+// zlib level (0-9) of compressed BAM output; -1 is zlib's default
+// (--bam-compression-level)
+extern int bam_compression_level;
+
 //prep_reads only: --flt-reads <bowtie-fastq_for--max>
 //  filter out reads if their numeric ID is in this fastq file
 // OR if flt_mappings was given too, filter out reads if their ID
@@ -195,10 +241,56 @@ class FZPipe {
 	   return this->openRead(fname.c_str());
 	   }
 	 void rewind();
+	 // Runs the decompressor once, into an uncompressed spill file next to
+	 // the input; this pipe (and any other one later spooled from the same
+	 // file) then reads the spill, so rewinds no longer decompress again.
+	 // Spill files are removed at exit.  A FIFO (e.g. a segment map that
+	 // is still being written by Bowtie) is copied to its spill on a
+	 // background thread instead, and readers of the spill wait for the
+	 // data they have not seen yet; see fz_wait_for_data().
+	 void spool();
 };
 
+/*
+ * Called at the end of the data in f, with partial bytes of an unterminated
+ * line just read: if f reads a spill still being fed from a FIFO, waits for
+ * more data and repositions f at the start of that line.  Returns false if f
+ * has really reached its end.
+ */
+bool fz_wait_for_data(FILE* f, size_t partial);
+
 void err_die(const char* format,...);
 
+/*
+ * Runs each of the given tasks on its own thread and waits for all of them
+ * to finish.  A task is any copyable object with a void operator()().
+ * Tasks must not share mutable state; each one is expected to collect its
+ * results locally so the caller can merge them after run_tasks() returns.
+ * With a single task (e.g. -p1) the task runs on the calling thread.
+ */
+template <class Task>
+void* run_task_thread(void* task)
+{
+  (*(Task*)task)();
+  return NULL;
+}
+
+template <class Task>
+void run_tasks(std::vector<Task>& tasks)
+{
+  if (tasks.size() == 1) {
+    tasks[0]();
+    return;
+  }
+  std::vector<pthread_t> threads(tasks.size());
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    if (pthread_create(&threads[i], NULL, run_task_thread<Task>, &tasks[i]) != 0)
+      err_die("Error: could not create worker thread\n");
+  }
+  for (size_t i = 0; i < threads.size(); ++i)
+    pthread_join(threads[i], NULL);
+}
+
 //uint8_t* realloc_bdata(bam1_t *b, int size);
 //uint8_t* dupalloc_bdata(bam1_t *b, int size);
 
@@ -280,20 +372,76 @@ class GBamRecord {
       }
 };
 
+/*
+ * Writes a BGZF file (e.g. BAM) like samtools' bgzf_write(), but deflates
+ * the full blocks on a pool of threads, writing them out in order.  With
+ * fewer than 2 threads the blocks are deflated on the calling thread.
+ */
+class BgzfPoolWriter {
+ public:
+   BgzfPoolWriter(FILE* f, int level, int num_threads);
+   ~BgzfPoolWriter();
+
+   void write(const void* data, size_t len);
+   // BAM serialization, as bam_header_write() and bam_write1(); only for
+   // little-endian hosts
+   void write_header(const bam_header_t* h);
+   void write_record(const bam1_t* b);
+
+   // Writes the last block and the EOF marker and closes the file (unless
+   // it is stdout); false if anything could not be written.
+   bool close();
+
+   struct Block;
+ private:
+   void submit();
+   void deflate_block(Block* block);
+   void write_done_blocks();
+   Block* get_block();
+   static void* worker_thread(void* arg);
+   void worker();
+
+   FILE* _file;
+   int _level;
+   bool _ok;
+   bool _closing;
+   Block* _current;
+   size_t _num_blocks;
+   size_t _max_blocks;
+   std::deque<Block*> _todo;   // submitted, not yet taken by a worker
+   std::deque<Block*> _order;  // submitted, not yet written, in file order
+   std::vector<Block*> _free;
+   std::vector<pthread_t> _threads;
+   pthread_mutex_t _lock;
+   pthread_cond_t _work;       // signals _todo or _closing
+   pthread_cond_t _written;    // signals blocks written out
+};
+
 class GBamWriter {
    samfile_t* bam_file;
    bam_header_t* bam_header;
+   BgzfPoolWriter* bgzf; // compressed output on little-endian hosts
  public:
    void create(const char* fname, bool uncompressed=false) {
       if (bam_header==NULL)
          err_die("Error: no bam_header for GBamWriter::create()!\n");
+      bam_file=NULL;
+      bgzf=NULL;
+      uint16_t byte_order=1;
       if (uncompressed) {
          bam_file=samopen(fname, "wbu", bam_header);
          }
+        else if (*(uint8_t*)&byte_order==1) {
+         FILE* f=(strcmp(fname, "-")==0) ? stdout : fopen(fname, "wb");
+         if (f==NULL)
+            err_die("Error: could not create BAM file %s!\n",fname);
+         bgzf=new BgzfPoolWriter(f, bam_compression_level, num_cpus);
+         bgzf->write_header(bam_header);
+         }
         else {
          bam_file=samopen(fname, "wb", bam_header);
          }
-      if (bam_file==NULL)
+      if (bam_file==NULL && bgzf==NULL)
          err_die("Error: could not create BAM file %s!\n",fname);
       //do we need to call bam_header_write() ?
       }
@@ -318,7 +466,12 @@ class GBamWriter {
       }
 
     ~GBamWriter() {
-      samclose(bam_file);
+      if (bgzf!=NULL) {
+         if (!bgzf->close())
+            err_die("Error: could not write BAM file!\n");
+         delete bgzf;
+         }
+        else samclose(bam_file);
       bam_header_destroy(bam_header);
       }
    bam_header_t* get_header() { return bam_header; }
@@ -375,10 +528,12 @@ class GBamWriter {
 
    void write(GBamRecord* brec) {
       if (brec!=NULL)
-          samwrite(this->bam_file,brec->get_b());
+          write(brec->get_b());
       }
    void write(bam1_t* b) {
-      samwrite(this->bam_file, b);
+      if (bgzf!=NULL)
+          bgzf->write_record(b);
+        else samwrite(this->bam_file, b);
       }
 };
 
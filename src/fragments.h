@@ -30,6 +30,12 @@ struct FragmentAlignmentGrade
     num_alignments = 1;
   }
   
+  FragmentAlignmentGrade(const HitBatch& batch, size_t i)
+  {
+    status = AlignStatus(batch, i);
+    num_alignments = 1;
+  }
+  
   FragmentAlignmentGrade& operator=(const FragmentAlignmentGrade& rhs)
   {
     status = rhs.status;
@@ -1,4 +1,12 @@
 #include "gff.h"
+#include "GStr.h"
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 //GffNames* GffReader::names=NULL;
 GffNames* GffObj::names=NULL;
@@ -106,9 +114,9 @@ char* GffLine::extractAttr(const char* pre, bool caseStrict, bool enforce_GTF2)
  return r;
 }
 
-static char fnamelc[128];
-
 GffLine::GffLine(GffReader* reader, const char* l) {
+ //no static buffers or reader updates here: lines may be parsed by several threads
+ char fnamelc[128];
  llen=strlen(l);
  GMALLOC(line,llen+1);
  memcpy(line, l, llen+1);
@@ -123,6 +131,7 @@ GffLine::GffLine(GffReader* reader, const char* l) {
  _parents_len=0;
  num_parents=0;
  parents=NULL;
+ discarded_id=NULL;
  is_gff3=false;
  is_cds=false;
  is_transcript=false;
@@ -228,10 +237,7 @@ if (reader->transcriptsOnly && !is_t_data) {
         char* id=extractAttr("ID=");
         if (id==NULL) id=extractAttr("transcript_id");
         //GMessage("Discarding non-transcript line:\n%s\n",l);
-        if (id!=NULL) {
-          reader->discarded_ids.Add(id, new int(1));
-          GFREE(id);
-          }
+        discarded_id=id; //recorded by GffReader::nextGffLine()
         return; //skip this line, unwanted feature name
         }
  ID=extractAttr("ID=");
@@ -829,19 +835,101 @@ GffObj::GffObj(GffReader *gfrd, GffLine* gffline, bool keepAttr, bool noExonAttr
         }
 }
 
-GffLine* GffReader::nextGffLine() {
- if (gffline!=NULL) return gffline; //caller should free gffline after processing
- while (gffline==NULL) {
+const int GFF_BATCH_LINES=16384; //lines parsed ahead per batch when num_threads>1
+
+struct GffLineBatchJob {
+  GffReader* reader;
+  char** lines;
+  GffLine** parsed;
+  int count;
+  int first; //this job parses lines first, first+step, ...
+  int step;
+};
+
+static void* parseGffLineBatch(void* arg) {
+  GffLineBatchJob* job=(GffLineBatchJob*)arg;
+  for (int i=job->first;i<job->count;i+=job->step)
+     job->parsed[i]=new GffLine(job->reader, job->lines[i]);
+  return NULL;
+}
+
+void GffReader::clearLineBatch() {
+ for (int i=batch_pos;i<batch_count;i++)
+    delete linebatch[i];
+ batch_count=0;
+ batch_pos=0;
+}
+
+//read the next GFF_BATCH_LINES data lines and parse them with num_threads threads;
+//the parsed lines are then consumed in file order by nextGffLine()
+bool GffReader::parseLineBatch() {
+ clearLineBatch();
+ if (linebatch==NULL) GMALLOC(linebatch, GFF_BATCH_LINES*sizeof(GffLine*));
+ char** lines=NULL;
+ GMALLOC(lines, GFF_BATCH_LINES*sizeof(char*));
+ int count=0;
+ while (count<GFF_BATCH_LINES) {
     int llen=0;
     buflen=GFF_LINELEN-1;
     char* l=fgetline(linebuf, buflen, fh, &fpos, &llen);
-    if (l==NULL) {
-         return NULL; //end of file
-         }
+    if (l==NULL) break; //end of file
     int ns=0; //first nonspace position
     while (l[ns]!=0 && isspace(l[ns])) ns++;
     if (l[ns]=='#' || llen<10) continue;
-    gffline=new GffLine(this, l);
+    lines[count++]=Gstrdup(l);
+    }
+ int nt=(count<num_threads) ? count : num_threads;
+ if (nt>0) {
+   GffLineBatchJob* jobs=new GffLineBatchJob[nt];
+   pthread_t* threads=new pthread_t[nt];
+   for (int t=0;t<nt;t++) {
+     jobs[t].reader=this;
+     jobs[t].lines=lines;
+     jobs[t].parsed=linebatch;
+     jobs[t].count=count;
+     jobs[t].first=t;
+     jobs[t].step=nt;
+     }
+   //the first job runs on this thread
+   for (int t=1;t<nt;t++) {
+     if (pthread_create(&threads[t], NULL, parseGffLineBatch, &jobs[t])!=0)
+        GError("Error: could not start a GFF parsing thread!\n");
+     }
+   parseGffLineBatch(&jobs[0]);
+   for (int t=1;t<nt;t++)
+     pthread_join(threads[t], NULL);
+   delete[] threads;
+   delete[] jobs;
+   }
+ for (int i=0;i<count;i++) GFREE(lines[i]);
+ GFREE(lines);
+ batch_count=count;
+ return (count>0);
+}
+
+GffLine* GffReader::nextGffLine() {
+ if (gffline!=NULL) return gffline; //caller should free gffline after processing
+ while (gffline==NULL) {
+    if (num_threads>1) {
+      if (batch_pos>=batch_count && !parseLineBatch())
+         return NULL; //end of file
+      gffline=linebatch[batch_pos];
+      linebatch[batch_pos++]=NULL;
+      }
+    else {
+      int llen=0;
+      buflen=GFF_LINELEN-1;
+      char* l=fgetline(linebuf, buflen, fh, &fpos, &llen);
+      if (l==NULL) {
+           return NULL; //end of file
+           }
+      int ns=0; //first nonspace position
+      while (l[ns]!=0 && isspace(l[ns])) ns++;
+      if (l[ns]=='#' || llen<10) continue;
+      gffline=new GffLine(this, l);
+      }
+    if (gffline->discarded_id!=NULL)
+       discarded_ids.Add(gffline->discarded_id, new int(1));
     if (gffline->skip) {
        delete gffline;
        gffline=NULL;
@@ -1864,3 +1952,263 @@ void GffObj::getCDSegs(GArray<GffCDSeg>& cds) {
        } //for each exon
    } // + strand
 }
+
+//-- binary annotation cache used by GffReader::readAllCached()
+// layout: magic, mode, GFF file size and mtime, the gseqs/tracks/feats name
+// tables in id order, then the gflst records with their exons
+static const char gff_cache_magic[8]={'G','F','F','C','A','C','H','1'};
+
+static bool gffcWrite(FILE* f, const void* p, size_t n) {
+ return (n==0 || fwrite(p, 1, n, f)==n);
+}
+
+static bool gffcWriteStr(FILE* f, const char* str) {
+ uint32_t len=(str==NULL) ? 0xFFFFFFFF : strlen(str);
+ return gffcWrite(f, &len, sizeof(len)) && (str==NULL || gffcWrite(f, str, len));
+}
+
+static bool gffcWriteNames(FILE* f, GffNameList& nl) {
+ uint32_t n=nl.Count();
+ bool ok=gffcWrite(f, &n, sizeof(n));
+ for (int i=0;ok && i<nl.Count();i++)
+   ok=gffcWriteStr(f, nl.getName(i));
+ return ok;
+}
+
+//bounds-checked cursor over the mapped cache file
+struct GffCacheCursor {
+  const char* p;
+  const char* end;
+  bool ok;
+  GffCacheCursor(const char* data, size_t len):p(data), end(data+len), ok(true) { }
+  void read(void* v, size_t n) {
+    if (!ok || (size_t)(end-p)<n) { ok=false; return; }
+    memcpy(v, p, n);
+    p+=n;
+    }
+  void skip(size_t n) {
+    if (!ok || (size_t)(end-p)<n) { ok=false; return; }
+    p+=n;
+    }
+  void skipStr() {
+    uint32_t len=0;
+    read(&len, sizeof(len));
+    if (ok && len!=0xFFFFFFFF) skip(len);
+    }
+  char* readStr() { //Gstrdup'ed copy, or NULL
+    uint32_t len=0;
+    read(&len, sizeof(len));
+    if (!ok || len==0xFFFFFFFF) return NULL;
+    if ((size_t)(end-p)<len) { ok=false; return NULL; }
+    char* r=NULL;
+    GMALLOC(r, len+1);
+    memcpy(r, p, len);
+    r[len]=0;
+    p+=len;
+    return r;
+    }
+  bool readNames(GffNameList& nl) { //ids must come out as they were saved
+    uint32_t n=0;
+    read(&n, sizeof(n));
+    for (uint32_t i=0;ok && i<n;i++) {
+      char* name=readStr();
+      if (!ok || name==NULL || nl.addName(name)!=(int)i) ok=false;
+      GFREE(name);
+      }
+    return ok;
+    }
+};
+
+//dry run over the name tables and records after the cache header, so that
+//a truncated or corrupt cache is rejected before anything is loaded from it
+static bool gffCacheComplete(GffCacheCursor cur) {
+ GffNameList gseqs, tracks, feats;
+ if (!cur.readNames(gseqs) || !cur.readNames(tracks) || !cur.readNames(feats))
+   return false;
+ uint32_t numobjs=0;
+ cur.read(&numobjs, sizeof(numobjs));
+ for (uint32_t i=0;cur.ok && i<numobjs;i++) {
+   cur.skip(4*sizeof(int32_t)+8*sizeof(uint32_t)+4);
+   cur.skip(sizeof(((GffObj*)NULL)->covlen)+sizeof(((GffObj*)NULL)->gscore));
+   cur.skipStr();
+   cur.skipStr();
+   cur.skipStr();
+   uint32_t numexons=0;
+   cur.read(&numexons, sizeof(numexons));
+   for (uint32_t e=0;cur.ok && e<numexons;e++)
+     cur.skip(2*sizeof(uint32_t)+2*sizeof(int32_t)+2+sizeof(double));
+   }
+ return cur.ok && cur.p==cur.end;
+}
+
+static bool gffStat(const char* gffname, int64_t& size, int64_t& mtime) {
+ struct stat st;
+ if (gffname==NULL || stat(gffname, &st)!=0) return false;
+ size=st.st_size;
+ mtime=st.st_mtime;
+ return true;
+}
+
+bool GffReader::saveCache(const char* cachefn, const char* gffname, uint mode) {
+ int64_t gsize=0, gmtime=0;
+ if (!gffStat(gffname, gsize, gmtime)) return false;
+ //write to a temporary file of this process and rename it, so a concurrent
+ //run never maps (or clobbers) a partially written cache
+ GStr tmpfn(cachefn);
+ tmpfn.appendfmt(".%d", (int)getpid());
+ FILE* f=fopen(tmpfn.chars(), "wb");
+ if (f==NULL) return false;
+ uint32_t m=mode;
+ bool ok=gffcWrite(f, gff_cache_magic, sizeof(gff_cache_magic)) &&
+     gffcWrite(f, &m, sizeof(m)) && gffcWrite(f, &gsize, sizeof(gsize)) &&
+     gffcWrite(f, &gmtime, sizeof(gmtime));
+ if (ok && GffObj::names!=NULL) {
+   ok=gffcWriteNames(f, GffObj::names->gseqs) && gffcWriteNames(f, GffObj::names->tracks) &&
+      gffcWriteNames(f, GffObj::names->feats);
+   }
+ else if (ok) { //nothing was parsed
+   uint32_t n=0;
+   ok=gffcWrite(f, &n, sizeof(n)) && gffcWrite(f, &n, sizeof(n)) && gffcWrite(f, &n, sizeof(n));
+   }
+ uint32_t numobjs=gflst.Count();
+ ok=ok && gffcWrite(f, &numobjs, sizeof(numobjs));
+ for (int i=0;ok && i<gflst.Count();i++) {
+   GffObj& o=*(gflst[i]);
+   int32_t ids[4]={o.gseq_id, o.track_id, o.ftype_id, o.exon_ftype_id};
+   uint32_t coords[8]={o.start, o.end, o.flags, o.CDstart, o.CDend,
+       (uint32_t)o.qlen, (uint32_t)o.qstart, (uint32_t)o.qend};
+   char c[4]={o.strand, o.CDphase, (char)o.isCDS, (char)o.partial};
+   uint32_t numexons=o.exons.Count();
+   ok=gffcWrite(f, ids, sizeof(ids)) && gffcWrite(f, coords, sizeof(coords)) &&
+      gffcWrite(f, c, sizeof(c)) && gffcWrite(f, &o.covlen, sizeof(o.covlen)) &&
+      gffcWrite(f, &o.gscore, sizeof(o.gscore)) &&
+      gffcWriteStr(f, o.gffID) && gffcWriteStr(f, o.gene_name) && gffcWriteStr(f, o.geneID) &&
+      gffcWrite(f, &numexons, sizeof(numexons));
+   for (int e=0;ok && e<o.exons.Count();e++) {
+     GffExon& x=*(o.exons[e]);
+     uint32_t xc[2]={x.start, x.end};
+     int32_t xq[2]={x.qstart, x.qend};
+     char xt[2]={x.phase, x.exontype};
+     ok=gffcWrite(f, xc, sizeof(xc)) && gffcWrite(f, xq, sizeof(xq)) &&
+        gffcWrite(f, xt, sizeof(xt)) && gffcWrite(f, &x.score, sizeof(x.score));
+     }
+   }
+ if (fclose(f)!=0) ok=false;
+ if (!ok || rename(tmpfn.chars(), cachefn)!=0) {
+   remove(tmpfn.chars());
+   return false;
+   }
+ return true;
+}
+
+bool GffReader::loadCache(const char* cachefn, const char* gffname, uint mode) {
+ int64_t gsize=0, gmtime=0;
+ if (!gffStat(gffname, gsize, gmtime)) return false;
+ int fd=open(cachefn, O_RDONLY);
+ if (fd<0) return false;
+ struct stat st;
+ if (fstat(fd, &st)!=0 || st.st_size<(off_t)sizeof(gff_cache_magic)) {
+   close(fd);
+   return false;
+   }
+ size_t len=st.st_size;
+ void* data=mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+ close(fd);
+ if (data==MAP_FAILED) return false;
+
+ GffCacheCursor cur((const char*)data, len);
+ char magic[sizeof(gff_cache_magic)];
+ uint32_t m=0;
+ int64_t csize=0, cmtime=0;
+ cur.read(magic, sizeof(magic));
+ cur.read(&m, sizeof(m));
+ cur.read(&csize, sizeof(csize));
+ cur.read(&cmtime, sizeof(cmtime));
+ if (!cur.ok || memcmp(magic, gff_cache_magic, sizeof(magic))!=0 || m!=mode ||
+      csize!=gsize || cmtime!=gmtime || !gffCacheComplete(cur)) {
+   munmap(data, len);
+   return false; //stale, foreign or damaged cache
+   }
+ //the saved name ids are only valid again in a fresh names repository
+ if (gflst.Count()>0 || (GffObj::names!=NULL &&
+       (GffObj::names->gseqs.Count()>0 || GffObj::names->tracks.Count()>0))) {
+   munmap(data, len);
+   return false;
+   }
+ gffnames_ref(GffObj::names);
+ if (names==NULL) names=GffObj::names;
+ cur.readNames(GffObj::names->gseqs);
+ cur.readNames(GffObj::names->tracks);
+ cur.readNames(GffObj::names->feats);
+ uint32_t numobjs=0;
+ cur.read(&numobjs, sizeof(numobjs));
+ for (uint32_t i=0;cur.ok && i<numobjs;i++) {
+   GffObj* o=new GffObj();
+   int32_t ids[4];
+   uint32_t coords[8];
+   char c[4];
+   uint32_t numexons=0;
+   cur.read(ids, sizeof(ids));
+   cur.read(coords, sizeof(coords));
+   cur.read(c, sizeof(c));
+   cur.read(&o->covlen, sizeof(o->covlen));
+   cur.read(&o->gscore, sizeof(o->gscore));
+   o->gffID=cur.readStr();
+   o->gene_name=cur.readStr();
+   o->geneID=cur.readStr();
+   cur.read(&numexons, sizeof(numexons));
+   o->gseq_id=ids[0];
+   o->track_id=ids[1];
+   o->ftype_id=ids[2];
+   o->exon_ftype_id=ids[3];
+   o->start=coords[0];
+   o->end=coords[1];
+   o->flags=coords[2];
+   o->CDstart=coords[3];
+   o->CDend=coords[4];
+   o->qlen=coords[5];
+   o->qstart=coords[6];
+   o->qend=coords[7];
+   o->strand=c[0];
+   o->CDphase=c[1];
+   o->isCDS=(c[2]!=0);
+   o->partial=(c[3]!=0);
+   for (uint32_t e=0;cur.ok && e<numexons;e++) {
+     uint32_t xc[2];
+     int32_t xq[2];
+     char xt[2];
+     double score=0;
+     cur.read(xc, sizeof(xc));
+     cur.read(xq, sizeof(xq));
+     cur.read(xt, sizeof(xt));
+     cur.read(&score, sizeof(score));
+     if (cur.ok)
+       o->exons.Add(new GffExon(xc[0], xc[1], score, xt[0], xq[0], xq[1], xt[1]));
+     }
+   gflst.Add(o);
+   }
+ munmap(data, len);
+ //gffCacheComplete() has checked the whole file, and the names repository
+ //is already partly filled, so there is no falling back to parsing here
+ if (!cur.ok || cur.p!=cur.end)
+   GError("Error: corrupt GFF cache file %s (remove it and try again)\n", cachefn);
+ gffnames_unref(GffObj::names); //the loaded records hold their own references
+ if (GffObj::names==NULL) names=NULL;
+ return true;
+}
+
+void GffReader::readAllCached(const char* gffname, bool keepAttr, bool mergeCloseExons,
+                              bool noExonAttr) {
+ if (keepAttr || gffname==NULL) { //attributes aren't cached
+   readAll(keepAttr, mergeCloseExons, noExonAttr);
+   return;
+   }
+ uint mode=(transcriptsOnly ? 1 : 0) | (gflst.mustSortByLoc() ? 2 : 0) |
+           (mergeCloseExons ? 4 : 0) | (noExonAttr ? 8 : 0);
+ GStr cachefn(gffname);
+ cachefn.appendfmt(".%x.gfcache", mode);
+ if (loadCache(cachefn.chars(), gffname, mode)) return;
+ readAll(keepAttr, mergeCloseExons, noExonAttr);
+ if (!saveCache(cachefn.chars(), gffname, mode))
+    GMessage("Warning: could not save GFF cache file %s\n", cachefn.chars());
+}
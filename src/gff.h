@@ -91,6 +91,8 @@ class GffLine {
     char** parents; //for GTF only parents[0] is used
     int num_parents;
     char* ID;     // if a ID=.. attribute was parsed, or a GTF with 'transcript' line (transcript_id)
+    char* discarded_id; //ID of a skipped non-transcript feature (transcriptsOnly mode);
+                        //GffReader::nextGffLine() records it in discarded_ids, in file order
     GffLine(GffReader* reader, const char* l); //parse the line accordingly
     void discardParent() {
        GFREE(_parents);
@@ -123,6 +125,7 @@ class GffLine {
          }
       //-- allocated string copies:
       ID=Gstrdup(l->ID);
+      discarded_id=NULL;
       if (l->gene_name!=NULL)
           gene_name=Gstrdup(l->gene_name);
       if (l->gene_id!=NULL)
@@ -142,6 +145,7 @@ class GffLine {
       parents=NULL;
       num_parents=0;
       ID=NULL;
+      discarded_id=NULL;
       gene_name=NULL;
       gene_id=NULL;
       skip=true;
@@ -161,6 +165,7 @@ class GffLine {
       GFREE(_parents);
       GFREE(parents);
       GFREE(ID);
+      GFREE(discarded_id);
       GFREE(gene_name);
       GFREE(gene_id);
      }
@@ -933,6 +938,7 @@ class GfList: public GList<GffObj> {
      //-- for deallocation of these objects, call freeAll() or freeUnused() as needed
      mustSort=sortbyloc;
      }
+   bool mustSortByLoc() { return mustSort; }
    void sortedByLoc(bool v=true) {
      bool prev=mustSort;
      mustSort=v;
@@ -1020,6 +1026,12 @@ class GffReader {
                             // of discarded parent IDs
   GHash<GfoHolder> phash; //transcript_id+contig (Parent~Contig) => [gflst index, GffObj]
   GHash<int> tids; //transcript_id uniqueness
+  int num_threads; //GFF lines are parsed in batches by this many threads if >1
+  GffLine** linebatch; //lines parsed ahead by parseLineBatch(), handed out in file order
+  int batch_count;
+  int batch_pos;
+  bool parseLineBatch();
+  void clearLineBatch();
   char* gfoBuildId(const char* id, const char* ctg);
   void gfoRemove(const char* id, const char* ctg);
   GfoHolder* gfoAdd(const char* id, const char* ctg, GffObj* gfo, int idx);
@@ -1049,12 +1061,17 @@ class GffReader {
       fh=f;
       GMALLOC(linebuf, GFF_LINELEN);
       buflen=GFF_LINELEN-1;
+      num_threads=1;
+      linebatch=NULL;
+      batch_count=0;
+      batch_pos=0;
       }
   void init(FILE *f, bool t_only=false, bool sortbyloc=false) {
       fname=NULL;
       fh=f;
       if (fh!=NULL) rewind(fh);
       fpos=0;
+      clearLineBatch();
       transcriptsOnly=t_only;
       gflst.sortedByLoc(sortbyloc);
       }
@@ -1069,6 +1086,10 @@ class GffReader {
       gffline=NULL;
       GMALLOC(linebuf, GFF_LINELEN);
       buflen=GFF_LINELEN-1;
+      num_threads=1;
+      linebatch=NULL;
+      batch_count=0;
+      batch_pos=0;
       }
 
  ~GffReader() {
@@ -1082,6 +1103,8 @@ class GffReader {
       gseqstats.Clear();
       GFREE(fname);
       GFREE(linebuf);
+      clearLineBatch();
+      GFREE(linebatch);
       }
 
   void showWarnings(bool v=true) {
@@ -1091,9 +1114,22 @@ class GffReader {
       
   GffLine* nextGffLine();
 
+  //parse the GFF lines with n threads (line order and results are unchanged)
+  void setThreads(int n) { num_threads=(n>1) ? n : 1; }
+
   // load all subfeatures, re-group them:
   void readAll(bool keepAttr=false, bool mergeCloseExons=false, bool noExonAttr=true);
 
+  //same as readAll(), but the resulting gflst is loaded from a binary cache
+  //next to gffname if one was saved by an earlier run with the same parsing
+  //options and the GFF file hasn't changed since; otherwise the file is parsed
+  //and the cache (re)written. Records keep their gflst order and gseq_id values,
+  //but not their attributes or parent/children links (keepAttr bypasses the cache)
+  void readAllCached(const char* gffname, bool keepAttr=false, bool mergeCloseExons=false,
+                     bool noExonAttr=true);
+  bool saveCache(const char* cachefn, const char* gffname, uint mode);
+  bool loadCache(const char* cachefn, const char* gffname, uint mode);
+
 }; // end of GffReader
 
 #endif
@@ -28,26 +28,28 @@ using namespace std;
 
 void print_usage()
 {
-    fprintf(stderr, "Usage:   gtf_juncs <transcripts.gtf>\n");
+    fprintf(stderr, "Usage:   gtf_juncs [-p <num_threads>] <transcripts.gtf>\n");
 }
 
-void read_transcripts(FILE* f, GffReader& gffr) { 
+void read_transcripts(FILE* f, const string& gtf_fname, GffReader& gffr) { 
   //assume gffr was just created but not initialized
   gffr.init(f, true, true); //(gffile, mRNA-only, sortByLoc)
   gffr.showWarnings(verbose);
+  gffr.setThreads(num_cpus);
   //(keepAttr,   mergeCloseExons,  noExonAttr)
-  gffr.readAll(false, true, true); 
+  gffr.readAllCached(gtf_fname.c_str(), false, true, true); 
   //now all parsed GffObjs are in gffr.gflst, grouped by genomic sequence
   }
 
 
 uint32_t get_junctions_from_gff(FILE* ref_mRNA_file,
+                                const string& gtf_fname,
                                 RefSequenceTable& rt)
 {
 	GffReader gff_reader(ref_mRNA_file, true); //only recognizable transcript features, sort them by locus
 	if (ref_mRNA_file)
 	{
-		read_transcripts(ref_mRNA_file, gff_reader);
+		read_transcripts(ref_mRNA_file, gtf_fname, gff_reader);
 	}
 	
 	set<pair<string, pair<int, int> > > uniq_juncs;
@@ -128,7 +130,7 @@ int main(int argc, char** argv)
 //	
     
     RefSequenceTable rt(true);
-	uint32_t num_juncs_reported = get_junctions_from_gff(ref_gtf, rt);
+	uint32_t num_juncs_reported = get_junctions_from_gff(ref_gtf, gtf_filename, rt);
     
     
     //uint32_t num_juncs_reported = 0;
@@ -10,6 +10,7 @@
  */
 
 #include "bwt_map.h"
+#include "align_status.h"
 
 struct InsertAlignment
 {
@@ -109,6 +110,51 @@ struct InsertAlignmentGrade
 		assert(!(too_far && too_close));
 	}
 	
+	// Same as above, for hit i of b1 and hit j of b2
+	InsertAlignmentGrade(const HitBatch& b1, 
+			     size_t i,
+			     const HitBatch& b2, 
+			     size_t j,
+			     int min_inner_distance,
+			     int max_inner_distance) :
+		  too_close(false),
+   		  too_far(false),
+		  num_spliced(0),
+		  num_mapped(2),
+		  opposite_strands(false),
+		  consistent_splices(false),
+		  edit_dist(0x1F),
+		  num_alignments(1)
+	{
+		if (b1.lefts[i] < b2.lefts[j])
+			inner_dist = b2.lefts[j] - b1.rights[i];
+		else
+			inner_dist = b1.lefts[i] - b2.rights[j];
+		
+		if (!b1.has(i, HitBatch::CONTIGUOUS))
+			num_spliced++;
+		if (!b2.has(j, HitBatch::CONTIGUOUS))
+			num_spliced++;
+		
+		too_far = (inner_dist > max_inner_distance);
+		too_close = (inner_dist < min_inner_distance);
+		
+		opposite_strands = (b1.has(i, HitBatch::ANTISENSE_ALIGN) != 
+				    b2.has(j, HitBatch::ANTISENSE_ALIGN));
+		
+		consistent_splices = (num_spliced == 2 &&
+				      b1.has(i, HitBatch::ANTISENSE_SPLICE) == 
+				      b2.has(j, HitBatch::ANTISENSE_SPLICE));
+		
+		uint32_t ls = max(b1.longest_ref_skips[i], b2.longest_ref_skips[j]);
+		ls /= 100;
+		longest_ref_skip = min (ls, 0x7FFFFu);
+		
+		edit_dist = b1.edit_dists[i] + b2.edit_dists[j];
+		
+		assert(!(too_far && too_close));
+	}
+	
 	InsertAlignmentGrade& operator=(const InsertAlignmentGrade& rhs)
 	{
 		too_close = rhs.too_close;
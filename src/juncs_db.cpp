@@ -23,13 +23,18 @@
 #include <stdexcept>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <seqan/sequence.h>
 #include <seqan/find.h>
 #include <seqan/file.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "common.h"
 #include "bwt_map.h"
+#include "reads.h"
 #include "tokenize.h"
 #include "junctions.h"
 #include "insertions.h"
@@ -45,7 +50,36 @@ using std::set;
 static int read_length = -1;
 void print_usage()
 {
-    fprintf(stderr, "Usage:   juncs_db <min_anchor> <read_length> <splice_coords1,...,splice_coordsN> <insertion_coords1,...,insertion_coordsN> <deletion_coords1,...,deletion_coordsN> <ref.fa>\n");
+    fprintf(stderr, "Usage:   juncs_db <min_anchor> <read_length> <splice_coords1,...,splice_coordsN> <insertion_coords1,...,insertion_coordsN> <deletion_coords1,...,deletion_coordsN> <ref.fa> [<segments1.fq,...,segmentsN.fq> <segments1.bwtout,...,segmentsN.bwtout>]\n");
+}
+
+/*
+ * A flank sequence as written to segment_juncs.fa: the name encodes the
+ * junction, insertion or deletion, seq is the genomic sequence around it.
+ */
+struct FlankSeq
+{
+  string name;
+  string seq;
+};
+
+// When segments are mapped in-process, the flanks are collected here
+// instead of being printed as FASTA
+static vector<FlankSeq>* flank_store = NULL;
+
+static void emit_flank(const string& name, const string& seq, ostream& splice_db)
+{
+  if (flank_store)
+    {
+      flank_store->push_back(FlankSeq());
+      flank_store->back().name = name;
+      flank_store->back().seq = seq;
+    }
+  else
+    {
+      splice_db << ">" << name << endl;
+      splice_db << seq << endl;
+    }
 }
 
 typedef vector<string> Mapped;
@@ -59,6 +93,343 @@ bool splice_junc_lt(const pair<size_t, size_t>& lhs,
 		return lhs.second < rhs.second;
 }
 
+/*
+ * The flank printers read a reference sequence through one of these: a
+ * sequence decoded whole from the FASTA, or windows of it fetched through
+ * a FastaIndex.  append() adds the bases [begin, end) to out.
+ */
+struct LoadedRefSeq
+{
+  LoadedRefSeq(RefSequenceTable::Sequence& s) : seq(s) {}
+
+  size_t length() const { return seqan::length(seq); }
+
+  void append(string& out, size_t begin, size_t end) const
+  {
+    if (end <= begin)
+      return;
+    ostringstream os;
+    os << infix(seq, begin, end);
+    out += os.str();
+  }
+
+  RefSequenceTable::Sequence& seq;
+};
+
+/*
+ * Random access to the sequences of a FASTA file through a samtools-style
+ * index (name, length, offset, bases and bytes per line), so that flanks
+ * can be fetched without decoding the whole reference.
+ */
+class FastaIndex
+{
+public:
+  FastaIndex() : _fp(NULL) {}
+  ~FastaIndex() { if (_fp) fclose(_fp); }
+
+  // Loads fai_name if it was written for a FASTA of this size, else
+  // indexes ref_name and saves the index as fai_name.  False if the FASTA
+  // cannot be indexed (lines of uneven length within a sequence).
+  bool open(const string& ref_name, const string& fai_name);
+
+  size_t num_seqs() const { return _entries.size(); }
+  const string& name(size_t i) const { return _entries[i].name; }
+  size_t length(size_t i) const { return (size_t)_entries[i].length; }
+
+  // Appends the bases [begin, end) of sequence i to out, as Dna5
+  void fetch(size_t i, size_t begin, size_t end, string& out);
+
+private:
+  struct Entry
+  {
+    string name;
+    uint64_t length;
+    uint64_t offset;
+    uint64_t line_bases;
+    uint64_t line_width;
+  };
+
+  bool load(const string& fai_name, uint64_t ref_size);
+  bool build();
+  void save(const string& fai_name, uint64_t ref_size);
+
+  FILE* _fp;
+  vector<Entry> _entries;
+  vector<char> _buf;
+};
+
+bool FastaIndex::open(const string& ref_name, const string& fai_name)
+{
+  struct stat st;
+  if (stat(ref_name.c_str(), &st) != 0)
+    return false;
+  _fp = fopen(ref_name.c_str(), "rb");
+  if (_fp == NULL)
+    return false;
+  if (load(fai_name, (uint64_t)st.st_size))
+    return true;
+  _entries.clear();
+  if (!build())
+    return false;
+  save(fai_name, (uint64_t)st.st_size);
+  return true;
+}
+
+bool FastaIndex::load(const string& fai_name, uint64_t ref_size)
+{
+  FILE* f = fopen(fai_name.c_str(), "r");
+  if (f == NULL)
+    return false;
+  char line[4096];
+  unsigned long long size = 0;
+  bool ok = fgets(line, sizeof(line), f) &&
+    sscanf(line, "#%llu", &size) == 1 && size == ref_size;
+  while (ok && fgets(line, sizeof(line), f))
+    {
+      char name[4096];
+      unsigned long long len, off, bases, width;
+      if (sscanf(line, "%s\t%llu\t%llu\t%llu\t%llu", name, &len, &off, &bases, &width) != 5)
+	{
+	  ok = false;
+	  break;
+	}
+      Entry e;
+      e.name = name;
+      e.length = len;
+      e.offset = off;
+      e.line_bases = bases;
+      e.line_width = width;
+      _entries.push_back(e);
+    }
+  fclose(f);
+  return ok;
+}
+
+bool FastaIndex::build()
+{
+  fprintf(stderr, "Indexing the reference sequences\n");
+  static const size_t line_max = 1 << 20;
+  vector<char> line(line_max);
+  uint64_t pos = 0;
+  bool in_seq = false;
+  bool last_line = false; // a shorter line was seen, so the sequence must end
+  Entry e;
+  rewind(_fp);
+  while (fgets(&line[0], line_max, _fp))
+    {
+      size_t n = strlen(&line[0]);
+      if (n == line_max - 1 && line[n - 1] != '\n')
+	return false;
+      pos += n;
+      if (line[0] == '>')
+	{
+	  if (in_seq)
+	    _entries.push_back(e);
+	  string name(&line[1], n - 1);
+	  string::size_type space_pos = name.find_first_of(" \t\r\n");
+	  if (space_pos != string::npos)
+	    name.resize(space_pos);
+	  e.name = name;
+	  e.length = 0;
+	  e.offset = pos;
+	  e.line_bases = 0;
+	  e.line_width = 0;
+	  in_seq = true;
+	  last_line = false;
+	  continue;
+	}
+      if (!in_seq)
+	return false;
+      size_t bases = n;
+      while (bases > 0 && (line[bases - 1] == '\n' || line[bases - 1] == '\r'))
+	--bases;
+      for (size_t i = 0; i < bases; ++i)
+	{
+	  if (isspace(line[i]))
+	    return false;
+	}
+      if (bases == 0)
+	{
+	  last_line = true;
+	  continue;
+	}
+      if (last_line)
+	return false;
+      if (e.line_bases == 0)
+	{
+	  e.line_bases = bases;
+	  e.line_width = n;
+	}
+      else if (bases != e.line_bases || n != e.line_width)
+	{
+	  if (bases > e.line_bases)
+	    return false;
+	  last_line = true;
+	}
+      e.length += bases;
+    }
+  if (in_seq)
+    _entries.push_back(e);
+  return true;
+}
+
+void FastaIndex::save(const string& fai_name, uint64_t ref_size)
+{
+  // written aside and renamed, as several runs may share the cache
+  char tmp_name[4096];
+  snprintf(tmp_name, sizeof(tmp_name), "%s.%d", fai_name.c_str(), (int)getpid());
+  FILE* f = fopen(tmp_name, "w");
+  if (f == NULL)
+    {
+      fprintf(stderr, "Warning: cannot write %s\n", fai_name.c_str());
+      return;
+    }
+  fprintf(f, "#%llu\n", (unsigned long long)ref_size);
+  for (size_t i = 0; i < _entries.size(); ++i)
+    {
+      const Entry& e = _entries[i];
+      fprintf(f, "%s\t%llu\t%llu\t%llu\t%llu\n", e.name.c_str(),
+	      (unsigned long long)e.length, (unsigned long long)e.offset,
+	      (unsigned long long)e.line_bases, (unsigned long long)e.line_width);
+    }
+  if (fclose(f) != 0 || rename(tmp_name, fai_name.c_str()) != 0)
+    {
+      fprintf(stderr, "Warning: cannot write %s\n", fai_name.c_str());
+      unlink(tmp_name);
+    }
+}
+
+void FastaIndex::fetch(size_t i, size_t begin, size_t end, string& out)
+{
+  const Entry& e = _entries[i];
+  if (end > e.length)
+    end = e.length;
+  if (end <= begin)
+    return;
+  uint64_t first = e.offset + (begin / e.line_bases) * e.line_width + begin % e.line_bases;
+  uint64_t last = e.offset + ((end - 1) / e.line_bases) * e.line_width + (end - 1) % e.line_bases;
+  _buf.resize(last - first + 1);
+  if (fseeko(_fp, (off_t)first, SEEK_SET) != 0 ||
+      fread(&_buf[0], 1, _buf.size(), _fp) != _buf.size())
+    err_die("Error: cannot read %s from the reference\n", e.name.c_str());
+  for (size_t k = 0; k < _buf.size(); ++k)
+    {
+      // the same conversion as reading the FASTA into a Dna5String
+      switch (_buf[k])
+	{
+	case '\n': case '\r': break;
+	case 'A': case 'a': out += 'A'; break;
+	case 'C': case 'c': out += 'C'; break;
+	case 'G': case 'g': out += 'G'; break;
+	case 'T': case 't': case 'U': case 'u': out += 'T'; break;
+	default: out += 'N';
+	}
+    }
+}
+
+struct IndexedRefSeq
+{
+  IndexedRefSeq(FastaIndex& f, size_t i) : fai(f), seq_id(i) {}
+
+  size_t length() const { return fai.length(seq_id); }
+
+  void append(string& out, size_t begin, size_t end) const
+  {
+    fai.fetch(seq_id, begin, end, out);
+  }
+
+  FastaIndex& fai;
+  size_t seq_id;
+};
+
+/*
+ * --flank-cache: the flanks of annotated junctions, kept across runs in
+ * <flank_cache>.<read_length>.flanks as "ref left right strand name seq"
+ * lines.  Runs sharing an annotation only extract the flanks of their
+ * novel junctions; each run appends the annotated flanks it was missing.
+ */
+class FlankCache
+{
+public:
+  void load(const string& fname);
+
+  bool find(const string& key, FlankSeq& flank) const
+  {
+    map<string, FlankSeq>::const_iterator f = _flanks.find(key);
+    if (f == _flanks.end())
+      return false;
+    flank = f->second;
+    return true;
+  }
+
+  void add(const string& key, const FlankSeq& flank)
+  {
+    _added += key + "\t" + flank.name + "\t" + flank.seq + "\n";
+    _flanks[key] = flank;
+  }
+
+  // Appends the new flanks with a single write, so that concurrent runs
+  // do not interleave their lines
+  void save();
+
+private:
+  string _fname;
+  map<string, FlankSeq> _flanks;
+  string _added;
+};
+
+void FlankCache::load(const string& fname)
+{
+  _fname = fname;
+  FILE* f = fopen(fname.c_str(), "r");
+  if (f == NULL)
+    return;
+  char line[8192];
+  while (fgets(line, sizeof(line), f))
+    {
+      char* nl = strchr(line, '\n');
+      if (nl == NULL)
+	continue; // cut off by a run still appending
+      *nl = 0;
+      // the key is the first four fields
+      char* p = line;
+      for (int t = 0; t < 4 && p; ++t)
+	{
+	  p = strchr(p, '\t');
+	  if (p) ++p;
+	}
+      char* seq = p ? strchr(p, '\t') : NULL;
+      if (seq == NULL)
+	continue;
+      FlankSeq flank;
+      flank.name.assign(p, seq - p);
+      flank.seq = seq + 1;
+      _flanks[string(line, p - 1 - line)] = flank;
+    }
+  fclose(f);
+  fprintf(stderr, "Loaded %lu cached splice flanks\n", (long unsigned int)_flanks.size());
+}
+
+void FlankCache::save()
+{
+  if (_added.empty())
+    return;
+  int fd = ::open(_fname.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+  if (fd < 0 || write(fd, _added.data(), _added.size()) != (ssize_t)_added.size())
+    fprintf(stderr, "Warning: cannot add to the flank cache %s\n", _fname.c_str());
+  if (fd >= 0)
+    close(fd);
+  _added.clear();
+}
+
+static string junction_key(const string& ref_name, const Junction& junction)
+{
+  char buf[64];
+  snprintf(buf, sizeof(buf), "\t%u\t%u\t%c", junction.left, junction.right,
+	   junction.antisense ? '-' : '+');
+  return ref_name + buf;
+}
+
 /**
  * Given an insertion set, this code will print FASTA entries
  * for the surrounding sequence. The names of the FASTA entries
@@ -66,10 +437,10 @@ bool splice_junc_lt(const pair<size_t, size_t>& lhs,
  * insertion. The entry is generally of the form
  * <contig>|<left end of fasta sequence>|<position of insertion>-<sequence of insertion>|<right end of fasta sequence>|ins|<[fwd|rev]>
  */ 
-template<typename TStr>
+template<typename TRef>
 void print_insertion(const Insertion& insertion,
 		     int read_len,
-		     TStr& ref_str,
+		     const TRef& ref,
 		     const string& ref_name,
 		     ostream& splice_db)
 {
@@ -77,32 +448,38 @@ void print_insertion(const Insertion& insertion,
   
   size_t left_start, right_start;
   size_t left_end, right_end;
-  if (insertion.left >= 0 && insertion.left <= length(ref_str))
+  if (insertion.left >= 0 && insertion.left <= ref.length())
     {
       left_start = (int)insertion.left - half_splice_len + 1 >= 0 ? (int)insertion.left - half_splice_len + 1 : 0;
       left_end = left_start + half_splice_len;
       
       right_start = (int)left_end; 
-      right_end = right_start + half_splice_len  < length(ref_str) ? right_start + half_splice_len : length(ref_str);
+      right_end = right_start + half_splice_len  < ref.length() ? right_start + half_splice_len : ref.length();
       
-      Infix<RefSequenceTable::Sequence>::Type left_splice = infix(ref_str, left_start, left_end);
-      Infix<RefSequenceTable::Sequence>::Type right_splice = infix(ref_str, right_start, right_end); 
+      ostringstream name;
+      name << ref_name << "|" << left_start << "|" << insertion.left << "-" << insertion.sequence 
+	   << "|" << right_end << "|ins|" << ("fwd");
       
-      splice_db << ">" << ref_name << "|" << left_start << "|" << insertion.left << "-" << insertion.sequence 
-		<< "|" << right_end << "|ins|" << ("fwd")  << endl;
-      
-      splice_db << left_splice << insertion.sequence << right_splice << endl;
+      string seq;
+      ref.append(seq, left_start, left_end);
+      seq += insertion.sequence;
+      ref.append(seq, right_start, right_end);
+      emit_flank(name.str(), seq, splice_db);
     }
 }
 
 
-template<typename TStr>
-void print_splice(const Junction& junction,
-				  int read_len,
-				  const string& tag,
-				  TStr& ref_str,
-				  const string& ref_name,
-				  ostream& splice_db)
+/*
+ * Builds the flank of a junction (or a deletion posing as one); false if
+ * the junction lies outside of the reference.
+ */
+template<typename TRef>
+bool splice_flank(const Junction& junction,
+		  int read_len,
+		  const string& tag,
+		  const TRef& ref,
+		  const string& ref_name,
+		  FlankSeq& flank)
 {
   // daehwan - this is tentative, let's think about this more :)
   // int half_splice_len = read_len - min_anchor_len;
@@ -111,29 +488,112 @@ void print_splice(const Junction& junction,
   size_t left_start, right_start;
   size_t left_end, right_end;
   
-  if (junction.left >= 0 && junction.left <= length(ref_str) &&
-      junction.right >= 0 && junction.right <= length(ref_str))
+  if (junction.left >= 0 && junction.left <= ref.length() &&
+      junction.right >= 0 && junction.right <= ref.length())
     {
       left_start = (int)junction.left - half_splice_len + 1 >= 0 ? (int)junction.left - half_splice_len + 1 : 0;
       left_end = left_start + half_splice_len;
       
       right_start = junction.right;
-      right_end = right_start + half_splice_len < length(ref_str) ? right_start + half_splice_len : length(ref_str) - right_start;
-      
-      Infix<RefSequenceTable::Sequence>::Type left_splice = infix(ref_str,
-								  left_start, 
-								  left_end);
-      Infix<RefSequenceTable::Sequence>::Type right_splice = infix(ref_str, 
-								   right_start, 
-								   right_end);
+      right_end = right_start + half_splice_len < ref.length() ? right_start + half_splice_len : ref.length() - right_start;
       
-      splice_db << ">" << ref_name << "|" << left_start << "|" << junction.left <<
-	"-" << junction.right << "|" << right_end << "|" << tag << endl;
+      ostringstream name;
+      name << ref_name << "|" << left_start << "|" << junction.left <<
+	"-" << junction.right << "|" << right_end << "|" << tag;
       
-      splice_db << left_splice << right_splice << endl;
+      flank.name = name.str();
+      flank.seq.clear();
+      ref.append(flank.seq, left_start, left_end);
+      ref.append(flank.seq, right_start, right_end);
+      return true;
+    }
+  return false;
+}
+
+template<typename TRef>
+void print_splice(const Junction& junction,
+		  int read_len,
+		  const string& tag,
+		  const TRef& ref,
+		  const string& ref_name,
+		  ostream& splice_db)
+{
+  FlankSeq flank;
+  if (splice_flank(junction, read_len, tag, ref, ref_name, flank))
+    emit_flank(flank.name, flank.seq, splice_db);
+}
+
+/*
+ * Prints the flanks of the junctions on one reference sequence, taking
+ * them from the flank cache where possible; the annotated junctions whose
+ * flanks had to be extracted are added to the cache.
+ */
+template<typename TRef>
+void print_ref_splices(const JunctionSet& junctions,
+		       uint32_t refid,
+		       const TRef& ref,
+		       const string& ref_name,
+		       const std::set<Junction>& annotated,
+		       FlankCache* cache,
+		       ostream& splice_db)
+{
+  Junction dummy_left(refid, 0, 0, true);
+  Junction dummy_right(refid, VMAXINT32, VMAXINT32, true);
+  JunctionSet::const_iterator itr = junctions.lower_bound(dummy_left);
+  JunctionSet::const_iterator end = junctions.upper_bound(dummy_right);
+  for (; itr != end && itr != junctions.end(); ++itr)
+    {
+      const Junction& junction = itr->first;
+      const char* tag = junction.antisense ? "GTAG|rev" : "GTAG|fwd";
+      if (cache == NULL)
+	{
+	  print_splice(junction, read_length, tag, ref, ref_name, splice_db);
+	  continue;
+	}
+      string key = junction_key(ref_name, junction);
+      FlankSeq flank;
+      if (!cache->find(key, flank))
+	{
+	  if (!splice_flank(junction, read_length, tag, ref, ref_name, flank))
+	    continue;
+	  if (annotated.find(junction) != annotated.end())
+	    cache->add(key, flank);
+	}
+      emit_flank(flank.name, flank.seq, splice_db);
     }
 }
 
+// Deletions are printed as junctions with their own tags
+template<typename TRef>
+void print_ref_deletions(const std::set<Deletion>& deletions,
+			 uint32_t refid,
+			 const TRef& ref,
+			 const string& ref_name,
+			 ostream& splice_db)
+{
+  Deletion dummy_left(refid, 0, 0, true);
+  Deletion dummy_right(refid, VMAXINT32, VMAXINT32, true);
+  std::set<Deletion>::const_iterator itr = deletions.lower_bound(dummy_left);
+  std::set<Deletion>::const_iterator end = deletions.upper_bound(dummy_right);
+  for (; itr != end && itr != deletions.end(); ++itr)
+    print_splice((Junction)*itr, read_length, itr->antisense ? "del|rev" : "del|fwd", ref, ref_name, splice_db);
+}
+
+template<typename TRef>
+void print_ref_insertions(const std::set<Insertion>& insertions,
+			  uint32_t refid,
+			  const TRef& ref,
+			  const string& ref_name,
+			  ostream& splice_db)
+{
+  Insertion dummy_left(refid, 0, "");
+  Insertion dummy_right(refid, VMAXINT32, "");
+  std::set<Insertion>::const_iterator itr = insertions.lower_bound(dummy_left);
+  std::set<Insertion>::const_iterator upper = insertions.upper_bound(dummy_right);
+  for (; itr != upper && itr != insertions.end(); ++itr)
+    print_insertion(*itr, read_length, ref, ref_name, splice_db);
+}
+
 
 /**
  * Parse an int out of optarg and enforce that it be at least 'lower';
@@ -182,11 +642,14 @@ static int parse_oInt(int lower, char* arg, const char *errmsg) {
 void driver(const vector<FILE*>& splice_coords_files,
 			const vector<FILE*>& insertion_coords_files,
 			const vector<FILE*>& deletion_coords_files, 
+			const string& ref_file_name,
 			ifstream& ref_stream)
 {	
 	char splice_buf[2048];
 	RefSequenceTable rt(true);
 	JunctionSet junctions;
+	// junctions of the first annotated_juncs files, for the flank cache
+	std::set<Junction> annotated;
 	for (size_t i = 0; i < splice_coords_files.size(); ++i)
 	{
 		FILE* splice_coords = splice_coords_files[i];
@@ -220,6 +683,8 @@ void driver(const vector<FILE*>& splice_coords_files,
 			uint32_t right_coord = atoi(scan_right_coord);
 			bool antisense = *orientation == '-';
 			junctions.insert(make_pair<Junction, JunctionStats>(Junction(ref_id, left_coord, right_coord, antisense), JunctionStats()));
+			if ((int)i < annotated_juncs)
+				annotated.insert(Junction(ref_id, left_coord, right_coord, antisense));
 		}
 	}
 
@@ -318,7 +783,43 @@ void driver(const vector<FILE*>& splice_coords_files,
 
 
 	typedef RefSequenceTable::Sequence Reference;
-	
+
+	FlankCache cache;
+	FastaIndex fai;
+	bool indexed = false;
+	if (!flank_cache.empty())
+	{
+		char suffix[32];
+		sprintf(suffix, ".%d.flanks", read_length);
+		cache.load(flank_cache + suffix);
+		indexed = fai.open(ref_file_name, flank_cache + ".fai");
+		if (!indexed)
+			fprintf(stderr, "Warning: cannot index %s, reading it whole\n", ref_file_name.c_str());
+	}
+	FlankCache* junction_cache = flank_cache.empty() ? NULL : &cache;
+
+	if (indexed)
+	{
+		// only the windows around the junctions and indels are read
+		for (size_t i = 0; i < fai.num_seqs(); ++i)
+		{
+			IndexedRefSeq ref(fai, i);
+			print_ref_splices(junctions, rt.get_id(fai.name(i), NULL, 0), ref, fai.name(i), annotated, junction_cache, cout);
+		}
+		for (size_t i = 0; i < fai.num_seqs(); ++i)
+		{
+			IndexedRefSeq ref(fai, i);
+			print_ref_deletions(deletions, rt.get_id(fai.name(i), NULL, 0), ref, fai.name(i), cout);
+		}
+		for (size_t i = 0; i < fai.num_seqs(); ++i)
+		{
+			IndexedRefSeq ref(fai, i);
+			print_ref_insertions(insertions, rt.get_id(fai.name(i), NULL, 0), ref, fai.name(i), cout);
+		}
+		cache.save();
+		return;
+	}
+
 	while(ref_stream.good() && 
 		  !ref_stream.eof()) 
 	{
@@ -335,21 +836,9 @@ void driver(const vector<FILE*>& splice_coords_files,
 		read(ref_stream, ref_str, Fasta());
 		
 		uint32_t refid = rt.get_id(name, NULL, 0);
-		Junction dummy_left(refid, 0, 0, true);
-		Junction dummy_right(refid, VMAXINT32, VMAXINT32, true);
-		
-		pair<JunctionSet::iterator, JunctionSet::iterator> r;
-		r.first = junctions.lower_bound(dummy_left);
-		r.second = junctions.upper_bound(dummy_right);
-		
-		JunctionSet::iterator itr = r.first;
-		
-		while(itr != r.second && itr != junctions.end())
-		{
-			print_splice(itr->first, read_length, itr->first.antisense ? "GTAG|rev" : "GTAG|fwd", ref_str, name, cout);
-			++itr;
-		}
+		print_ref_splices(junctions, refid, LoadedRefSeq(ref_str), name, annotated, junction_cache, cout);
 	}
+	cache.save();
 
 
 	ref_stream.clear();
@@ -372,20 +861,7 @@ void driver(const vector<FILE*>& splice_coords_files,
 		read(ref_stream, ref_str, Fasta());
 		
 		uint32_t refid = rt.get_id(name, NULL,0);
-		Deletion dummy_left(refid, 0, 0, true);
-		Deletion dummy_right(refid, VMAXINT32, VMAXINT32, true);
-		
-		pair<std::set<Deletion>::iterator, std::set<Deletion>::iterator> r;
-		r.first = deletions.lower_bound(dummy_left);
-		r.second = deletions.upper_bound(dummy_right);
-		
-		std::set<Deletion>::iterator itr = r.first;
-		
-		while(itr != r.second && itr != deletions.end())
-		{
-			print_splice((Junction)*itr, read_length, itr->antisense ? "del|rev" : "del|fwd", ref_str, name, cout);
-			++itr;
-		}
+		print_ref_deletions(deletions, refid, LoadedRefSeq(ref_str), name, cout);
 	}
 
 	ref_stream.clear();
@@ -409,20 +885,402 @@ void driver(const vector<FILE*>& splice_coords_files,
 		read(ref_stream, ref_str, Fasta());
 		
 		uint32_t refid = rt.get_id(name, NULL,0);
-		Insertion dummy_left(refid, 0, "");
-		Insertion dummy_right(refid, VMAXINT32, "");
-	
-		std::set<Insertion>::iterator itr = insertions.lower_bound(dummy_left);
-		std::set<Insertion>::iterator upper   = insertions.upper_bound(dummy_right);
-
-		while(itr != upper && itr != insertions.end()){
-			print_insertion(*itr, read_length, ref_str, name, cout);	
-			++itr;
-		}	
+		print_ref_insertions(insertions, refid, LoadedRefSeq(ref_str), name, cout);
 	}
 
 }
 
+/*
+ * In-process replacement for bowtie-build + bowtie -v on segment_juncs.fa.
+ * Segments are aligned end-to-end to the flanks with at most
+ * segment_mismatches mismatches.  Candidates come from a q-gram directory
+ * over all flank positions: split a segment into p <= segment_mismatches + 1
+ * disjoint pieces of at least q bases and one of them has at most
+ * segment_mismatches / p mismatches at every valid alignment, so looking up
+ * that neighbourhood of each piece finds them all.  Segments shorter than q
+ * are checked against every flank position.
+ */
+static const int max_flank_qgram = 12;
+
+static inline int base_code(char c)
+{
+  switch (c)
+    {
+    case 'A': case 'a': return 0;
+    case 'C': case 'c': return 1;
+    case 'G': case 'g': return 2;
+    case 'T': case 't': return 3;
+    default: return -1;
+    }
+}
+
+// code of the q-gram of s starting at pos, -1 if it holds anything but ACGT
+static inline int qgram_code(const string& s, size_t pos, int q)
+{
+  int code = 0;
+  for (int i = 0; i < q; ++i)
+    {
+      int b = base_code(s[pos + i]);
+      if (b < 0)
+	return -1;
+      code = (code << 2) | b;
+    }
+  return code;
+}
+
+struct FlankHit
+{
+  FlankHit(uint32_t f = 0, uint32_t o = 0, bool rc = false) :
+    flank(f), offset(o), antisense(rc) {}
+
+  bool operator<(const FlankHit& rhs) const
+  {
+    if (flank != rhs.flank)
+      return flank < rhs.flank;
+    if (offset != rhs.offset)
+      return offset < rhs.offset;
+    return antisense < rhs.antisense;
+  }
+
+  bool operator==(const FlankHit& rhs) const
+  {
+    return flank == rhs.flank && offset == rhs.offset && antisense == rhs.antisense;
+  }
+
+  uint32_t flank;
+  uint32_t offset;
+  bool antisense; // the segment aligns reverse complemented
+};
+
+class FlankIndex
+{
+public:
+  FlankIndex(const vector<FlankSeq>& flanks, int q) : _flanks(flanks), _q(q)
+  {
+    _starts.push_back(0);
+    for (size_t f = 0; f < flanks.size(); ++f)
+      _starts.push_back(_starts.back() + (uint32_t)flanks[f].seq.length());
+
+    // counting sort of all flank positions by the q-gram starting there
+    _dir.assign(((size_t)1 << (2 * q)) + 1, 0);
+    for (int pass = 0; pass < 2; ++pass)
+      {
+	for (size_t f = 0; f < flanks.size(); ++f)
+	  {
+	    const string& seq = flanks[f].seq;
+	    for (size_t j = 0; j + q <= seq.length(); ++j)
+	      {
+		int code = qgram_code(seq, j, q);
+		if (code < 0)
+		  {
+		    if (pass == 0)
+		      _n_pos.push_back(_starts[f] + (uint32_t)j);
+		    continue;
+		  }
+		if (pass == 0)
+		  ++_dir[code + 1];
+		else
+		  _pos[_dir[code]++] = _starts[f] + (uint32_t)j;
+	      }
+	  }
+	if (pass == 0)
+	  {
+	    for (size_t b = 1; b < _dir.size(); ++b)
+	      _dir[b] += _dir[b - 1];
+	    _pos.resize(_dir.back());
+	  }
+	else
+	  {
+	    // the fill pass moved each bucket start onto the next bucket's
+	    for (size_t b = _dir.size() - 1; b > 0; --b)
+	      _dir[b] = _dir[b - 1];
+	    _dir[0] = 0;
+	  }
+      }
+  }
+
+  // Appends the alignments of seq (already reverse complemented if
+  // antisense) with at most max_mismatches mismatches
+  void align(const string& seq,
+	     bool antisense,
+	     int max_mismatches,
+	     vector<FlankHit>& hits) const
+  {
+    size_t len = seq.length();
+    size_t num_pieces = min((size_t)max_mismatches + 1, len / _q);
+    if (num_pieces == 0)
+      {
+	scan(seq, antisense, max_mismatches, hits);
+	return;
+      }
+    size_t piece_step = len / num_pieces;
+    // fewer pieces than max_mismatches + 1 when seq is short; then the best
+    // of them may still carry this many mismatches
+    int piece_mismatches = max_mismatches / (int)num_pieces;
+
+    size_t first = hits.size();
+    vector<int> codes;
+    for (size_t p = 0; p < num_pieces; ++p)
+      {
+	uint32_t piece_offset = (uint32_t)(p * piece_step);
+	codes.clear();
+	qgram_neighbours(seq, piece_offset, 0, 0, piece_mismatches, codes);
+	for (size_t c = 0; c < codes.size(); ++c)
+	  {
+	    int code = codes[c];
+	    for (uint32_t k = _dir[code]; k < _dir[code + 1]; ++k)
+	      add_candidate(_pos[k], piece_offset, len, antisense, hits);
+	  }
+	// an N in the flank is just one more mismatch inside such a piece
+	if (piece_mismatches > 0)
+	  {
+	    for (size_t k = 0; k < _n_pos.size(); ++k)
+	      add_candidate(_n_pos[k], piece_offset, len, antisense, hits);
+	  }
+      }
+
+    sort(hits.begin() + first, hits.end());
+    hits.erase(unique(hits.begin() + first, hits.end()), hits.end());
+
+    size_t kept = first;
+    for (size_t h = first; h < hits.size(); ++h)
+      {
+	if (mismatches(seq, hits[h], max_mismatches) <= max_mismatches)
+	  hits[kept++] = hits[h];
+      }
+    hits.resize(kept);
+  }
+
+  // Adds the alignment placing the piece at piece_offset of a segment of
+  // length len onto flank position pos, if the segment fits in the flank
+  void add_candidate(uint32_t pos,
+		     uint32_t piece_offset,
+		     size_t len,
+		     bool antisense,
+		     vector<FlankHit>& hits) const
+  {
+    size_t f = upper_bound(_starts.begin(), _starts.end(), pos) - _starts.begin() - 1;
+    uint32_t in_flank = pos - _starts[f];
+    if (in_flank < piece_offset)
+      return;
+    uint32_t start = in_flank - piece_offset;
+    if (start + len > _flanks[f].seq.length())
+      return;
+    hits.push_back(FlankHit((uint32_t)f, start, antisense));
+  }
+
+  // Collects the codes of all q-grams within max_mismatches of the one at
+  // seq[pos], an N being a mismatch against every base
+  void qgram_neighbours(const string& seq,
+			size_t pos,
+			int i,
+			int code,
+			int max_mismatches,
+			vector<int>& codes) const
+  {
+    if (i == _q)
+      {
+	codes.push_back(code);
+	return;
+      }
+    int b = base_code(seq[pos + i]);
+    for (int c = 0; c < 4; ++c)
+      {
+	int mm = (c == b) ? 0 : 1;
+	if (mm <= max_mismatches)
+	  qgram_neighbours(seq, pos, i + 1, (code << 2) | c, max_mismatches - mm, codes);
+      }
+  }
+
+  // Tries seq at every flank offset, for segments shorter than a q-gram
+  void scan(const string& seq,
+	    bool antisense,
+	    int max_mismatches,
+	    vector<FlankHit>& hits) const
+  {
+    size_t len = seq.length();
+    for (size_t f = 0; f < _flanks.size(); ++f)
+      {
+	size_t flank_len = _flanks[f].seq.length();
+	for (size_t start = 0; start + len <= flank_len; ++start)
+	  {
+	    FlankHit hit((uint32_t)f, (uint32_t)start, antisense);
+	    if (mismatches(seq, hit, max_mismatches) <= max_mismatches)
+	      hits.push_back(hit);
+	  }
+      }
+  }
+
+  // N never matches, as with bowtie -v; counting stops once past stop
+  int mismatches(const string& seq, const FlankHit& hit, int stop) const
+  {
+    const char* ref = _flanks[hit.flank].seq.c_str() + hit.offset;
+    int mm = 0;
+    for (size_t i = 0; i < seq.length() && mm <= stop; ++i)
+      {
+	if (seq[i] != ref[i] || seq[i] == 'N')
+	  ++mm;
+      }
+    return mm;
+  }
+
+  const FlankSeq& flank(uint32_t f) const { return _flanks[f]; }
+
+private:
+  const vector<FlankSeq>& _flanks;
+  int _q;
+  vector<uint32_t> _starts;   // offset of each flank in the position space
+  vector<uint32_t> _dir;      // q-gram code -> first entry in _pos
+  vector<uint32_t> _pos;      // flank positions grouped by q-gram
+  vector<uint32_t> _n_pos;    // flank positions whose q-gram holds an N
+};
+
+/*
+ * Aligns every step-th read of a batch, starting with the first-th, and
+ * formats its alignments as bowtie's default output would.
+ */
+struct SegmentMapWorker
+{
+  SegmentMapWorker(const FlankIndex* _index,
+		   const vector<Read>* _reads,
+		   vector<string>* _out,
+		   size_t _first,
+		   size_t _step) :
+    index(_index),
+    reads(_reads),
+    out(_out),
+    first(_first),
+    step(_step) {}
+
+  void operator()()
+  {
+    vector<FlankHit> hits;
+    string fwd, rev, rev_qual;
+    for (size_t r = first; r < reads->size(); r += step)
+      {
+	const Read& read = (*reads)[r];
+	fwd = read.seq;
+	for (size_t i = 0; i < fwd.length(); ++i)
+	  fwd[i] = toupper(fwd[i]);
+	rev = fwd;
+	reverse_complement(rev);
+
+	hits.clear();
+	index->align(fwd, false, segment_mismatches, hits);
+	index->align(rev, true, segment_mismatches, hits);
+
+	// bowtie -k/-m: reads with too many alignments are not reported
+	string& lines = (*out)[r];
+	lines.clear();
+	if (hits.empty() || hits.size() > max_multihits)
+	  continue;
+
+	string qual = read.qual;
+	if (qual.length() != fwd.length())
+	  qual.assign(fwd.length(), 'I');
+	rev_qual.assign(qual.rbegin(), qual.rend());
+
+	for (size_t h = 0; h < hits.size(); ++h)
+	  {
+	    const FlankHit& hit = hits[h];
+	    const string& seq = hit.antisense ? rev : fwd;
+	    const char* ref = index->flank(hit.flank).seq.c_str() + hit.offset;
+
+	    // mismatch offsets are relative to the 5' end of the read
+	    string mismatches;
+	    char mm_buf[32];
+	    size_t len = seq.length();
+	    for (size_t k = 0; k < len; ++k)
+	      {
+		size_t i = hit.antisense ? len - 1 - k : k;
+		if (seq[i] == ref[i] && seq[i] != 'N')
+		  continue;
+		if (!mismatches.empty())
+		  mismatches += ",";
+		sprintf(mm_buf, "%d:%c>%c", (int)k, ref[i], seq[i]);
+		mismatches += mm_buf;
+	      }
+
+	    lines += read.name;
+	    lines += hit.antisense ? "\t-\t" : "\t+\t";
+	    lines += index->flank(hit.flank).name;
+	    sprintf(mm_buf, "\t%u\t", hit.offset);
+	    lines += mm_buf;
+	    lines += seq;
+	    lines += "\t";
+	    lines += hit.antisense ? rev_qual : qual;
+	    lines += "\t0\t";
+	    lines += mismatches;
+	    lines += "\n";
+	  }
+      }
+  }
+
+  const FlankIndex* index;
+  const vector<Read>* reads;
+  vector<string>* out;
+  size_t first;
+  size_t step;
+};
+
+void map_segments(const vector<FlankSeq>& flanks,
+		  const vector<string>& segment_file_names,
+		  const vector<string>& map_file_names)
+{
+  if (color)
+    err_die("Error: in-process segment mapping does not support colorspace reads\n");
+
+  int q = min(segment_length, 20) / (segment_mismatches + 1);
+  q = max(4, min(q, max_flank_qgram));
+  fprintf(stderr, "Indexing %lu splice flanks\n", (long unsigned int)flanks.size());
+  FlankIndex index(flanks, q);
+
+  static const size_t batch_size = 100000;
+  size_t num_workers = max(num_cpus, 1);
+  for (size_t s = 0; s < segment_file_names.size(); ++s)
+    {
+      string seg_file_name = segment_file_names[s];
+      string unzcmd = getUnpackCmd(seg_file_name, false);
+      FZPipe seg_file(seg_file_name, unzcmd);
+      if (seg_file.file == NULL)
+	err_die("Error: cannot open %s for reading\n", seg_file_name.c_str());
+      FLineReader fr(seg_file);
+
+      FZPipe map_file;
+      if (getFext(map_file_names[s]) == "z")
+	map_file.openWrite(map_file_names[s].c_str(), zpacker);
+      else
+	map_file.openWrite(map_file_names[s].c_str());
+      if (map_file.file == NULL)
+	err_die("Error: cannot open %s for writing\n", map_file_names[s].c_str());
+
+      fprintf(stderr, "Mapping %s against splice flanks\n", segment_file_names[s].c_str());
+      vector<Read> reads;
+      vector<string> out;
+      bool more = true;
+      while (more)
+	{
+	  reads.clear();
+	  Read read;
+	  while (reads.size() < batch_size && (more = next_fastx_read(fr, read, FASTQ)))
+	    reads.push_back(read);
+	  if (reads.empty())
+	    break;
+
+	  out.resize(reads.size());
+	  vector<SegmentMapWorker> workers;
+	  for (size_t w = 0; w < min(num_workers, reads.size()); ++w)
+	    workers.push_back(SegmentMapWorker(&index, &reads, &out, w, min(num_workers, reads.size())));
+	  run_tasks(workers);
+
+	  for (size_t r = 0; r < reads.size(); ++r)
+	    fputs(out[r].c_str(), map_file.file);
+	}
+      map_file.close();
+      seg_file.close();
+    }
+}
+
 int main(int argc, char** argv)
 {
 	fprintf(stderr, "juncs_db v%s (%s)\n", PACKAGE_VERSION, SVN_REVISION); 
@@ -467,8 +1325,8 @@ int main(int argc, char** argv)
 		{
 			fprintf(stderr, "Warning: cannot open %s for reading\n",
 					splice_coords_file_names[s].c_str());
-			continue;
 		}
+		// kept even if NULL, as --annotated-juncs counts file positions
 		coords_files.push_back(coords_file);
 	}
 	if(optind >= argc) 
@@ -537,7 +1395,31 @@ int main(int argc, char** argv)
 				ref_file_name.c_str());
 		exit(1);
 	}
-    
-	driver(coords_files, insertion_coords_files, deletion_coords_files, ref_stream);
+
+	if (optind + 1 < argc)
+	{
+		/*
+		 * Segment files were given: map them against the flanks here
+		 * instead of printing segment_juncs.fa for bowtie-build
+		 */
+		vector<string> segment_file_names;
+		vector<string> map_file_names;
+		tokenize(argv[optind++], ",", segment_file_names);
+		tokenize(argv[optind++], ",", map_file_names);
+		if (segment_file_names.size() != map_file_names.size())
+		{
+			fprintf(stderr, "Error: need one output file per segment file\n");
+			print_usage();
+			return 1;
+		}
+		vector<FlankSeq> flanks;
+		flank_store = &flanks;
+		driver(coords_files, insertion_coords_files, deletion_coords_files, ref_file_name, ref_stream);
+		flank_store = NULL;
+		map_segments(flanks, segment_file_names, map_file_names);
+		return 0;
+	}
+
+	driver(coords_files, insertion_coords_files, deletion_coords_files, ref_file_name, ref_stream);
     return 0;
 }
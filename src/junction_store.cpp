@@ -0,0 +1,305 @@
+/*
+ *  junction_store.cpp
+ *  TopHat
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <cstring>
+#include <algorithm>
+
+#include "common.h"
+#include "junction_store.h"
+
+static const char junction_store_magic[8] = {'T', 'H', 'J', 'U', 'N', 'C', 'S', '1'};
+
+enum eJUNCTION_FLAGS
+  {
+    JUNC_ANTISENSE = 1,
+    JUNC_GTF_MATCH = 2,
+    JUNC_ACCEPTED = 4
+  };
+
+static const int num_junction_columns = 7;
+
+static void put_varint(vector<uint8_t>& col, uint32_t v)
+{
+  while (v >= 0x80)
+    {
+      col.push_back((uint8_t)(v | 0x80));
+      v >>= 7;
+    }
+  col.push_back((uint8_t)v);
+}
+
+static bool get_varint(const vector<uint8_t>& col, size_t& pos, uint32_t& v)
+{
+  v = 0;
+  int shift = 0;
+  while (pos < col.size() && shift < 35)
+    {
+      uint8_t b = col[pos++];
+      v |= (uint32_t)(b & 0x7F) << shift;
+      if (!(b & 0x80))
+	return true;
+      shift += 7;
+    }
+  return false;
+}
+
+bool is_junction_store(const string& fname)
+{
+  FILE* f = fopen(fname.c_str(), "rb");
+  if (!f)
+    return false;
+  char magic[sizeof(junction_store_magic)];
+  bool is_store = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+    memcmp(magic, junction_store_magic, sizeof(magic)) == 0;
+  fclose(f);
+  return is_store;
+}
+
+bool JunctionStoreWriter::open(const string& fname)
+{
+  close();
+  _fp = fopen(fname.c_str(), "wb");
+  if (!_fp)
+    return false;
+  _ok = fwrite(junction_store_magic, 1, sizeof(junction_store_magic), _fp) ==
+    sizeof(junction_store_magic);
+  return _ok;
+}
+
+void JunctionStoreWriter::add(const string& ref_name,
+			      const Junction& j,
+			      const JunctionStats& s)
+{
+  if (ref_name != _ref_name)
+    {
+      flush_section();
+      _ref_name = ref_name;
+    }
+  _juncs.push_back(j);
+  _stats.push_back(s);
+}
+
+bool JunctionStoreWriter::flush_section()
+{
+  if (_juncs.empty() || !_fp)
+    return _ok;
+
+  vector<uint8_t> cols[num_junction_columns];
+  uint32_t prev_left = 0;
+  for (size_t i = 0; i < _juncs.size(); ++i)
+    {
+      const Junction& j = _juncs[i];
+      const JunctionStats& s = _stats[i];
+      put_varint(cols[0], j.left - prev_left);
+      put_varint(cols[1], j.right - j.left);
+      cols[2].push_back((j.antisense ? JUNC_ANTISENSE : 0) |
+			(s.gtf_match ? JUNC_GTF_MATCH : 0) |
+			(s.accepted ? JUNC_ACCEPTED : 0));
+      put_varint(cols[3], s.supporting_hits);
+      put_varint(cols[4], s.left_extent);
+      put_varint(cols[5], s.right_extent);
+      put_varint(cols[6], s.min_splice_mms);
+      prev_left = j.left;
+    }
+
+  uint32_t name_len = _ref_name.length();
+  uint32_t count = _juncs.size();
+  _ok = _ok &&
+    fwrite(&name_len, sizeof(name_len), 1, _fp) == 1 &&
+    fwrite(_ref_name.c_str(), 1, name_len, _fp) == name_len &&
+    fwrite(&count, sizeof(count), 1, _fp) == 1;
+  for (int c = 0; _ok && c < num_junction_columns; ++c)
+    {
+      uint32_t col_len = cols[c].size();
+      _ok = fwrite(&col_len, sizeof(col_len), 1, _fp) == 1 &&
+	fwrite(&cols[c][0], 1, col_len, _fp) == col_len;
+    }
+
+  _juncs.clear();
+  _stats.clear();
+  return _ok;
+}
+
+bool JunctionStoreWriter::close()
+{
+  if (!_fp)
+    return true;
+  flush_section();
+  if (fclose(_fp) != 0)
+    _ok = false;
+  _fp = NULL;
+  _ref_name.clear();
+  return _ok;
+}
+
+bool JunctionStoreReader::open(const string& fname)
+{
+  close();
+  _fp = fopen(fname.c_str(), "rb");
+  if (!_fp)
+    return false;
+  _fname = fname;
+  char magic[sizeof(junction_store_magic)];
+  if (fread(magic, 1, sizeof(magic), _fp) != sizeof(magic) ||
+      memcmp(magic, junction_store_magic, sizeof(magic)) != 0)
+    {
+      close();
+      return false;
+    }
+  return true;
+}
+
+void JunctionStoreReader::close()
+{
+  if (_fp)
+    fclose(_fp);
+  _fp = NULL;
+  _ref_name.clear();
+  _juncs.clear();
+  _stats.clear();
+  _pos = 0;
+}
+
+bool JunctionStoreReader::read_section()
+{
+  _juncs.clear();
+  _stats.clear();
+  _pos = 0;
+
+  uint32_t name_len = 0;
+  if (fread(&name_len, sizeof(name_len), 1, _fp) != 1)
+    return false;
+
+  vector<char> name(name_len + 1, 0);
+  uint32_t count = 0;
+  bool ok = fread(&name[0], 1, name_len, _fp) == name_len &&
+    fread(&count, sizeof(count), 1, _fp) == 1;
+
+  vector<uint8_t> cols[num_junction_columns];
+  for (int c = 0; ok && c < num_junction_columns; ++c)
+    {
+      uint32_t col_len = 0;
+      ok = fread(&col_len, sizeof(col_len), 1, _fp) == 1;
+      if (ok)
+	{
+	  cols[c].resize(col_len);
+	  ok = col_len == 0 || fread(&cols[c][0], 1, col_len, _fp) == col_len;
+	}
+    }
+  ok = ok && cols[2].size() == count;
+  if (!ok)
+    err_die("Error: junction store %s is truncated or corrupt\n", _fname.c_str());
+
+  _ref_name = &name[0];
+  uint32_t ref_id = RefSequenceTable::hash_string(_ref_name.c_str());
+  _juncs.resize(count);
+  _stats.resize(count);
+  size_t pos[num_junction_columns] = {0,};
+  uint32_t left = 0;
+  for (uint32_t i = 0; ok && i < count; ++i)
+    {
+      Junction& j = _juncs[i];
+      JunctionStats& s = _stats[i];
+      uint32_t delta = 0, span = 0, hits = 0, left_ext = 0, right_ext = 0, mms = 0;
+      ok = get_varint(cols[0], pos[0], delta) &&
+	get_varint(cols[1], pos[1], span) &&
+	get_varint(cols[3], pos[3], hits) &&
+	get_varint(cols[4], pos[4], left_ext) &&
+	get_varint(cols[5], pos[5], right_ext) &&
+	get_varint(cols[6], pos[6], mms);
+      if (!ok)
+	break;
+      uint8_t flags = cols[2][i];
+
+      left += delta;
+      j.refid = ref_id;
+      j.left = left;
+      j.right = left + span;
+      j.antisense = flags & JUNC_ANTISENSE;
+      s.supporting_hits = hits;
+      s.left_extent = left_ext;
+      s.right_extent = right_ext;
+      s.min_splice_mms = mms;
+      s.gtf_match = flags & JUNC_GTF_MATCH;
+      s.accepted = flags & JUNC_ACCEPTED;
+    }
+  if (!ok)
+    err_die("Error: junction store %s is truncated or corrupt\n", _fname.c_str());
+  return true;
+}
+
+bool JunctionStoreReader::next(Junction& j, JunctionStats& s)
+{
+  if (!_fp)
+    return false;
+  while (_pos >= _juncs.size())
+    {
+      if (!read_section())
+	return false;
+    }
+  j = _juncs[_pos];
+  s = _stats[_pos];
+  ++_pos;
+  return true;
+}
+
+struct JunctionRefOrder
+{
+  JunctionRefOrder(RefSequenceTable& rt) : ref_sequences(rt) {}
+
+  bool operator()(uint32_t lhs, uint32_t rhs) const
+  {
+    return strcmp(ref_sequences.get_name(lhs), ref_sequences.get_name(rhs)) < 0;
+  }
+
+  RefSequenceTable& ref_sequences;
+};
+
+bool write_junction_store(const string& fname,
+			  const JunctionSet& junctions,
+			  RefSequenceTable& ref_sequences)
+{
+  // A JunctionSet is ordered by reference id; a store wants name order
+  vector<uint32_t> ref_ids;
+  for (JunctionSet::const_iterator i = junctions.begin(); i != junctions.end(); ++i)
+    {
+      if (ref_ids.empty() || ref_ids.back() != i->first.refid)
+	ref_ids.push_back(i->first.refid);
+    }
+  sort(ref_ids.begin(), ref_ids.end(), JunctionRefOrder(ref_sequences));
+
+  JunctionStoreWriter writer;
+  if (!writer.open(fname))
+    return false;
+  for (size_t r = 0; r < ref_ids.size(); ++r)
+    {
+      string ref_name = ref_sequences.get_name(ref_ids[r]);
+      JunctionSet::const_iterator i = junctions.lower_bound(Junction(ref_ids[r], 0, 0, false));
+      for (; i != junctions.end() && i->first.refid == ref_ids[r]; ++i)
+	writer.add(ref_name, i->first, i->second);
+    }
+  return writer.close();
+}
+
+bool read_junction_store(const string& fname, JunctionSet& junctions)
+{
+  JunctionStoreReader reader;
+  if (!reader.open(fname))
+    return false;
+  Junction j;
+  JunctionStats s;
+  while (reader.next(j, s))
+    {
+      pair<JunctionSet::iterator, bool> ins = junctions.insert(make_pair(j, s));
+      if (!ins.second)
+	merge_junction_stats(ins.first->second, s);
+    }
+  return true;
+}
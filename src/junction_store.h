@@ -0,0 +1,97 @@
+#ifndef JUNCTION_STORE_H
+#define JUNCTION_STORE_H
+/*
+ *  junction_store.h
+ *  TopHat
+ *
+ *  A compact binary file of junctions and their JunctionStats, so that
+ *  junction catalogs from many samples can be merged without re-parsing
+ *  BED text.
+ *
+ *  The file is a sequence of per-reference sections in reference name
+ *  order.  Each section holds its junctions sorted by (left, right,
+ *  strand) as separate columns: LEB128-encoded deltas of the left
+ *  coordinates, intron lengths, flags, supporting hit counts, extents and
+ *  splice mismatches.  Readers decode one section at a time, so a store
+ *  can be streamed in constant memory per reference.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "junctions.h"
+
+using namespace std;
+
+// True if fname starts with the junction store magic
+bool is_junction_store(const string& fname);
+
+class JunctionStoreWriter
+{
+public:
+  JunctionStoreWriter() : _fp(NULL), _ok(true) {}
+  ~JunctionStoreWriter() { close(); }
+
+  bool open(const string& fname);
+
+  // Junctions must be added grouped by reference, references in name
+  // order, and sorted by Junction::operator< within a reference.
+  void add(const string& ref_name, const Junction& j, const JunctionStats& s);
+
+  // Writes the last section and closes the file; false on a write error.
+  bool close();
+
+private:
+  bool flush_section();
+
+  FILE* _fp;
+  bool _ok;
+  string _ref_name;
+  vector<Junction> _juncs;
+  vector<JunctionStats> _stats;
+};
+
+class JunctionStoreReader
+{
+public:
+  JunctionStoreReader() : _fp(NULL), _pos(0) {}
+  ~JunctionStoreReader() { close(); }
+
+  bool open(const string& fname);
+  void close();
+
+  // Reads the next junction in store order, false at the end of the file.
+  // Junction::refid is set to the RefSequenceTable id of ref_name().
+  bool next(Junction& j, JunctionStats& s);
+
+  const string& ref_name() const { return _ref_name; }
+
+private:
+  bool read_section();
+
+  FILE* _fp;
+  string _fname;
+  string _ref_name;
+  vector<Junction> _juncs;
+  vector<JunctionStats> _stats;
+  size_t _pos;
+};
+
+/*
+ * Writes junctions to a store, grouping them by the names in
+ * ref_sequences; returns false if the file could not be written.
+ */
+bool write_junction_store(const string& fname,
+			  const JunctionSet& junctions,
+			  RefSequenceTable& ref_sequences);
+
+/*
+ * Adds the junctions of a store to junctions, combining the stats of the
+ * ones already there with merge_junction_stats(); returns false if fname
+ * is not a junction store.
+ */
+bool read_junction_store(const string& fname, JunctionSet& junctions);
+
+#endif
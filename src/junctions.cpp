@@ -84,6 +84,16 @@ void print_junction(FILE* junctions_out,
 	  j.right - (j.left - s.left_extent));
 }
 
+void merge_junction_stats(JunctionStats& merged, const JunctionStats& s)
+{
+  merged.left_extent = max(merged.left_extent, s.left_extent);
+  merged.right_extent = max(merged.right_extent, s.right_extent);
+  merged.min_splice_mms = min(merged.min_splice_mms, s.min_splice_mms);
+  merged.supporting_hits += s.supporting_hits;
+  merged.gtf_match = merged.gtf_match || s.gtf_match;
+  merged.accepted = merged.accepted || s.accepted;
+}
+
 void junctions_from_alignment(const BowtieHit& spliced_alignment,
 			      JunctionSet& junctions)
 {
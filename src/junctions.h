@@ -99,6 +99,9 @@ typedef std::map<Junction, JunctionStats> JunctionSet;
 // This routine DOES NOT set the real refid!  
 pair<Junction, JunctionStats> junction_from_spliced_hit(const BowtieHit& h);
 
+void junctions_from_spliced_hit(const BowtieHit& h, 
+				vector<pair<Junction, JunctionStats> >& new_juncs);
+
 void print_junction(FILE* junctions_out, 
 		    const string& name, 
 		    const Junction& j, 
@@ -109,6 +112,9 @@ void print_junction(FILE* junctions_out,
 void junctions_from_alignment(const BowtieHit& spliced_alignment,
 			      JunctionSet& junctions);
 
+// Combines the stats of one junction as seen in two sets of alignments
+void merge_junction_stats(JunctionStats& merged, const JunctionStats& s);
+
 void accept_valid_junctions(JunctionSet& junctions,
 			    const uint32_t refid,
 			    const vector<unsigned short>& DoC,
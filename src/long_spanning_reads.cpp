@@ -55,29 +55,6 @@ bool key_lt(const pair<uint32_t, HitsForRead>& lhs,
   return lhs.first < rhs.first;
 }
 
-void get_seqs(istream& ref_stream,
-        RefSequenceTable& rt,
-        bool keep_seqs = true,
-        bool strip_slash = false)
-{
-  while(ref_stream.good() &&
-  !ref_stream.eof())
-    {
-      RefSequenceTable::Sequence* ref_str = new RefSequenceTable::Sequence();
-      string name;
-      readMeta(ref_stream, name, Fasta());
-      string::size_type space_pos = name.find_first_of(" \t\r");
-      if (space_pos != string::npos)
-  {
-    name.resize(space_pos);
-  }
-      seqan::read(ref_stream, *ref_str, Fasta());
-
-      rt.get_id(name, keep_seqs ? ref_str : NULL, 0);
-    }
-}
-
-
 void look_right_for_hit_group(ReadTable& unmapped_reads,
             vector<HitStream>& contig_hits,
             size_t curr_file,
@@ -1102,6 +1079,12 @@ void join_segment_hits(GBamWriter& bam_writer, std::set<Junction>& possible_junc
     break;
   }
 
+      // --read-ids: hits outside the range belong to another process
+      if (read_in_process > read_id_last)
+        break;
+      if (read_in_process < read_id_first)
+        continue;
+
       if (contig_hits.size() > 1)
       {
         look_right_for_hit_group(unmapped_reads,
@@ -1188,7 +1171,7 @@ void driver(GBamWriter& bam_writer, istream& ref_stream,
 
   RefSequenceTable rt(true, true);
   fprintf (stderr, "Loading reference sequences...\n");
-  get_seqs(ref_stream, rt, true, false);
+  get_seqs(ref_stream, rt, true);
     fprintf (stderr, "        reference sequences loaded.\n");
   ReadTable it;
 
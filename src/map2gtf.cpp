@@ -24,7 +24,8 @@ Map2GTF::Map2GTF(std::string gtf_fname, std::string reads_fname) :
     }
     std::cout << "Reading the annotation file: " << gtf_fname_ << std::endl;
     gtfReader_.init(gtf_fhandle_, true); //only recognizable transcripts will be loaded
-    gtfReader_.readAll();
+    gtfReader_.setThreads(num_cpus);
+    gtfReader_.readAllCached(gtf_fname_.c_str());
 
     std::cout << "Initializing the SAMHitFactory." << std::endl;
     hitFactory_ = new BowtieHitFactory(readTable_, refSeqTable_);
@@ -232,7 +233,7 @@ void trans_to_genomic_coords(const char* read_name, HitFactory* hitFactory,
     }
     bool antisense_splice = (spliced && out.trans->strand=='-'); //transcript strand <=> splice strand (if spliced)
     read_start -= 1; // handle the off-by-one problem
-    out.hit = hitFactory->create_hit(read_id, ref_name,
+    out.hit = hitFactory->create_hit(read_id.c_str(), ref_name.c_str(),
             static_cast<int> (read_start), cig_list, in.antisense_align(),
             antisense_splice, in.edit_dist(), in.splice_mms(), in.end());
     out.hit.seq(in.seq());
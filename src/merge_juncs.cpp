@@ -0,0 +1,156 @@
+/*
+ *  merge_juncs.cpp
+ *  TopHat
+ *
+ *  Merges the junction stores of several samples into one catalog.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#else
+#define PACKAGE_VERSION "INTERNAL"
+#define SVN_REVISION "XXX"
+#endif
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <queue>
+#include <algorithm>
+#include <getopt.h>
+
+#include "common.h"
+#include "junctions.h"
+#include "junction_store.h"
+
+using namespace std;
+
+void print_usage()
+{
+	fprintf(stderr, "Usage:   merge_juncs [--junction-store <merged.jstore>] [--min-junc-support <N>] <juncs1.jstore> [... <juncsN.jstore>]\n");
+	fprintf(stderr, "         writes the merged junctions to stdout in the format of --raw-juncs\n");
+}
+
+// The head record of one input store
+struct StoreHead
+{
+	StoreHead(JunctionStoreReader* r) : reader(r) {}
+
+	JunctionStoreReader* reader;
+	Junction junc;
+	JunctionStats stats;
+};
+
+// Orders heads by (reference name, left, right, strand), smallest on top
+struct StoreHeadAfter
+{
+	bool operator()(const StoreHead& lhs, const StoreHead& rhs) const
+	{
+		int c = strcmp(lhs.reader->ref_name().c_str(), rhs.reader->ref_name().c_str());
+		if (c != 0)
+			return c > 0;
+		return rhs.junc < lhs.junc;
+	}
+};
+
+/*
+ * Streams a k-way merge of the input stores: only the current reference
+ * section of each store and one head record per store are in memory.
+ * Junctions present in several stores are combined with merge_junction_stats().
+ */
+void driver(const vector<string>& store_names)
+{
+	vector<JunctionStoreReader*> readers;
+	priority_queue<StoreHead, vector<StoreHead>, StoreHeadAfter> heads;
+	for (size_t i = 0; i < store_names.size(); ++i)
+	{
+		JunctionStoreReader* reader = new JunctionStoreReader();
+		if (!reader->open(store_names[i]))
+			err_die("Error: %s is not a junction store\n", store_names[i].c_str());
+		readers.push_back(reader);
+
+		StoreHead head(reader);
+		if (reader->next(head.junc, head.stats))
+			heads.push(head);
+	}
+
+	JunctionStoreWriter writer;
+	if (!junction_store.empty() && !writer.open(junction_store))
+		err_die("Error: cannot open %s for writing\n", junction_store.c_str());
+
+	size_t num_merged = 0;
+	size_t num_filtered = 0;
+	while (!heads.empty())
+	{
+		StoreHead head = heads.top();
+		heads.pop();
+		string ref_name = head.reader->ref_name();
+		Junction junc = head.junc;
+		JunctionStats stats = head.stats;
+		if (head.reader->next(head.junc, head.stats))
+			heads.push(head);
+
+		while (!heads.empty() &&
+			   heads.top().junc == junc &&
+			   heads.top().reader->ref_name() == ref_name)
+		{
+			head = heads.top();
+			heads.pop();
+			merge_junction_stats(stats, head.stats);
+			if (head.reader->next(head.junc, head.stats))
+				heads.push(head);
+		}
+
+		if (stats.supporting_hits < min_junc_support)
+		{
+			++num_filtered;
+			continue;
+		}
+
+		++num_merged;
+		fprintf(stdout,
+				"%s\t%d\t%d\t%c\n",
+				ref_name.c_str(),
+				junc.left - 1,
+				junc.right,
+				junc.antisense ? '-' : '+');
+		if (!junction_store.empty())
+			writer.add(ref_name, junc, stats);
+	}
+
+	if (!writer.close())
+		err_die("Error: could not write junction store %s\n", junction_store.c_str());
+	for (size_t i = 0; i < readers.size(); ++i)
+		delete readers[i];
+
+	fprintf(stderr, "Merged %lu junctions from %lu stores", num_merged, store_names.size());
+	if (num_filtered)
+		fprintf(stderr, " (%lu below --min-junc-support)", num_filtered);
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char** argv)
+{
+	fprintf(stderr, "merge_juncs v%s (%s)\n", PACKAGE_VERSION, SVN_REVISION);
+	fprintf(stderr, "---------------------------------------\n");
+
+	int parse_ret = parse_options(argc, argv, print_usage);
+	if (parse_ret)
+		return parse_ret;
+
+	if (optind >= argc)
+	{
+		print_usage();
+		return 1;
+	}
+
+	vector<string> store_names;
+	while (optind < argc)
+		store_names.push_back(argv[optind++]);
+
+	driver(store_names);
+
+	return 0;
+}
@@ -16,6 +16,7 @@
 #include <vector>
 #include <cstring>
 #include <cstdlib>
+#include <algorithm>
 
 #include "common.h"
 #include "reads.h"
@@ -129,79 +130,57 @@ void flt_reads_and_hits(vector<FZPipe>& reads_files) {
 }
 
 
-void process_reads(vector<FZPipe>& reads_files, vector<FZPipe>& quals_files)
-{	
-   //TODO: add the option to write the garbage reads into separate file(s)
-  int num_reads_chucked = 0;
-  int multimap_chucked=0;
-  int min_read_len = 20000000;
-  int max_read_len = 0;
-  uint32_t next_id = 0;
-  FILE* fw=NULL;
-  if (!aux_outfile.empty()) {
-    fw=fopen(aux_outfile.c_str(), "w");
-    if (fw==NULL)
-       err_die("Error: cannot create file %s\n",aux_outfile.c_str());
-    }
-
-  for (size_t fi = 0; fi < reads_files.size(); ++fi)
-    {
-      Read read;
-      FLineReader fr(reads_files[fi]);
-      skip_lines(fr);
-      FZPipe fq;
-      if (quals)
-	      fq = quals_files[fi];
-      FLineReader frq(fq);
-      skip_lines(frq);
-      
-      while (!fr.isEof()) {
-	    //read.clear();
-	    // Get the next read from the file
-        if (!next_fastx_read(fr, read, reads_format, ((quals) ? &frq : NULL)))
-            break;
-
-        ++next_id;
-        //IMPORTANT: to keep paired reads in sync, this must be
-        //incremented BEFORE any reads are chucked !
+// Per-library counters reported in the aux file
+struct ReadCounts
+{
+  ReadCounts() : chucked(0), multimap_chucked(0),
+		 min_read_len(20000000), max_read_len(0) {}
+  int chucked;
+  int multimap_chucked;
+  int min_read_len;
+  int max_read_len;
+};
 
+// Filters out a read or writes it to stdout under the numeric ID id
+void process_read(Read& read, uint32_t id, ReadCounts& counts)
+{
         if (read.seq.length()<12) {
-            ++num_reads_chucked;
-            continue;
+            ++counts.chucked;
+            return;
             }
-        if ((int)read.seq.length()<min_read_len)
-             min_read_len=read.seq.length();
-        if ((int)read.seq.length()>max_read_len)
-             max_read_len=read.seq.length();
+        if ((int)read.seq.length()<counts.min_read_len)
+             counts.min_read_len=read.seq.length();
+        if ((int)read.seq.length()>counts.max_read_len)
+             counts.max_read_len=read.seq.length();
 
         // daehwan - check this later, it's due to bowtie
         if (color && read.seq[1] == '4') {
-          ++num_reads_chucked;
-          continue;
+          ++counts.chucked;
+          return;
           }
 
-        if (readmap_loaded && check_readmap(next_id)) {
-          ++num_reads_chucked;
-          ++multimap_chucked;
-          continue;
+        if (readmap_loaded && check_readmap(id)) {
+          ++counts.chucked;
+          ++counts.multimap_chucked;
+          return;
           }
 	      format_qual_string(read.qual);
         std::transform(read.seq.begin(), read.seq.end(), read.seq.begin(), ::toupper);
-        char counts[256];
-        memset(counts, 0, sizeof(counts));
+        char counts_by_char[256];
+        memset(counts_by_char, 0, sizeof(counts_by_char));
         // Count up the bad characters
         for (unsigned int i = 0; i != read.seq.length(); ++i)
           {
             char c = (char)toupper(read.seq[i]);
-            counts[(size_t)c]++;
+            counts_by_char[(size_t)c]++;
           }
 
-        double percent_A = (double)(counts[(size_t)'A']) / read.seq.length();
-        double percent_C = (double)(counts[(size_t)'C']) / read.seq.length();
-        double percent_G = (double)(counts[(size_t)'G']) / read.seq.length();
-        double percent_T = (double)(counts[(size_t)'T']) / read.seq.length();
-        double percent_N = (double)(counts[(size_t)'N']) / read.seq.length();
-        double percent_4 = (double)(counts[(size_t)'4']) / read.seq.length();
+        double percent_A = (double)(counts_by_char[(size_t)'A']) / read.seq.length();
+        double percent_C = (double)(counts_by_char[(size_t)'C']) / read.seq.length();
+        double percent_G = (double)(counts_by_char[(size_t)'G']) / read.seq.length();
+        double percent_T = (double)(counts_by_char[(size_t)'T']) / read.seq.length();
+        double percent_N = (double)(counts_by_char[(size_t)'N']) / read.seq.length();
+        double percent_4 = (double)(counts_by_char[(size_t)'4']) / read.seq.length();
 
         // Chuck the read if there are at least 5 'N's or if it's mostly
         // (>90%) 'N's and 'A's
@@ -213,7 +192,7 @@ void process_reads(vector<FZPipe>& reads_files, vector<FZPipe>& quals_files)
             percent_N >= 0.1 ||
             percent_4 >= 0.1)
           {
-            ++num_reads_chucked;
+            ++counts.chucked;
           }
         else
           {
@@ -221,7 +200,7 @@ void process_reads(vector<FZPipe>& reads_files, vector<FZPipe>& quals_files)
               {
 
               printf("@%u\n%s\n+%s\n%s\n",
-               next_id,
+               id,
                read.seq.c_str(),
                read.name.c_str(),
                read.qual.c_str());
@@ -235,33 +214,133 @@ void process_reads(vector<FZPipe>& reads_files, vector<FZPipe>& quals_files)
                   qual = string(read.seq.length(), 'I').c_str();
 
                 printf("@%u\n%s\n+%s\n%s\n",
-                   next_id,
+                   id,
                    read.seq.c_str(),
                    read.name.c_str(),
                    qual.c_str());
               }
           }
+}
+
+// A read kept by --sample-reads, with the ID it has in the full library
+struct SampledRead
+{
+  uint64_t priority;
+  uint32_t id;
+  Read read;
+  
+  // heap order: the read with the highest priority is dropped first
+  bool operator<(const SampledRead& rhs) const
+  {
+    return priority < rhs.priority;
+  }
+};
+
+bool sampled_id_lt(const SampledRead& lhs, const SampledRead& rhs)
+{
+  return lhs.id < rhs.id;
+}
+
+// A fixed pseudo-random priority for a read ID (the splitmix64 finalizer).
+// The sample is made of the sample_reads reads with the lowest priorities,
+// which depends only on the IDs, so the left and right mate runs agree.
+uint64_t sample_priority(uint32_t id)
+{
+  uint64_t z = id + 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+void process_reads(vector<FZPipe>& reads_files, vector<FZPipe>& quals_files)
+{	
+   //TODO: add the option to write the garbage reads into separate file(s)
+  ReadCounts counts;
+  uint32_t next_id = 0;
+  FILE* fw=NULL;
+  if (!aux_outfile.empty()) {
+    fw=fopen(aux_outfile.c_str(), "w");
+    if (fw==NULL)
+       err_die("Error: cannot create file %s\n",aux_outfile.c_str());
+    }
+
+  // --sample-reads: a reservoir holding the reads with the lowest
+  // priorities seen so far, as a heap with the highest one on top
+  vector<SampledRead> sample;
+  if (sample_reads > 0)
+    sample.reserve(sample_reads);
+
+  for (size_t fi = 0; fi < reads_files.size(); ++fi)
+    {
+      Read read;
+      FLineReader fr(reads_files[fi]);
+      skip_lines(fr);
+      FZPipe fq;
+      if (quals)
+	      fq = quals_files[fi];
+      FLineReader frq(fq);
+      skip_lines(frq);
+      
+      while (!fr.isEof()) {
+	    //read.clear();
+	    // Get the next read from the file
+        if (!next_fastx_read(fr, read, reads_format, ((quals) ? &frq : NULL)))
+            break;
+
+        ++next_id;
+        //IMPORTANT: to keep paired reads in sync, this must be
+        //incremented BEFORE any reads are chucked !
+
+        if (sample_reads <= 0) {
+          process_read(read, next_id, counts);
+          continue;
+          }
+
+        uint64_t priority = sample_priority(next_id);
+        if ((int)sample.size() < sample_reads) {
+          sample.push_back(SampledRead());
+          }
+        else if (priority < sample.front().priority) {
+          pop_heap(sample.begin(), sample.end());
+          }
+        else continue;
+        sample.back().priority = priority;
+        sample.back().id = next_id;
+        sample.back().read = read;
+        push_heap(sample.begin(), sample.end());
       } //while !fr.isEof()
     fr.close();
     frq.close();
     } //for each input file
+
+  // the sampled reads are written in ID order, like the full library
+  sort(sample.begin(), sample.end(), sampled_id_lt);
+  for (size_t i = 0; i < sample.size(); ++i)
+    process_read(sample[i].read, sample[i].id, counts);
+
+  uint32_t num_reads = (sample_reads > 0) ? (uint32_t)sample.size() : next_id;
+  if (sample_reads > 0)
+    fprintf(stderr, "%u out of %u reads have been sampled\n",
+	    num_reads, next_id);
   fprintf(stderr, "%u out of %u reads have been filtered out\n",
-	  num_reads_chucked, next_id);
+	  counts.chucked, num_reads);
   if (readmap_loaded)
     fprintf(stderr, "\t(%u filtered out due to %s)\n",
-        multimap_chucked, flt_reads.c_str());
+        counts.multimap_chucked, flt_reads.c_str());
   if (fw!=NULL) {
-    fprintf(fw, "min_read_len=%d\n",min_read_len - (color ? 1 : 0));
-    fprintf(fw, "max_read_len=%d\n",max_read_len - (color ? 1 : 0));
+    fprintf(fw, "min_read_len=%d\n",counts.min_read_len - (color ? 1 : 0));
+    fprintf(fw, "max_read_len=%d\n",counts.max_read_len - (color ? 1 : 0));
     fprintf(fw, "reads_in =%d\n",next_id);
-    fprintf(fw, "reads_out=%d\n",next_id-num_reads_chucked);
+    fprintf(fw, "reads_out=%d\n",num_reads-counts.chucked);
+    if (sample_reads > 0)
+      fprintf(fw, "reads_sampled=%d\n",num_reads);
     fclose(fw);
     }
 }
 
 void print_usage()
 {
-  fprintf(stderr, "Usage:\n prep_reads [--filter-multi <multi.fq>] <reads1.fa/fq,...,readsN.fa/fq>\n");
+  fprintf(stderr, "Usage:\n prep_reads [--filter-multi <multi.fq>] [--sample-reads <N>] <reads1.fa/fq,...,readsN.fa/fq>\n");
   //alternate usage (--ctv_to_num) : doesn't filter out any reads,
   //but simply convert read names to numeric ids
 }
@@ -18,6 +18,10 @@
 #include <cstring>
 #include <cstdlib>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <seqan/find.h>
 #include <seqan/file.h>
 #include <seqan/modifier.h>
@@ -285,75 +289,58 @@ void reverse_complement(string& seq)
 	//fprintf(stderr, "rev: %s\n", seq.c_str());
 }
 
+/*
+ * Colorspace lookup tables.  Bases A, C, G, T are coded 0..3 (anything
+ * else, including lowercase, is 4), and the color of two adjacent bases is
+ * the XOR of their codes: "A0"->A, "A1"->C, "C1"->A, "G3"->C, etc.
+ */
+struct ColorTables
+{
+  unsigned char bp_code[256];     // base character -> 0..4
+  unsigned char color_code[256];  // '0'..'3' -> 0..3, anything else -> 5
+
+  ColorTables()
+  {
+    memset(bp_code, 4, sizeof(bp_code));
+    memset(color_code, 5, sizeof(color_code));
+    bp_code['A'] = 0;
+    bp_code['C'] = 1;
+    bp_code['G'] = 2;
+    bp_code['T'] = 3;
+    for (int c = 0; c < 4; ++c)
+      color_code['0' + c] = c;
+  }
+};
+
+static const ColorTables color_tables;
+
+// Next base in a colorspace read, or 'N' once the base or color is unknown
+static inline char next_color_bp(char base, char color)
+{
+  unsigned int b = color_tables.bp_code[(unsigned char)base];
+  unsigned int c = color_tables.color_code[(unsigned char)color];
+  return (b < 4 && c < 4) ? "ACGT"[b ^ c] : 'N';
+}
+
+// Color of two adjacent (uppercase) bases, '4' if either is not ACGT
+static inline char two_bps_color(char b1, char b2)
+{
+  unsigned int c1 = color_tables.bp_code[(unsigned char)b1];
+  unsigned int c2 = color_tables.bp_code[(unsigned char)b2];
+  return (c1 < 4 && c2 < 4) ? (char)('0' + (c1 ^ c2)) : '4';
+}
+
 string convert_color_to_bp(const string& color)
 {
   if (color.length() <= 0)
     return "";
 
   char base = color[0];
-  string bp;
+  string bp(color.length() - 1, 'N');
   for (string::size_type i = 1; i < color.length(); ++i)
     {
-      char next = color[i];
-      switch(base)
-	{
-	  // 'A0':'A', 'A1':'C', 'A2':'G', 'A3':'T', 'A4':'N', 'A.':'N',
-	case 'A':
-	  {
-	    switch(next)
-	      {
-	      case '0': next = 'A'; break;
-	      case '1': next = 'C'; break;
-	      case '2': next = 'G'; break;
-	      case '3': next = 'T'; break;
-	      default: next = 'N'; break;
-	      }
-	  }
-	  break;
-	case 'C':
-	  {
-	    // 'C0':'C', 'C1':'A', 'C2':'T', 'C3':'G', 'C4':'N', 'C.':'N',
-	     switch(next)
-	      {
-	      case '0': next = 'C'; break;
-	      case '1': next = 'A'; break;
-	      case '2': next = 'T'; break;
-	      case '3': next = 'G'; break;
-	      default: next = 'N'; break;
-	      }
-	  }
-	  break;
-	case 'G':
-	  {
-	    // 'G0':'G', 'G1':'T', 'G2':'A', 'G3':'C', 'G4':'N', 'G.':'N',
-	     switch(next)
-	      {
-	      case '0': next = 'G'; break;
-	      case '1': next = 'T'; break;
-	      case '2': next = 'A'; break;
-	      case '3': next = 'C'; break;
-	      default: next = 'N'; break;
-	      }
-	  }
-	  break;
-	case 'T':
-	  {
-	    // 'T0':'T', 'T1':'G', 'T2':'C', 'T3':'A', 'T4':'N', 'T.':'N',
-	     switch(next)
-	      {
-	      case '0': next = 'T'; break;
-	      case '1': next = 'G'; break;
-	      case '2': next = 'C'; break;
-	      case '3': next = 'A'; break;
-	      default: next = 'N'; break;
-	      }
-	  }
-	  break;
-	default: next = 'N'; break;
-	}
-
-      bp.push_back(next);
-      base = next;
+      base = next_color_bp(base, color[i]);
+      bp[i - 1] = base;
     }
 
   return bp;
@@ -365,90 +352,17 @@ seqan::String<char> convert_color_to_bp(char base, const seqan::String<char>& co
   if (seqan::length(color) <= 0)
     return "";
 
-  string bp;
-  for (string::size_type i = 0; i < seqan::length(color); ++i)
+  seqan::String<char> bp;
+  seqan::resize(bp, seqan::length(color));
+  for (size_t i = 0; i < seqan::length(color); ++i)
     {
-      char next = color[i];
-      switch(base)
-	{
-	  // 'A0':'A', 'A1':'C', 'A2':'G', 'A3':'T', 'A4':'N', 'A.':'N',
-	case 'A':
-	  {
-	    switch(next)
-	      {
-	      case '0': next = 'A'; break;
-	      case '1': next = 'C'; break;
-	      case '2': next = 'G'; break;
-	      case '3': next = 'T'; break;
-	      default: next = 'N'; break;
-	      }
-	  }
-	  break;
-	case 'C':
-	  {
-	    // 'C0':'C', 'C1':'A', 'C2':'T', 'C3':'G', 'C4':'N', 'C.':'N',
-	     switch(next)
-	      {
-	      case '0': next = 'C'; break;
-	      case '1': next = 'A'; break;
-	      case '2': next = 'T'; break;
-	      case '3': next = 'G'; break;
-	      default: next = 'N'; break;
-	      }
-	  }
-	  break;
-	case 'G':
-	  {
-	    // 'G0':'G', 'G1':'T', 'G2':'A', 'G3':'C', 'G4':'N', 'G.':'N',
-	     switch(next)
-	      {
-	      case '0': next = 'G'; break;
-	      case '1': next = 'T'; break;
-	      case '2': next = 'A'; break;
-	      case '3': next = 'C'; break;
-	      default: next = 'N'; break;
-	      }
-	  }
-	  break;
-	case 'T':
-	  {
-	    // 'T0':'T', 'T1':'G', 'T2':'C', 'T3':'A', 'T4':'N', 'T.':'N',
-	     switch(next)
-	      {
-	      case '0': next = 'T'; break;
-	      case '1': next = 'G'; break;
-	      case '2': next = 'C'; break;
-	      case '3': next = 'A'; break;
-	      default: next = 'N'; break;
-	      }
-	  }
-	  break;
-	default: next = 'N'; break;
-	}
-
-      bp.push_back(next);
-      base = next;
+      base = next_color_bp(base, color[i]);
+      bp[i] = base;
     }
 
   return bp;
 }
 
-
-#define check_color(b1, b2, c1, c2) ((b1 == c1 && b2 == c2) || (b1 == c2 && b2 == c1))
-
-#define two_bps_to_color(b1, b2, c)				      \
-  if (((b1) == 'A' || (b1) == 'G' || (b1) == 'C' || (b1) == 'T') && (b1) == (b2)) \
-  c = '0'; \
-  else if (check_color((b1), (b2), 'A', 'C') || check_color((b1), (b2), 'G', 'T')) \
-  c = '1'; \
-  else if (check_color((b1), (b2), 'A', 'G') || check_color((b1), (b2), 'C', 'T')) \
-  c = '2'; \
-  else if (check_color((b1), (b2), 'A', 'T') || check_color((b1), (b2), 'C', 'G')) \
-  c = '3'; \
-  else \
-  c = '4';
- 
-
 string convert_bp_to_color(const string& bp, bool remove_primer)
 {
   if (bp.length() <= 1)
@@ -456,17 +370,14 @@ string convert_bp_to_color(const string& bp, bool remove_primer)
 
   char base = toupper(bp[0]);
   string color;
+  color.reserve(bp.length());
   if (!remove_primer)
     color.push_back(base);
   
   for (string::size_type i = 1; i < bp.length(); ++i)
     {
       char next = toupper(bp[i]);
-
-      char c = '0';
-      two_bps_to_color(base, next, c);
-      color.push_back(c);
-
+      color.push_back(two_bps_color(base, next));
       base = next;
     }
 
@@ -480,18 +391,15 @@ seqan::String<char> convert_bp_to_color(const seqan::String<char>& bp, bool remo
     return "";
 
   char base = toupper(bp[0]);
-  string color;
+  seqan::String<char> color;
+  seqan::reserve(color, seqan::length(bp));
   if (!remove_primer)
-    color.push_back(base);
+    seqan::appendValue(color, base);
   
-  for (string::size_type i = 1; i < seqan::length(bp); ++i)
+  for (size_t i = 1; i < seqan::length(bp); ++i)
     {
       char next = toupper(bp[i]);
-
-      char c = '0';
-      two_bps_to_color(base, next, c);
-      color.push_back(c);
-
+      seqan::appendValue(color, two_bps_color(base, next));
       base = next;
     }
 
@@ -499,84 +407,137 @@ seqan::String<char> convert_bp_to_color(const seqan::String<char>& bp, bool remo
 }
 
 /*
+ * One step of the BWA decoding recurrence for the four bases (states) j at
+ * a read position, given the previous row f_prev / ptr_prev:
+ *
+ *   f[j] = min over k of f_prev[k] + w(k, j)
+ *
+ * where w depends on whether the colors k^j and ptr_prev[k]^k agree with the
+ * read's current and previous colors.  The four states are evaluated
+ * together; all sums are unsigned and wrap exactly like the scalar version,
+ * and ties keep the smallest k.
  */
-void BWA_decode(const string& color, const string& qual, const string& ref, string& decode)
+static inline void BWA_decode_step(const unsigned int* f_prev,
+				   const char* ptr_prev,
+				   unsigned int q,
+				   unsigned int q_prev,
+				   unsigned int color_curr,
+				   unsigned int color_prev,
+				   unsigned int ref_base,
+				   unsigned int* f,
+				   char* ptr)
 {
-  assert(color.length() == ref.length() - 1);
-  
-  const size_t max_length = 256;
-  const unsigned int max_value = max_length * 0xff;
-  size_t length = color.length();
-  if (length < 1 || length + 1 > max_length)
-    {
-      return;
-    }
-
-  unsigned int f[max_length * 4];
-  char ptr[max_length * 4];
+  const unsigned int max_value = 256 * 0xff;
+#ifdef __SSE2__
+  const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+  const __m128i sign = _mm_set1_epi32(0x80000000);
+  __m128i best = _mm_set1_epi32(max_value);
+  __m128i best_k = _mm_setzero_si128();
+  const __m128i ref_lane = _mm_cmpeq_epi32(lanes, _mm_set1_epi32(ref_base));
+#endif
+  unsigned int f_scalar[4] = {max_value, max_value, max_value, max_value};
 
-  unsigned int q_prev = 0;
-  for (unsigned int i = 0; i < length + 1; ++i)
+  for (unsigned int k = 0; k < 4; ++k)
     {
-      unsigned int q = (unsigned int) (qual.length() <= i ? 'I' : qual[i]) - 33;
+      // the state j whose color from k matches the read (none if color_curr > 3)
+      unsigned int j_match = color_curr < 4 ? (k ^ color_curr) : 4;
+      unsigned int ref_color_prev = ptr_prev[k] < 4 ? (unsigned int)(ptr_prev[k] ^ k) : 4;
+      bool prev_match = color_prev < 4 && color_prev == ref_color_prev;
+
+      // q_hat and the color penalty for a matching and a mismatching j
+      unsigned int q_hat_match = prev_match ? q + q_prev : q - q_prev;
+      unsigned int q_hat_mismatch = prev_match ? q_prev - q : 0;
+
+#ifdef __SSE2__
+      __m128i match = _mm_cmpeq_epi32(lanes, _mm_set1_epi32(j_match));
+      // w = (j == ref ? 0 : q_hat) + (j == j_match ? 0 : q)
+      __m128i q_hat = _mm_or_si128(_mm_and_si128(match, _mm_set1_epi32(q_hat_match)),
+				   _mm_andnot_si128(match, _mm_set1_epi32(q_hat_mismatch)));
+      __m128i w = _mm_add_epi32(_mm_andnot_si128(ref_lane, q_hat),
+				_mm_andnot_si128(match, _mm_set1_epi32(q)));
+      __m128i f_k = _mm_add_epi32(_mm_set1_epi32(f_prev[k]), w);
+      __m128i less = _mm_cmplt_epi32(_mm_xor_si128(f_k, sign), _mm_xor_si128(best, sign));
+      best = _mm_or_si128(_mm_and_si128(less, f_k), _mm_andnot_si128(less, best));
+      best_k = _mm_or_si128(_mm_and_si128(less, _mm_set1_epi32(k)), _mm_andnot_si128(less, best_k));
+#else
       for (unsigned int j = 0; j < 4; ++j)
 	{
-	  size_t i_j = i * 4 + j;
-	  if (i == 0)
+	  unsigned int f_k = f_prev[k] +
+	    (j == ref_base ? 0 : (j == j_match ? q_hat_match : q_hat_mismatch)) +
+	    (j == j_match ? 0 : q);
+	  if (f_k < f_scalar[j])
 	    {
-	      f[i_j] = "ACGT"[j] == ref[i] ? 0 : q;
-	      ptr[i_j] = 4;
-	      continue;
+	      f_scalar[j] = f_k;
+	      ptr[j] = k;
 	    }
+	}
+#endif
+    }
 
-	  f[i_j] = max_value;
-	  char base = "ACGT"[j];
-	  for (unsigned int k = 0; k < 4; ++k)
-	    {
-	      char base_prev = "ACGT"[k];
-	      char ref_color;
-	      two_bps_to_color(base_prev, base, ref_color);
+#ifdef __SSE2__
+  unsigned int ks[4];
+  _mm_storeu_si128((__m128i*)f_scalar, best);
+  _mm_storeu_si128((__m128i*)ks, best_k);
+  for (unsigned int j = 0; j < 4; ++j)
+    ptr[j] = ks[j];
+#endif
+  for (unsigned int j = 0; j < 4; ++j)
+    f[j] = f_scalar[j];
+}
 
-	      char base_prev_prev = "ACGTN"[ptr[(i-1)*4 + k]];
-	      char ref_color_prev;
-	      two_bps_to_color(base_prev_prev, base_prev, ref_color_prev);
+/*
+ * Scratch space for BWA_decode: the scores of the last two columns only,
+ * and the traceback pointers of every column, on the stack.
+ */
+struct BWADecodeBuffer
+{
+  static const size_t max_length = 256;
 
-	      char color_curr = color[i-1];
-	      char color_prev = i >= 2 ? color[i-2] : '4';	      
+  unsigned int f[2][4];
+  char ptr[max_length * 4];
+};
 
-	      int q_hat = 0;
-	      if (color_prev == ref_color_prev && color_prev != '4')
-		{
-		  if (color_curr == ref_color)
-		    q_hat = q + q_prev;
-		  else
-		    q_hat = q_prev - q;
-		}
-	      else if (color_curr == ref_color)
-		{
-		  q_hat = q - q_prev;
-		}
+void BWA_decode(const string& color, const string& qual, const string& ref, string& decode)
+{
+  assert(color.length() == ref.length() - 1);
+  
+  const size_t max_length = BWADecodeBuffer::max_length;
+  BWADecodeBuffer buf;
+  size_t length = color.length();
+  if (length < 1 || length + 1 > max_length)
+    {
+      return;
+    }
 
-	      unsigned int f_k = f[(i-1) * 4 + k] +
-		(base == ref[i] ? 0 : q_hat) +
-		(color_curr == ref_color ? 0 : q);
+  const unsigned char* bp_code = color_tables.bp_code;
+  const unsigned char* color_code = color_tables.color_code;
 
-	      if (f_k < f[i_j])
-		{
-		  f[i_j] = f_k;
-		  ptr[i_j] = k;
-		}
-	    }
-	}
+  unsigned int q_prev = (unsigned int) (qual.length() <= 0 ? 'I' : qual[0]) - 33;
+  unsigned int ref_base = bp_code[(unsigned char)ref[0]];
+  for (unsigned int j = 0; j < 4; ++j)
+    {
+      buf.f[0][j] = j == ref_base ? 0 : q_prev;
+      buf.ptr[j] = 4;
+    }
 
+  for (unsigned int i = 1; i < length + 1; ++i)
+    {
+      unsigned int q = (unsigned int) (qual.length() <= i ? 'I' : qual[i]) - 33;
+      unsigned int color_curr = color_code[(unsigned char)color[i-1]];
+      unsigned int color_prev = i >= 2 ? color_code[(unsigned char)color[i-2]] : 4;
+      BWA_decode_step(buf.f[(i - 1) & 1], buf.ptr + (i - 1) * 4,
+		      q, q_prev, color_curr, color_prev,
+		      bp_code[(unsigned char)ref[i]],
+		      buf.f[i & 1], buf.ptr + i * 4);
       q_prev = q;
     }
 
+  const unsigned int* f_last = buf.f[length & 1];
   unsigned int min_index = 0;
-  unsigned int min_f = f[length * 4];
+  unsigned int min_f = f_last[0];
   for (unsigned int i = 1; i < 4; ++i)
     {
-      unsigned int temp_f = f[length * 4 + i];
+      unsigned int temp_f = f_last[i];
       if (temp_f < min_f)
 	{
 	  min_f = temp_f;
@@ -588,7 +549,7 @@ void BWA_decode(const string& color, const string& qual, const string& ref, stri
   decode[length] = "ACGT"[min_index];
   for (unsigned int i = length; i > 0; --i)
     {
-      min_index = ptr[i * 4 + min_index];
+      min_index = buf.ptr[i * 4 + min_index];
       decode[i-1] = "ACGT"[min_index];
     }
 }
@@ -11,11 +11,13 @@
 
 #include <string>
 #include <sstream>
+#include <vector>
 #include <seqan/sequence.h>
 #include "common.h"
 #include <queue>
 
 using std::string;
+using std::vector;
 
 static const int max_read_bp = 256;
 
@@ -15,10 +15,12 @@
 #endif
 
 #include <getopt.h>
+#include <algorithm>
 
 #include "common.h"
 #include "bwt_map.h"
 #include "junctions.h"
+#include "reads.h"
 
 
 void get_junctions_from_hitstream(HitStream& hitstream,
@@ -56,59 +58,232 @@ void get_junctions_from_hitstream(HitStream& hitstream,
 }
 
 
-void driver(FILE* hit_map)
-{	
-    ReadTable it;
-    
-    RefSequenceTable rt(sam_header, true);
-	
-    SAMHitFactory hit_factory(it,rt);
-	
-	//HitStream hitstream(hit_map, &hit_factory, false, true, true);
-	
-    JunctionSet junctions;
-    
-    while (hit_map && !feof(hit_map))
+static const size_t junc_chunk_records = 50000;
+
+/*
+ * One chunk of input records, read on the main thread and handed to a
+ * worker.  BAM records are decoded into reused bam1_t buffers, SAM records
+ * are kept as text lines.
+ */
+struct RecordChunk
+{
+	RecordChunk() : count(0) {}
+	~RecordChunk()
 	{
-        char bwt_buf[2048];
-		if (!fgets(bwt_buf, 2048, hit_map))
-        {
-            break;
-        }
-		// Chomp the newline
-		char* nl = strrchr(bwt_buf, '\n');
-		if (nl) *nl = 0;
-		
-		// Get a new record from the tab-delimited Bowtie map
-		BowtieHit bh;
-		
-		if (hit_factory.get_hit_from_buf(bwt_buf, bh, false))
+		for (size_t i = 0; i < recs.size(); ++i)
+			bam_destroy1(recs[i]);
+	}
+
+	vector<bam1_t*> recs;
+	vector<string> lines;
+	size_t count;
+
+	const char* record(size_t i) const
+	{
+		return recs.empty() ? lines[i].c_str() : (const char*)recs[i];
+	}
+};
+
+// Reads up to junc_chunk_records records into chunk, returns false once
+// the input is exhausted.
+bool read_bam_chunk(samfile_t* sam_file, RecordChunk& chunk)
+{
+	if (chunk.recs.empty())
+	{
+		chunk.recs.resize(junc_chunk_records);
+		for (size_t i = 0; i < junc_chunk_records; ++i)
+			chunk.recs[i] = bam_init1();
+	}
+	chunk.count = 0;
+	while (chunk.count < junc_chunk_records &&
+		   samread(sam_file, chunk.recs[chunk.count]) > 0)
+		++chunk.count;
+	return chunk.count == junc_chunk_records;
+}
+
+bool read_sam_chunk(FLineReader& sam_reader, RecordChunk& chunk)
+{
+	chunk.lines.resize(junc_chunk_records);
+	chunk.count = 0;
+	while (chunk.count < junc_chunk_records)
+	{
+		const char* line = sam_reader.nextLine();
+		if (line == NULL)
+			return false;
+		if (*line == '@')
+			continue;
+		chunk.lines[chunk.count++] = line;
+	}
+	return true;
+}
+
+/*
+ * Per-worker junction accumulator: a flat vector of junctions that is
+ * sorted and deduplicated whenever it has doubled since the last time, so
+ * it stays close to the number of distinct junctions seen.  Each worker
+ * has its own hit factory and tables; reference ids are hashes of the
+ * names, so they agree between workers.
+ */
+struct ChunkJunctions
+{
+	ChunkJunctions(bam_header_t* header) :
+		rt(true), factory(NULL), compacted(0)
+	{
+		if (header)
 		{
-            junctions_from_alignment(bh, junctions);
+			BAMHitFactory* bam_factory = new BAMHitFactory(it, rt);
+			bam_factory->set_header(header);
+			factory = bam_factory;
+		}
+		else
+		{
+			factory = new SAMHitFactory(it, rt);
+		}
+	}
+
+	~ChunkJunctions()
+	{
+		delete factory;
+	}
+
+	void compact()
+	{
+		sort(juncs.begin(), juncs.end());
+		juncs.erase(unique(juncs.begin(), juncs.end()), juncs.end());
+		compacted = juncs.size();
+	}
 
+	void add_chunk(const RecordChunk& chunk)
+	{
+		vector<pair<Junction, JunctionStats> > hit_juncs;
+		for (size_t i = 0; i < chunk.count; ++i)
+		{
+			BowtieHit bh;
+			if (!factory->get_hit_from_buf(chunk.record(i), bh, false))
+				continue;
+
+			hit_juncs.clear();
+			junctions_from_spliced_hit(bh, hit_juncs);
+			for (size_t j = 0; j < hit_juncs.size(); ++j)
+				juncs.push_back(hit_juncs[j].first);
 		}
+		if (juncs.size() > 2 * compacted + junc_chunk_records)
+			compact();
 	}
-    
-    for (JunctionSet::iterator itr = junctions.begin();
-         itr != junctions.end();
-         ++itr)
+
+	ReadTable it;
+	RefSequenceTable rt;
+	HitFactory* factory;
+	vector<Junction> juncs;
+	size_t compacted;
+};
+
+struct ChunkJunctionsWorker
+{
+	ChunkJunctionsWorker(ChunkJunctions* j, const RecordChunk* c) :
+		juncs(j), chunk(c) {}
+
+	void operator()()
 	{
-        const char* ref_name = rt.get_name(itr->first.refid);
-    
-        fprintf(stdout,
-                "%s\t%d\t%d\t%c\n",
-                ref_name,
-                itr->first.left - 1,
-                itr->first.right,
-                itr->first.antisense ? '-' : '+');
-    }
-    
-	fprintf(stderr, "Extracted %lu junctions\n", junctions.size()); 
+		juncs->add_chunk(*chunk);
+	}
+
+	ChunkJunctions* juncs;
+	const RecordChunk* chunk;
+};
+
+void driver(const string& map_filename)
+{
+	// BAM records are decoded by samtools, SAM text is read line by line
+	// so records of any length work
+	samfile_t* sam_file = NULL;
+	FILE* map_file = NULL;
+	FLineReader* sam_reader = NULL;
+	if (getFext(map_filename) == "bam")
+	{
+		sam_file = samopen(map_filename.c_str(), "rb", 0);
+		if (sam_file == NULL || sam_file->header == NULL)
+			err_die("Error: cannot open BAM file %s for reading\n",
+					map_filename.c_str());
+	}
+	else
+	{
+		map_file = fopen(map_filename.c_str(), "r");
+		if (!map_file)
+			err_die("Error: cannot open map file %s for reading\n",
+					map_filename.c_str());
+		sam_reader = new FLineReader(map_file);
+	}
+
+	// Each round reads one chunk per worker, then extracts their junctions
+	// in parallel
+	int num_workers = max(1, num_cpus);
+	vector<ChunkJunctions*> worker_juncs;
+	vector<RecordChunk> chunks(num_workers);
+	for (int i = 0; i < num_workers; ++i)
+		worker_juncs.push_back(new ChunkJunctions(sam_file ? sam_file->header : NULL));
+
+	bool more = true;
+	while (more)
+	{
+		vector<ChunkJunctionsWorker> workers;
+		for (int i = 0; more && i < num_workers; ++i)
+		{
+			more = sam_file ? read_bam_chunk(sam_file, chunks[i])
+				: read_sam_chunk(*sam_reader, chunks[i]);
+			if (chunks[i].count > 0)
+				workers.push_back(ChunkJunctionsWorker(worker_juncs[i], &chunks[i]));
+		}
+		if (!workers.empty())
+			run_tasks(workers);
+	}
+
+	// Sort-reduce the per-worker junctions, which gives the same order as
+	// a JunctionSet
+	RefSequenceTable rt(sam_header, true);
+	vector<Junction> junctions;
+	for (int i = 0; i < num_workers; ++i)
+	{
+		ChunkJunctions& wj = *worker_juncs[i];
+		for (RefSequenceTable::const_iterator itr = wj.rt.begin();
+			 itr != wj.rt.end(); ++itr)
+		{
+			if (itr->second.name)
+				rt.get_id(itr->second.name, NULL, 0);
+		}
+		junctions.insert(junctions.end(), wj.juncs.begin(), wj.juncs.end());
+		delete worker_juncs[i];
+	}
+	sort(junctions.begin(), junctions.end());
+	junctions.erase(unique(junctions.begin(), junctions.end()), junctions.end());
+
+	for (size_t i = 0; i < junctions.size(); ++i)
+	{
+		const Junction& junc = junctions[i];
+		const char* ref_name = rt.get_name(junc.refid);
+
+		fprintf(stdout,
+				"%s\t%d\t%d\t%c\n",
+				ref_name,
+				junc.left - 1,
+				junc.right,
+				junc.antisense ? '-' : '+');
+	}
+
+	fprintf(stderr, "Extracted %lu junctions\n", junctions.size());
+
+	if (sam_file)
+		samclose(sam_file);
+	if (sam_reader)
+	{
+		delete sam_reader;
+		fclose(map_file);
+	}
 }
 
 void print_usage()
 {
-    fprintf(stderr, "Usage:   sam_juncs <hits.sam>\n");
+    fprintf(stderr, "Usage:   sam_juncs <hits.sam|hits.bam>\n");
 	
 	//    fprintf(stderr, "Usage:   tophat_reports <coverage.wig> <junctions.bed> <accepted_hits.sam> <map1.bwtout> [splice_map1.sbwtout]\n");
 }
@@ -132,15 +307,7 @@ int main(int argc, char** argv)
     
     string map_filename = argv[optind++];
 
-	FILE* map_file = fopen(map_filename.c_str(), "r");
-	if (!map_file)
-	{
-		fprintf(stderr, "Error: cannot open map file %s for reading\n",
-				map_filename.c_str());
-		exit(1);
-	}
-
-    driver(map_file);
+    driver(map_filename);
     
     return 0;
 }
@@ -38,6 +38,7 @@
 #include "junctions.h"
 #include "insertions.h"
 #include "deletions.h"
+#include "splice_motifs.h"
 
 using namespace seqan;
 using namespace std;
@@ -61,32 +62,6 @@ int max_microexon_stretch = 2000;
 int butterfly_overhang = 6;
 int min_cov_length = 20;
 
-void get_seqs(istream& ref_stream,
-			  RefSequenceTable& rt,
-			  bool keep_seqs = true,
-			  bool strip_slash = false)
-{    
-    while(ref_stream.good() &&
-          !ref_stream.eof())
-    {
-		RefSequenceTable::Sequence* ref_str = new RefSequenceTable::Sequence();
-        string name;
-        readMeta(ref_stream, name, Fasta());
-		string::size_type space_pos = name.find_first_of(" \t\r");
-		if (space_pos != string::npos)
-		{
-			name.resize(space_pos);
-		}
-		//fprintf(stderr, "\tLoading %s...", name.c_str());
-		seqan::read(ref_stream, *ref_str, Fasta());
-		//fprintf(stderr, "done\n");
-        rt.get_id(name, keep_seqs ? ref_str : NULL, 0);
-		if (!keep_seqs)
-			delete ref_str;
-    }	
-}
-
-
 RefSeg seg_from_bowtie_hit(const BowtieHit& T)
 {
   RefSeg r_seg(T.ref_id(), POINT_DIR_DONTCARE, T.antisense_align(), READ_DONTCARE, 0, 0);
@@ -211,6 +186,91 @@ typedef vector<uint32_t> MerExtensionCounts;
 MerExtensionTable extensions;
 MerExtensionCounts extension_counts;
 
+/**
+ * A sparse k-mer -> extension table for a small set of reads, such as the
+ * unaligned segments of a single microexon window.  The dense table above
+ * has 4^(2 * half_splice_mer_len) buckets, which is far too many to clear
+ * per window; this one is a flat list sorted by key, so clear() costs
+ * O(entries) and lookups are a binary search.
+ * Call finalize() after the last add() and before any find().
+ */
+class SparseMerExtensionTable
+{
+public:
+	void clear()
+	{
+		_pending.clear();
+		_keys.clear();
+		_exts.clear();
+	}
+	
+	void add(uint64_t key, const MerExtension& ext)
+	{
+		_pending.push_back(make_pair((uint32_t)key, ext));
+	}
+	
+	void finalize()
+	{
+		sort(_pending.begin(), _pending.end());
+		_pending.erase(unique(_pending.begin(), _pending.end()), _pending.end());
+		for (size_t i = 0; i < _pending.size(); ++i)
+		{
+			_keys.push_back(_pending[i].first);
+			_exts.push_back(_pending[i].second);
+		}
+		_pending.clear();
+	}
+	
+	void find(uint64_t key, 
+			  const MerExtension*& first, 
+			  const MerExtension*& last) const
+	{
+		pair<vector<uint32_t>::const_iterator, vector<uint32_t>::const_iterator> r =
+			equal_range(_keys.begin(), _keys.end(), (uint32_t)key);
+		if (r.first == r.second)
+		{
+			first = last = NULL;
+			return;
+		}
+		first = &_exts[r.first - _keys.begin()];
+		last = first + (r.second - r.first);
+	}
+	
+private:
+	vector<pair<uint32_t, MerExtension> > _pending;
+	vector<uint32_t> _keys;
+	vector<MerExtension> _exts;
+};
+
+void add_read_extension(MerExtensionTable& ext_table,
+						uint64_t seed,
+						const MerExtension& ext,
+						bool use_precount_table)
+{
+	if (use_precount_table)
+	{
+		int curr_seed = --extension_counts[seed]; 
+		if (curr_seed < 0 || curr_seed > (int)ext_table[seed].size())
+		{
+			fprintf(stderr, "Error: curr_seed is %d, max is %lu\n", curr_seed, (long unsigned int)ext_table[seed].size());
+		}
+		
+		ext_table[seed][curr_seed] = ext;
+	}
+	else
+	{
+		ext_table[seed].push_back(ext);
+	}
+}
+
+void add_read_extension(SparseMerExtensionTable& ext_table,
+						uint64_t seed,
+						const MerExtension& ext,
+						bool use_precount_table)
+{
+	ext_table.add(seed, ext);
+}
+
 uint64_t dna5str_to_idx(const string& str)
 {
 	uint64_t idx = 0;
@@ -237,7 +297,8 @@ uint64_t colorstr_to_idx(const string& str)
 	return idx;
 }
 
-void store_read_extensions(MerExtensionTable& ext_table,
+template <class ExtensionTable>
+void store_read_extensions(ExtensionTable& ext_table,
 			   int seq_key_len,
 			   int min_ext_len,
 			   const string& seq,
@@ -307,20 +368,7 @@ void store_read_extensions(MerExtensionTable& ext_table,
 
 		ext.left_dna_str = hit_left;
 		ext.left_ext_len = min(i, (unsigned int)MerExtension::MAX_EXTENSION_BP);
-		if (use_precount_table)
-		{
-			int curr_seed = --extension_counts[seed]; 
-			if (curr_seed < 0 || curr_seed > (int)ext_table[seed].size())
-			{
-				fprintf(stderr, "Error: curr_seed is %d, max is %lu\n", curr_seed, (long unsigned int)ext_table[seed].size());
-			}
-			
-			ext_table[seed][curr_seed] = ext;
-		}
-		else
-		{
-			ext_table[seed].push_back(ext);
-		}
+		add_read_extension(ext_table, seed, ext, use_precount_table);
 		new_hits++;
 		
 		// Take the leftmost base of the seed and stick it into bp
@@ -1487,15 +1535,36 @@ void align(uint32_t ref_id,
 int extension_mismatches = 0;
 
 
+// Looks up the extensions for key, either in the given window table or, if
+// there is none, in the global extension table.
+void find_extensions(size_t key,
+					 const SparseMerExtensionTable* window_exts,
+					 const MerExtension*& first,
+					 const MerExtension*& last)
+{
+	if (window_exts)
+	{
+		window_exts->find(key, first, last);
+		return;
+	}
+	
+	const vector<MerExtension>& exts = extensions[key];
+	first = exts.empty() ? NULL : &exts[0];
+	last = first + exts.size();
+}
+
 bool left_extendable_junction(uint64_t upstream_dna_str,
 							  size_t key,
 							  size_t splice_mer_len,
-							  size_t min_ext_len)
+							  size_t min_ext_len,
+							  const SparseMerExtensionTable* window_exts)
 {
-	vector<MerExtension>& exts = extensions[key];
-	for (size_t i = 0; i < exts.size(); ++i)
+	const MerExtension* first;
+	const MerExtension* last;
+	find_extensions(key, window_exts, first, last);
+	for (const MerExtension* e = first; e != last; ++e)
 	{
-		const MerExtension& ext = exts[i];
+		const MerExtension& ext = *e;
 		if (ext.left_ext_len < min_ext_len)
 			continue;
 		uint64_t upstream = upstream_dna_str & ~(0xFFFFFFFFFFFFFFFFull << (ext.left_ext_len << 1));
@@ -1509,12 +1578,15 @@ bool left_extendable_junction(uint64_t upstream_dna_str,
 bool right_extendable_junction(uint64_t downstream_dna_str,
 							   size_t key,
 							   size_t splice_mer_len,
-							   size_t min_ext_len)
+							   size_t min_ext_len,
+							   const SparseMerExtensionTable* window_exts)
 {
-	vector<MerExtension>& exts = extensions[key];
-	for (size_t i = 0; i < exts.size(); ++i)
+	const MerExtension* first;
+	const MerExtension* last;
+	find_extensions(key, window_exts, first, last);
+	for (const MerExtension* e = first; e != last; ++e)
 	{
-		const MerExtension& ext = exts[i];
+		const MerExtension& ext = *e;
 		if (ext.right_ext_len < min_ext_len)
 			continue;
 		uint64_t mask = ~(0xFFFFFFFFFFFFFFFFull >> (ext.right_ext_len << 1));
@@ -1546,7 +1618,8 @@ bool extendable_junction(uint64_t upstream_dna_str,
 			 size_t min_ext_len,
 			 bool reverse,
 			 char last_in_upstream = 'N',
-			 char first_in_downstream = 'N')
+			 char first_in_downstream = 'N',
+			 const SparseMerExtensionTable* window_exts = NULL)
 {
   if (color)
     {
@@ -1574,9 +1647,11 @@ bool extendable_junction(uint64_t upstream_dna_str,
   downstream_dna_str <<= splice_mer_len;
   
   bool extendable = (left_extendable_junction(upstream_dna_str,
-					      key, splice_mer_len, min_ext_len) || 
+					      key, splice_mer_len, min_ext_len,
+					      window_exts) || 
 		     right_extendable_junction(downstream_dna_str,
-					       key, splice_mer_len, min_ext_len));
+					       key, splice_mer_len, min_ext_len,
+					       window_exts));
   return extendable;
 }
 
@@ -1584,6 +1659,11 @@ typedef std::set<Junction, skip_count_lt> PotentialJuncs;
 
 struct RecordExtendableJuncs
 {
+  // If window_exts is given, extensions are looked up there instead of in 
+  // the global extension table.
+  RecordExtendableJuncs(const SparseMerExtensionTable* window_exts = NULL) :
+    _window_exts(window_exts) {}
+  
   void record(uint32_t ref_id,
 	      const vector<pair<size_t, DnaSpliceStrings> >& left_sites,
 	      const vector<pair<size_t, DnaSpliceStrings> >& right_sites,
@@ -1620,10 +1700,12 @@ struct RecordExtendableJuncs
 
 	    if (extendable_junction(upstream_dna_str,
 				    downstream_dna_str, splice_mer_len, 7, false,
-				    last_in_upstream, first_in_downstream) ||
+				    last_in_upstream, first_in_downstream,
+				    _window_exts) ||
 		extendable_junction(rc_downstream_dna_str,
 				    rc_upstream_dna_str, splice_mer_len, 7, true,
-				    last_in_upstream, first_in_downstream))
+				    last_in_upstream, first_in_downstream,
+				    _window_exts))
 	      {
 		juncs.insert(Junction(ref_id,
 				      left_sites[L].first - 1,
@@ -1636,6 +1718,9 @@ struct RecordExtendableJuncs
 	      }			
 	  }
       }	
+
+private:
+  const SparseMerExtensionTable* _window_exts;
 };
 
 struct RecordAllJuncs
@@ -1753,6 +1838,469 @@ uint32_t get_right_butterfly_key(uint64_t downstream_key,
 	return (uint32_t)key;
 }
 
+typedef vector<pair<size_t, DnaSpliceStrings> > SpliceSites;
+
+/*
+ * Appends the butterfly keys of a donor-side (left) site: the bottom of the
+ * site's upstream mer followed by the top of every long enough right
+ * extension of that mer, and the same for the reverse strand extensions.
+ */
+void left_site_butterfly_keys(const pair<size_t, DnaSpliceStrings>& site,
+			      size_t key_length,
+			      vector<ButterflyKey>& keys)
+{
+  size_t extension_length = butterfly_overhang;
+  uint64_t bottom_bit_mask = ~(0xFFFFFFFFFFFFFFFFull << (key_length<<1));
+  uint64_t top_bit_mask =  ~(0xFFFFFFFFFFFFFFFFull >> (key_length<<1));
+
+  uint64_t fwd_upstream_dna_str = site.second.fwd_string;
+  uint64_t fwd_upstream_key = fwd_upstream_dna_str & bottom_bit_mask;
+  
+  assert (fwd_upstream_key < extensions.size());
+  
+  const vector<MerExtension>& fwd_exts = extensions[fwd_upstream_key];
+  for (size_t i = 0; i < fwd_exts.size(); ++i)
+    {
+      const MerExtension& ext = fwd_exts[i];
+      if (ext.right_ext_len < extension_length)
+	continue;
+      
+      /*
+	< f_u_key ><ext.right>
+	NNNNNNNNNN  GT
+      */
+      
+      // take the top bits of the right extension
+      uint64_t key = ext.right_dna_str >> ((ext.right_ext_len - extension_length) << 1);
+      
+      // and the bottom bits of the site key
+      uint64_t mask = ~(0xFFFFFFFFFFFFFFFFull << (extension_length << 1));
+      uint64_t top_half = fwd_upstream_key & mask;
+      
+      // and cat them together
+      key |= (top_half << (extension_length << 1));
+      keys.push_back(ButterflyKey((uint32_t)site.first, key));
+    }
+  
+  uint64_t rev_upstream_dna_str = site.second.rev_string;
+  uint64_t rev_upstream_key = (rev_upstream_dna_str & top_bit_mask) >> (64 - (key_length<<1));
+  
+  assert (rev_upstream_key < extensions.size());
+  
+  const vector<MerExtension>& rev_exts = extensions[rev_upstream_key];
+  for (size_t i = 0; i < rev_exts.size(); ++i)
+    {
+      const MerExtension& ext = rev_exts[i];
+      if (ext.left_ext_len < extension_length)
+	continue;
+      
+      /*
+	< r_u_key ><ext.left>
+	NNNNNNNNNN  GT
+      */
+      
+      // reverse complement the left extension, and we will need 
+      // what were the bottom bits.  these become the top bits in the 
+      // rc.
+      uint64_t ext_str = color ? rc_color_str(ext.left_dna_str) : rc_dna_str(ext.left_dna_str);
+      ext_str >>= 64 - (ext.left_ext_len << 1);
+      
+      // now take the top bits of the rc, make them the bottom of 
+      // the key
+      uint64_t key = ext_str >> ((ext.left_ext_len - extension_length) << 1);
+      
+      // now add in the seed key bottom bits, making them the top of 
+      // the key
+      uint64_t mask = ~(0xFFFFFFFFFFFFFFFFull << (extension_length << 1));
+      uint64_t top_half = fwd_upstream_key & mask;
+      key |= (top_half << (extension_length << 1));
+      keys.push_back(ButterflyKey((uint32_t)site.first, key));
+    }
+}
+
+/*
+ * Appends the butterfly keys of an acceptor-side (right) site: the bottom
+ * of every long enough left extension of the site's downstream mer
+ * followed by the top of that mer, and the same for the reverse strand.
+ */
+void right_site_butterfly_keys(const pair<size_t, DnaSpliceStrings>& site,
+			       size_t key_length,
+			       vector<ButterflyKey>& keys)
+{
+  size_t extension_length = butterfly_overhang;
+  uint64_t bottom_bit_mask = ~(0xFFFFFFFFFFFFFFFFull << (key_length<<1));
+  uint64_t top_bit_mask =  ~(0xFFFFFFFFFFFFFFFFull >> (key_length<<1));
+
+  uint64_t fwd_downstream_dna_str = site.second.fwd_string;
+  uint64_t fwd_downstream_key = (fwd_downstream_dna_str & top_bit_mask) >> (64 - (key_length<<1));
+  
+  assert (fwd_downstream_key < extensions.size());
+  
+  // in color space the first color of the mer depends on the base before
+  // the site, so every color is tried
+  uint64_t fwd_downstream_keys[4];
+  size_t num_fwd_downstream_keys = 0;
+  if (color)
+    {
+      for(size_t color_value = 0; color_value < 4; ++color_value)
+	{
+	  uint64_t tmp_key = (fwd_downstream_key << 2) >> 2 | (color_value << ((key_length - 1) << 1));
+	  fwd_downstream_keys[num_fwd_downstream_keys++] = tmp_key;
+	}
+    }
+  else
+    {
+      fwd_downstream_keys[num_fwd_downstream_keys++] = fwd_downstream_key;
+    }
+  
+  for(size_t k = 0; k < num_fwd_downstream_keys; ++k)
+    {
+      uint64_t tmp_fwd_downstream_key = fwd_downstream_keys[k];
+      const vector<MerExtension>& fwd_exts = extensions[tmp_fwd_downstream_key];
+      for (size_t i = 0; i < fwd_exts.size(); ++i)
+	{
+	  const MerExtension& ext = fwd_exts[i];
+	  if (ext.left_ext_len < extension_length)
+	    continue;
+	  
+	  /*
+	    <ext.left>< f_d_key >
+	    AG NNNNNNNNNN
+	  */
+	  
+	  // take the bottom bits of the left extension, making them the
+	  // top of the key.
+	  uint64_t mask = ~(0xFFFFFFFFFFFFFFFFull << (extension_length << 1));
+	  uint64_t key = (ext.left_dna_str & mask) << (extension_length << 1);
+	  
+	  // add in the top bits of the seed key, making them the bottom bits
+	  // of the key.
+	  uint64_t bottom_half = (tmp_fwd_downstream_key >> ((key_length - extension_length) << 1));
+	  key |= bottom_half;
+	  keys.push_back(ButterflyKey((uint32_t)site.first, key));
+	}
+    }
+
+  uint64_t rev_downstream_dna_str = site.second.rev_string;
+  uint64_t rev_downstream_key = rev_downstream_dna_str & bottom_bit_mask;
+  
+  assert (rev_downstream_key < extensions.size());
+  
+  uint64_t rev_downstream_keys[4];
+  size_t num_rev_downstream_keys = 0;
+  if (color)
+    {
+      for(size_t color_value = 0; color_value < 4; ++color_value)
+	{
+	  uint64_t tmp_key = (rev_downstream_key >> 2) << 2 | color_value;
+	  rev_downstream_keys[num_rev_downstream_keys++] = tmp_key;
+	}
+    }
+  else
+    {
+      rev_downstream_keys[num_rev_downstream_keys++] = rev_downstream_key;
+    }
+  
+  for(size_t k = 0; k < num_rev_downstream_keys; ++k)
+    {
+      uint64_t tmp_rev_downstream_key = rev_downstream_keys[k];
+      uint64_t tmp_fwd_downstream_key = fwd_downstream_key;
+      if (color)
+	{
+	  tmp_fwd_downstream_key = rc_color_str(tmp_rev_downstream_key) >> (64 - (key_length << 1));
+	}
+      
+      const vector<MerExtension>& rev_exts = extensions[tmp_rev_downstream_key];
+      for (size_t i = 0; i < rev_exts.size(); ++i)
+	{
+	  const MerExtension& ext = rev_exts[i];
+	  if (ext.right_ext_len < extension_length)
+	    continue;
+	  
+	  /*
+	    <ext.right>< r_d_key >
+	    AG NNNNNNNNNN
+	  */
+	  
+	  // reverse complement the right_extension.  we want the 
+	  // top bits of the extension, but these become the bottom bits
+	  // under the rc.
+	  uint64_t ext_str = color ? rc_color_str(ext.right_dna_str) : rc_dna_str(ext.right_dna_str);
+	  ext_str >>= 64 - (ext.right_ext_len << 1);
+	  
+	  // take the bottom bits of the rc and make it the top of the key
+	  uint64_t key = ext_str << (extension_length << 1);
+	  
+	  // take the top bits of the seed key and make them the bottom
+	  // of the key.
+	  uint64_t bottom_half = (tmp_fwd_downstream_key >> ((key_length - extension_length) << 1));
+	  key |= bottom_half;
+	  
+	  keys.push_back(ButterflyKey((uint32_t)site.first, key));
+	}
+    }
+}
+
+// The unmerged rest of one site's keys.  The heap algorithms build a max
+// heap, so heads compare in reverse to pop the smallest key first.
+struct ButterflyMergeHead
+{
+  ButterflyMergeHead(const ButterflyKey* n, const ButterflyKey* e) : next(n), end(e) {}
+
+  bool operator<(const ButterflyMergeHead& rhs) const
+  {
+    return *rhs.next < *next;
+  }
+
+  const ButterflyKey* next;
+  const ButterflyKey* end;
+};
+
+/*
+ * The butterfly keys of a run of consecutive sites, each site's keys
+ * sorted and unique.  Windows overlap by half, so a worker sliding along
+ * its windows computes the keys of every site only once and gets each
+ * window's keys by merging the per-site lists.
+ */
+class ButterflySiteKeys
+{
+public:
+  ButterflySiteKeys(const SpliceSites* sites,
+		    bool left_sites,
+		    size_t key_length) :
+    _sites(sites),
+    _left_sites(left_sites),
+    _key_length(key_length),
+    _first(0),
+    _offsets(1, 0) {}
+
+  // Makes [begin, end) the current sites; both ends may only move right.
+  void slide(size_t begin, size_t end)
+  {
+    size_t cached_end = _first + _offsets.size() - 1;
+    if (begin >= cached_end)
+      {
+	_keys.clear();
+	_offsets.assign(1, 0);
+	_first = begin;
+      }
+    else if (begin > _first)
+      {
+	size_t drop = begin - _first;
+	size_t dropped_keys = _offsets[drop];
+	_keys.erase(_keys.begin(), _keys.begin() + dropped_keys);
+	_offsets.erase(_offsets.begin(), _offsets.begin() + drop);
+	for (size_t i = 0; i < _offsets.size(); ++i)
+	  _offsets[i] -= dropped_keys;
+	_first = begin;
+      }
+
+    for (size_t s = _first + _offsets.size() - 1; s < end; ++s)
+      {
+	size_t site_begin = _keys.size();
+	if (_left_sites)
+	  left_site_butterfly_keys((*_sites)[s], _key_length, _keys);
+	else
+	  right_site_butterfly_keys((*_sites)[s], _key_length, _keys);
+	sort(_keys.begin() + site_begin, _keys.end());
+	_keys.erase(unique(_keys.begin() + site_begin, _keys.end()), _keys.end());
+	_offsets.push_back(_keys.size());
+      }
+  }
+
+  // Merges the keys of the current sites into keys, in ButterflyKey order.
+  void merge(vector<ButterflyKey>& keys, vector<ButterflyMergeHead>& heap) const
+  {
+    keys.clear();
+    heap.clear();
+    for (size_t i = 0; i + 1 < _offsets.size(); ++i)
+      {
+	if (_offsets[i] < _offsets[i + 1])
+	  heap.push_back(ButterflyMergeHead(&_keys[0] + _offsets[i],
+					    &_keys[0] + _offsets[i + 1]));
+      }
+    make_heap(heap.begin(), heap.end());
+    while (!heap.empty())
+      {
+	pop_heap(heap.begin(), heap.end());
+	ButterflyMergeHead& head = heap.back();
+	if (keys.empty() || !(keys.back() == *head.next))
+	  keys.push_back(*head.next);
+	if (++head.next == head.end)
+	  heap.pop_back();
+	else
+	  push_heap(heap.begin(), heap.end());
+      }
+  }
+
+private:
+  const SpliceSites* _sites;
+  bool _left_sites;
+  size_t _key_length;
+
+  // keys of site _first + i are _keys[_offsets[i], _offsets[i + 1])
+  size_t _first;
+  vector<size_t> _offsets;
+  vector<ButterflyKey> _keys;
+};
+
+/*
+ * Pairs every left key with every right key that has the same key value,
+ * recording the ones that make an intron of an acceptable length.
+ */
+void join_butterfly_keys(uint32_t ref_id,
+			 const vector<ButterflyKey>& left_keys,
+			 const vector<ButterflyKey>& right_keys,
+			 bool antisense,
+			 PotentialJuncs& juncs,
+			 int min_intron,
+			 int max_intron,
+			 size_t max_juncs)
+{
+  size_t lk = 0;
+  size_t rk = 0;
+  
+  while (lk < left_keys.size() && rk < right_keys.size())
+    {
+      while (lk < left_keys.size() &&
+	     left_keys[lk].key < right_keys[rk].key) { ++lk; }
+      
+      if (lk == left_keys.size())
+	break;
+      
+      while (rk < right_keys.size() &&
+	     right_keys[rk].key < left_keys[lk].key) { ++rk; }
+      
+      if (rk == right_keys.size())
+	break;
+      
+      if (lk < left_keys.size() && rk < right_keys.size() &&
+	  right_keys[rk].key == left_keys[lk].key)
+	{
+	  
+	  size_t k = right_keys[rk].key;
+	  size_t lk_end = lk;
+	  size_t rk_end = rk;
+	  while (rk_end < right_keys.size() && right_keys[rk_end].key == k) {++rk_end;}
+	  while (lk_end < left_keys.size() && left_keys[lk_end].key == k) {++lk_end;}
+	  
+	  size_t tmp_lk = lk;
+	  
+	  while (tmp_lk < lk_end)
+	    {
+	      size_t tmp_rk = rk;
+	      while (tmp_rk < rk_end)
+		{
+		  int donor = (int)left_keys[tmp_lk].pos - 1;
+		  int acceptor = (int)right_keys[tmp_rk].pos + 2;
+		  
+		  if (acceptor - donor > min_intron && acceptor - donor < max_intron)
+		    {
+		      Junction j(ref_id,
+				 donor,
+				 acceptor,
+				 antisense,
+				 acceptor - donor); // just prefer shorter introns
+		      juncs.insert(j);
+		      if (juncs.size() > max_juncs)
+			{
+			  juncs.erase(*(juncs.rbegin()));
+			}
+		    }
+		  ++tmp_rk;
+		}
+	      
+	      ++tmp_lk;
+	    }
+	  
+	  lk = lk_end;
+	  rk = rk_end;
+	}
+    }
+}
+
+struct site_pos_lt
+{
+  bool operator()(const pair<size_t, DnaSpliceStrings>& site, size_t pos) const
+  {
+    return site.first < pos;
+  }
+};
+
+// Searches the windows [first_window, last_window) of one strand of a
+// reference for butterfly junctions.  The extension table is only read, and
+// each worker keeps its own key buffers and junction set, so workers can
+// run concurrently.
+struct ButterflyWindowWorker
+{
+  ButterflyWindowWorker(uint32_t _ref_id,
+			const SpliceSites* _left_sites,
+			const SpliceSites* _right_sites,
+			bool _antisense,
+			int _min_intron,
+			int _max_intron,
+			size_t _max_juncs,
+			size_t _key_length,
+			size_t _first_window,
+			size_t _last_window) :
+    ref_id(_ref_id),
+    left_sites(_left_sites),
+    right_sites(_right_sites),
+    antisense(_antisense),
+    min_intron(_min_intron),
+    max_intron(_max_intron),
+    max_juncs(_max_juncs),
+    key_length(_key_length),
+    first_window(_first_window),
+    last_window(_last_window) {}
+
+  void operator()()
+  {
+    ButterflySiteKeys left_site_keys(left_sites, true, key_length);
+    ButterflySiteKeys right_site_keys(right_sites, false, key_length);
+    vector<ButterflyKey> left_keys;
+    vector<ButterflyKey> right_keys;
+    vector<ButterflyMergeHead> heap;
+
+    for (size_t w = first_window; w < last_window; ++w)
+      {
+	size_t window_left_edge = w * max_intron;
+	size_t window_right_edge = window_left_edge + 2 * max_intron;
+	//fprintf(stderr, "\twindow %lu - %lu\n", window_left_edge, window_right_edge);
+
+	left_site_keys.slide(lower_bound(left_sites->begin(), left_sites->end(), window_left_edge, site_pos_lt()) - left_sites->begin(),
+			     lower_bound(left_sites->begin(), left_sites->end(), window_right_edge, site_pos_lt()) - left_sites->begin());
+	right_site_keys.slide(lower_bound(right_sites->begin(), right_sites->end(), window_left_edge, site_pos_lt()) - right_sites->begin(),
+			      lower_bound(right_sites->begin(), right_sites->end(), window_right_edge, site_pos_lt()) - right_sites->begin());
+
+	left_site_keys.merge(left_keys, heap);
+	right_site_keys.merge(right_keys, heap);
+
+	join_butterfly_keys(ref_id,
+			    left_keys,
+			    right_keys,
+			    antisense,
+			    juncs,
+			    min_intron,
+			    max_intron,
+			    max_juncs);
+      }
+  }
+
+  uint32_t ref_id;
+  const SpliceSites* left_sites;
+  const SpliceSites* right_sites;
+  bool antisense;
+  int min_intron;
+  int max_intron;
+  size_t max_juncs;
+  size_t key_length;
+  size_t first_window;
+  size_t last_window;
+
+  PotentialJuncs juncs;
+};
+
 struct RecordButterflyJuncs
 {
   void record(uint32_t ref_id,
@@ -1766,9 +2314,6 @@ struct RecordButterflyJuncs
 	      size_t half_splice_mer_len)
   {
     size_t key_length = 2 * half_splice_mer_len;
-    size_t extension_length = butterfly_overhang;
-    uint64_t bottom_bit_mask = ~(0xFFFFFFFFFFFFFFFFull << (key_length<<1));
-    uint64_t top_bit_mask =  ~(0xFFFFFFFFFFFFFFFFull >> (key_length<<1));
 		
     if (all_left_sites.empty() || all_right_sites.empty())
       return;
@@ -1776,308 +2321,118 @@ struct RecordButterflyJuncs
     size_t last_site = max(all_left_sites.back().first, 
 			   all_right_sites.back().first);
     
-    size_t curr_left_site = 0;
-    size_t curr_right_site = 0;
-    for (size_t window_left_edge = 0; 
-	 window_left_edge < last_site; 
-	 window_left_edge += max_intron)
+    // windows of 2 * max_intron start every max_intron bases
+    size_t num_windows = (last_site + max_intron - 1) / max_intron;
+    if (num_windows == 0)
+      return;
+
+    // Workers take contiguous runs of windows, so that most sites have
+    // their keys computed by a single worker.
+    size_t num_workers = max(1, min(num_cpus, (int)num_windows));
+    vector<ButterflyWindowWorker> workers;
+    for (size_t i = 0; i < num_workers; ++i)
       {
-	//fprintf(stderr, "\twindow %lu - %lu\n", window_left_edge, window_left_edge + 2 * max_intron); 
-	vector<pair<size_t, DnaSpliceStrings> > left_sites;
-	vector<pair<size_t, DnaSpliceStrings> > right_sites;
-	
-	while(curr_left_site < all_left_sites.size() &&
-	      all_left_sites[curr_left_site].first < window_left_edge)
-	  {
-	    curr_left_site++;
-	  }
-	
-	while(curr_right_site < all_right_sites.size() &&
-	      all_right_sites[curr_right_site].first < window_left_edge)
+	workers.push_back(ButterflyWindowWorker(ref_id,
+						&all_left_sites,
+						&all_right_sites,
+						antisense,
+						min_intron,
+						max_intron,
+						max_juncs,
+						key_length,
+						i * num_windows / num_workers,
+						(i + 1) * num_windows / num_workers));
+      }
+    run_tasks(workers);
+
+    // Each worker kept its max_juncs best, so these are the best overall
+    for (size_t i = 0; i < workers.size(); ++i)
+      {
+	PotentialJuncs& worker_juncs = workers[i].juncs;
+	for (PotentialJuncs::iterator j = worker_juncs.begin(); j != worker_juncs.end(); ++j)
 	  {
-	    curr_right_site++;
+	    juncs.insert(*j);
+	    if (juncs.size() > max_juncs)
+	      juncs.erase(*(juncs.rbegin()));
 	  }
+      }
+  }
+};
+
+// Positions of the splice-site dinucleotides in every reference sequence,
+// loaded (or built) once per run by driver().
+SpliceMotifIndex splice_motifs;
+
+template <class DinucString>
+int dinuc_motif_id(const DinucString& dinuc)
+{
+  string d;
+  for (size_t i = 0; i < length(dinuc); ++i)
+    d.push_back((char)(seqan::Dna)dinuc[i]);
+  return splice_motif_id(d);
+}
+
+// Collects the offsets i in [0, to] from seg.left at which first_dinuc or
+// second_dinuc start on the reference.  Offsets go into first_sites and
+// second_sites in increasing order; pass NULL to skip one of them.  Uses
+// the splice motif index when it covers the sequence, otherwise scans.
+template <class FirstDinuc, class SecondDinuc>
+void find_seg_dinucs(const RefSeg& seg,
+		     const RefSequenceTable::Sequence& ref_str,
+		     size_t to,
+		     const FirstDinuc& first_dinuc,
+		     const SecondDinuc& second_dinuc,
+		     vector<size_t>* first_sites,
+		     vector<size_t>* second_sites)
+{
+  int first_motif = dinuc_motif_id(first_dinuc);
+  int second_motif = dinuc_motif_id(second_dinuc);
+  if (first_motif >= 0 && second_motif >= 0 && first_motif != second_motif &&
+      splice_motifs.has_ref(seg.ref_id, length(ref_str)))
+    {
+      vector<uint32_t> positions;
+      for (int d = 0; d < 2; ++d)
+	{
+	  vector<size_t>* sites = d == 0 ? first_sites : second_sites;
+	  if (!sites)
+	    continue;
+	  positions.clear();
+	  splice_motifs.find(seg.ref_id, d == 0 ? first_motif : second_motif,
+			     seg.left, seg.left + to + 1, positions);
+	  for (size_t p = 0; p < positions.size(); ++p)
+	    sites->push_back(positions[p] - seg.left);
+	}
+      return;
+    }
+
+  for (size_t i = 0; i <= to; ++i)
+    {
+      // Look at a slice of the reference without creating a copy.
+      DnaString curr = seqan::infix(ref_str, seg.left + i, seg.left + i + 2);
+      if (first_sites && curr == first_dinuc)
+	first_sites->push_back(i);
+      else if (second_sites && curr == second_dinuc)
+	second_sites->push_back(i);
+    }
+}
+
+template <class JunctionRecorder>
+void juncs_from_ref_segs(RefSequenceTable& rt,
+                         vector<RefSeg>& expected_don_acc_windows,
+                         PotentialJuncs& juncs,
+                         const DnaString& donor_dinuc,
+                         const DnaString& acceptor_dinuc,
+                         int max_intron,
+                         int min_intron,
+                         size_t max_juncs,
+                         bool talkative,
+                         size_t half_splice_mer_len,
+                         JunctionRecorder recorder = JunctionRecorder())
+{	
 	
-	for (size_t ls = curr_left_site; ls < all_left_sites.size(); ++ls)
-	  {
-	    if (all_left_sites[ls].first < window_left_edge + 2 * max_intron)
-	      {
-		left_sites.push_back(all_left_sites[ls]);
-	      }
-	  }
-	
-	for (size_t rs = curr_right_site; rs < all_right_sites.size(); ++rs)
-	  {
-	    if (all_right_sites[rs].first < window_left_edge + 2 * max_intron)
-	      {
-		right_sites.push_back(all_right_sites[rs]);
-	      }
-	  }
-	
-	vector<ButterflyKey> left_keys;
-	for (size_t L = 0; L < left_sites.size(); ++L)
-	  {
-	    uint64_t fwd_upstream_dna_str = left_sites[L].second.fwd_string;
-	    uint64_t fwd_upstream_key = fwd_upstream_dna_str & bottom_bit_mask;
-	    
-	    assert (fwd_upstream_key < extensions.size());
-	    
-	    vector<MerExtension>& fwd_exts = extensions[fwd_upstream_key];
-	    for (size_t i = 0; i < fwd_exts.size(); ++i)
-	      {
-		const MerExtension& ext = fwd_exts[i];
-		if (ext.right_ext_len < extension_length)
-		  continue;
-		
-		/*
-		  < f_u_key ><ext.right>
-		  NNNNNNNNNN  GT
-		*/
-		
-		// take the top bits of the right extension
-		uint64_t key = ext.right_dna_str >> ((ext.right_ext_len - extension_length) << 1);
-		
-		// and the bottom bits of the site key
-		uint64_t mask = ~(0xFFFFFFFFFFFFFFFFull << (extension_length << 1));
-		uint64_t top_half = fwd_upstream_key & mask;
-		
-		// and cat them together
-		key |= (top_half << (extension_length << 1));
-		left_keys.push_back(ButterflyKey((uint32_t)left_sites[L].first, key));
-	      }
-	    
-	    uint64_t rev_upstream_dna_str = left_sites[L].second.rev_string;
-	    uint64_t rev_upstream_key = (rev_upstream_dna_str & top_bit_mask) >> (64 - (key_length<<1));
-	    
-	    assert (rev_upstream_key < extensions.size());
-	    
-	    vector<MerExtension>& rev_exts = extensions[rev_upstream_key];
-	    for (size_t i = 0; i < rev_exts.size(); ++i)
-	      {
-		const MerExtension& ext = rev_exts[i];
-		if (ext.left_ext_len < extension_length)
-		  continue;
-		
-		/*
-		  < r_u_key ><ext.left>
-		  NNNNNNNNNN  GT
-		*/
-				
-		// reverse complement the left extension, and we will need 
-		// what were the bottom bits.  these become the top bits in the 
-		// rc.
-		uint64_t ext_str = color ? rc_color_str(ext.left_dna_str) : rc_dna_str(ext.left_dna_str);
-		ext_str >>= 64 - (ext.left_ext_len << 1);
-		
-		// now take the top bits of the rc, make them the bottom of 
-		// the key
-		uint64_t key = ext_str >> ((ext.left_ext_len - extension_length) << 1);
-		
-		// now add in the seed key bottom bits, making them the top of 
-		// the key
-		uint64_t mask = ~(0xFFFFFFFFFFFFFFFFull << (extension_length << 1));
-		uint64_t top_half = fwd_upstream_key & mask;
-		key |= (top_half << (extension_length << 1));
-		left_keys.push_back(ButterflyKey((uint32_t)left_sites[L].first, key));
-	      }
-	  }
-	sort (left_keys.begin(), left_keys.end());
-	vector<ButterflyKey>::iterator new_end = unique(left_keys.begin(), left_keys.end());
-	left_keys.erase(new_end, left_keys.end());
-	
-	vector<ButterflyKey> right_keys;
-	for (size_t R = 0; R < right_sites.size(); ++R)
-	  {
-	    uint64_t fwd_downstream_dna_str = right_sites[R].second.fwd_string;
-	    uint64_t fwd_downstream_key = (fwd_downstream_dna_str & top_bit_mask) >> (64 - (key_length<<1));
-	    
-	    assert (fwd_downstream_key < extensions.size());
-	    
-	    vector<uint64_t> fwd_downstream_keys;
-	    if (color)
-	      {
-		for(size_t color_value = 0; color_value < 4; ++color_value)
-		  {
-		    uint64_t tmp_key = (fwd_downstream_key << 2) >> 2 | (color_value << ((key_length - 1) << 1));
-		    fwd_downstream_keys.push_back(tmp_key);
-		  }
-	      }
-	    else
-	      {
-		fwd_downstream_keys.push_back(fwd_downstream_key);
-	      }
-	    
-	    for(size_t key = 0; key < fwd_downstream_keys.size(); ++key)
-	      {
-		uint64_t tmp_fwd_downstream_key = fwd_downstream_keys[key];
-		vector<MerExtension>& fwd_exts = extensions[tmp_fwd_downstream_key];
-		for (size_t i = 0; i < fwd_exts.size(); ++i)
-		  {
-		    const MerExtension& ext = fwd_exts[i];
-		    if (ext.left_ext_len < extension_length)
-		      continue;
-		    
-		    /*
-		      <ext.left>< f_d_key >
-		      AG NNNNNNNNNN
-		    */
-		    
-		    // take the bottom bits of the left extension, making them the
-		    // top of the key.
-		    uint64_t mask = ~(0xFFFFFFFFFFFFFFFFull << (extension_length << 1));
-		    uint64_t key = (ext.left_dna_str & mask) << (extension_length << 1);
-		    
-		    // add in the top bits of the seed key, making them the bottom bits
-		    // of the key.
-		    uint64_t bottom_half = (tmp_fwd_downstream_key >> ((key_length - extension_length) << 1));
-		    key |= bottom_half;
-		    right_keys.push_back(ButterflyKey((uint32_t)right_sites[R].first, key));
-		  }
-	      }
-
-	    uint64_t rev_downstream_dna_str = right_sites[R].second.rev_string;
-	    uint64_t rev_downstream_key = rev_downstream_dna_str & bottom_bit_mask;
-	    
-	    assert (rev_downstream_key < extensions.size());
-	    
-	    vector<uint64_t> rev_downstream_keys;
-	    if (color)
-	      {
-		for(size_t color_value = 0; color_value < 4; ++color_value)
-		  {
-		    uint64_t tmp_key = (rev_downstream_key >> 2) << 2 | color_value;
-		    rev_downstream_keys.push_back(tmp_key);
-		  }
-	      }
-	    else
-	      {
-		rev_downstream_keys.push_back(rev_downstream_key);
-	      }
-				
-	    for(size_t key = 0; key < rev_downstream_keys.size(); ++key)
-	      {
-		uint64_t tmp_rev_downstream_key = rev_downstream_keys[key];
-		uint64_t tmp_fwd_downstream_key = fwd_downstream_key;
-		if (color)
-		  {
-		    tmp_fwd_downstream_key = rc_color_str(tmp_rev_downstream_key) >> (64 - (key_length << 1));
-		  }
-		
-		vector<MerExtension>& rev_exts = extensions[tmp_rev_downstream_key];
-		for (size_t i = 0; i < rev_exts.size(); ++i)
-		  {
-		    const MerExtension& ext = rev_exts[i];
-		    if (ext.right_ext_len < extension_length)
-		      continue;
-		    
-		    /*
-		      <ext.right>< r_d_key >
-		      AG NNNNNNNNNN
-		    */
-		    
-		    // reverse complement the right_extension.  we want the 
-		    // top bits of the extension, but these become the bottom bits
-		    // under the rc.
-		    uint64_t ext_str = color ? rc_color_str(ext.right_dna_str) : rc_dna_str(ext.right_dna_str);
-		    ext_str >>= 64 - (ext.right_ext_len << 1);
-		    
-		    // take the bottom bits of the rc and make it the top of the key
-		    uint64_t key = ext_str << (extension_length << 1);
-		    
-		    // take the top bits of the seed key and make them the bottom
-		    // of the key.
-		    uint64_t bottom_half = (tmp_fwd_downstream_key >> ((key_length - extension_length) << 1));
-		    key |= bottom_half;
-		    
-		    right_keys.push_back(ButterflyKey((uint32_t)right_sites[R].first, key));
-		  }
-	      }
-	  }
-	
-	sort (right_keys.begin(), right_keys.end());
-	new_end = unique(right_keys.begin(), right_keys.end());
-	right_keys.erase(new_end, right_keys.end());
-			
-	size_t lk = 0;
-	size_t rk = 0;
-	
-	while (lk < left_keys.size() && rk < right_keys.size())
-	  {
-	    while (lk < left_keys.size() &&
-		   left_keys[lk].key < right_keys[rk].key) { ++lk; }
-	    
-	    if (lk == left_keys.size())
-	      break;
-	    
-	    while (rk < right_keys.size() &&
-		   right_keys[rk].key < left_keys[lk].key) { ++rk; }
-				
-	    if (rk == right_keys.size())
-	      break;
-	    
-	    if (lk < left_keys.size() && rk < right_keys.size() &&
-		right_keys[rk].key == left_keys[lk].key)
-	      {
-					
-		size_t k = right_keys[rk].key;
-		size_t lk_end = lk;
-		size_t rk_end = rk;
-		while (rk_end < right_keys.size() && right_keys[rk_end].key == k) {++rk_end;}
-		while (lk_end < left_keys.size() && left_keys[lk_end].key == k) {++lk_end;}
-		
-		size_t tmp_lk = lk;
-					
-		while (tmp_lk < lk_end)
-		  {
-		    size_t tmp_rk = rk;
-		    while (tmp_rk < rk_end)
-		      {
-			int donor = (int)left_keys[tmp_lk].pos - 1;
-			int acceptor = (int)right_keys[tmp_rk].pos + 2;
-							
-			if (acceptor - donor > min_intron && acceptor - donor < max_intron)
-			  {
-			    Junction j(ref_id,
-				       donor,
-				       acceptor,
-				       antisense,
-				       acceptor - donor); // just prefer shorter introns
-			    juncs.insert(j);
-			    if (juncs.size() > max_juncs)
-			      {
-				juncs.erase(*(juncs.rbegin()));
-			      }
-			  }
-			++tmp_rk;
-		      }
-		    
-		    ++tmp_lk;
-		  }
-		
-		lk = lk_end;
-		rk = rk_end;
-	      }
-	  }
-      }
-  }
-};
-
-template <class JunctionRecorder>
-void juncs_from_ref_segs(RefSequenceTable& rt,
-                         vector<RefSeg>& expected_don_acc_windows,
-                         PotentialJuncs& juncs,
-                         const DnaString& donor_dinuc,
-                         const DnaString& acceptor_dinuc,
-                         int max_intron,
-                         int min_intron,
-                         size_t max_juncs,
-                         bool talkative,
-                         size_t half_splice_mer_len)
-{	
-	
-    typedef map<uint32_t, IntronMotifs> MotifMap;
-    
-    MotifMap ims;
+    typedef map<uint32_t, IntronMotifs> MotifMap;
+    
+    MotifMap ims;
 	
     seqan::DnaStringReverseComplement rev_donor_dinuc(donor_dinuc);
     seqan::DnaStringReverseComplement rev_acceptor_dinuc(acceptor_dinuc);
@@ -2232,15 +2587,21 @@ void juncs_from_ref_segs(RefSequenceTable& rt,
 
 	if (seg.points_where == POINT_DIR_BOTH)
 	  {
-	    for (size_t i = 0; i <= to; ++i)
-	      {
-                // Look at a slice of the reference without creating a copy.
-                DnaString curr = seqan::infix(org_seg_str, i - left_color_offset, i + 2 - left_color_offset);
+	    vector<size_t> donor_sites, rev_acceptor_sites;
+	    find_seg_dinucs(seg, *ref_str, to,
+			    donor_dinuc, rev_acceptor_dinuc,
+			    skip_fwd ? NULL : &donor_sites,
+			    skip_rev ? NULL : &rev_acceptor_sites);
 
-		if ((!skip_fwd && curr == donor_dinuc) || (!skip_rev && curr == rev_acceptor_dinuc))
+	    for (int strand = 0; strand < 2; ++strand)
+	      {
+		bool fwd = (strand == 0);
+		const vector<size_t>& sites = fwd ? donor_sites : rev_acceptor_sites;
+		for (size_t s = 0; s < sites.size(); ++s)
 		  {
+		    size_t i = sites[s];
 		    DnaString partner;
-		    if (curr == donor_dinuc)
+		    if (fwd)
 		      partner = acceptor_dinuc;
 		    else
 		      partner = rev_donor_dinuc;
@@ -2260,7 +2621,7 @@ void juncs_from_ref_segs(RefSequenceTable& rt,
 			size_t pos = length(seg_str) - (read_len - i) - 2;
 			if (partner == seqan::infix(org_seg_str, pos - left_color_offset, pos + 2 - left_color_offset))
 			  {
-			    if (curr == donor_dinuc)
+			    if (fwd)
 			      {
 				motifs.fwd_donors.push_back(make_pair(seg.left + i, DnaSpliceStrings(0,0)));
 				motifs.fwd_acceptors.push_back(make_pair(seg.left + pos, DnaSpliceStrings(0,0)));
@@ -2273,7 +2634,7 @@ void juncs_from_ref_segs(RefSequenceTable& rt,
 
 			    // daehwan
         #ifdef B_DEBUG2
-				cout << curr << ":" << partner << " added" << endl;
+				cout << (fwd ? donor_dinuc : rev_acceptor_dinuc) << ":" << partner << " added" << endl;
         #endif
 			  }
 		      }
@@ -2287,28 +2648,28 @@ void juncs_from_ref_segs(RefSequenceTable& rt,
             // on the right by a partial bowtie hit, indicating that we
             // should be looking for an intron to the left of the hit
 	    // In this seg, that means either an "AG" or an "AC"
-            for (size_t i = 0; i <= to; ++i)
-	      {
-                // Look at a slice of the reference without creating a copy.
-                DnaString curr = seqan::infix(org_seg_str, i - left_color_offset, i + 2 - left_color_offset);
-                if (curr == acceptor_dinuc && !skip_fwd)
-		  motifs.fwd_acceptors.push_back(make_pair(seg.left + i, DnaSpliceStrings(0,0)));
-                else if (curr == rev_donor_dinuc && !skip_rev)
-		  motifs.rev_donors.push_back(make_pair(seg.left + i, DnaSpliceStrings(0,0)));
-	      }
+	    vector<size_t> acceptor_sites, rev_donor_sites;
+	    find_seg_dinucs(seg, *ref_str, to,
+			    acceptor_dinuc, rev_donor_dinuc,
+			    skip_fwd ? NULL : &acceptor_sites,
+			    skip_rev ? NULL : &rev_donor_sites);
+	    for (size_t s = 0; s < acceptor_sites.size(); ++s)
+	      motifs.fwd_acceptors.push_back(make_pair(seg.left + acceptor_sites[s], DnaSpliceStrings(0,0)));
+	    for (size_t s = 0; s < rev_donor_sites.size(); ++s)
+	      motifs.rev_donors.push_back(make_pair(seg.left + rev_donor_sites[s], DnaSpliceStrings(0,0)));
 	  }
         else
 	  {
             // A right pointing ref seg wants either a "GT" or a "CT"
-            for (size_t i = 0; i <= to; ++i)
-	      {
-                // Look at a slice of the reference without creating a copy.
-                DnaString curr = seqan::infix(org_seg_str, i - left_color_offset, i + 2 - left_color_offset);
-                if (curr == donor_dinuc && !skip_fwd)
-		  motifs.fwd_donors.push_back(make_pair(seg.left + i, DnaSpliceStrings(0,0)));
-                else if (curr == rev_acceptor_dinuc && !skip_rev)
-		  motifs.rev_acceptors.push_back(make_pair(seg.left + i, DnaSpliceStrings(0,0)));
-	      }
+	    vector<size_t> donor_sites, rev_acceptor_sites;
+	    find_seg_dinucs(seg, *ref_str, to,
+			    donor_dinuc, rev_acceptor_dinuc,
+			    skip_fwd ? NULL : &donor_sites,
+			    skip_rev ? NULL : &rev_acceptor_sites);
+	    for (size_t s = 0; s < donor_sites.size(); ++s)
+	      motifs.fwd_donors.push_back(make_pair(seg.left + donor_sites[s], DnaSpliceStrings(0,0)));
+	    for (size_t s = 0; s < rev_acceptor_sites.size(); ++s)
+	      motifs.rev_acceptors.push_back(make_pair(seg.left + rev_acceptor_sites[s], DnaSpliceStrings(0,0)));
 	  }
     }
     
@@ -2342,7 +2703,6 @@ void juncs_from_ref_segs(RefSequenceTable& rt,
 
         //const char* ref_name = rt.get_name(motif_itr->second.ref_id);
         
-        JunctionRecorder recorder;
         recorder.record(ref_id,
                         fwd_donors, 
                         fwd_acceptors, 
@@ -2367,81 +2727,128 @@ void juncs_from_ref_segs(RefSequenceTable& rt,
 }
 
 
+/*
+ * True if a read base does not match a reference base; N never matches,
+ * not even another N.
+ */
+static inline unsigned int split_mismatch(char a, char b)
+{
+	return (a != b) | (a == 'N') | (b == 'N');
+}
+
 /**
  * Performs a simple global alignment.
  * This function will perform a restricted global alignment. The restriction is that only one insertion/deletion
  * is allowed in the final alignment.
- * @param shortSequence The short sequence to be aligned.
- * @param leftReference The left end of the reference to be aligned, must be exactly as long as the short sequence
- * @param leftReference The right end of the reference to be aligned, must be exactly as long as the short sequenc
+ * @param shorterSequence The short sequence to be aligned.
+ * @param leftReference The left end of the reference to be aligned, at least as long as the short sequence
+ * @param rightReference The right end of the reference to be aligned, at least as long as the short sequence
+ * @param length The length of the short sequence
  * @param insertPosition This will contain the 0-based index of the first position in the shorter sequence after the insertion/deletion. A value of -1 indicates that the alignment could not be performed.
- * @param mismatchCount This will contain the number of mismatches in the optimal restricted global alignment. The number and length of insertions/deletions is fixed. A value of -1 indicates that the alignment could not be performed.
+ * @param mismatchCount This will contain the number of mismatches in the optimal restricted global alignment. The number and length of insertions/deletions is fixed.
  */
-void simpleSplitAlignment(seqan::String<char>& shorterSequence,
-			  seqan::String<char>& leftReference,
-			  seqan::String<char>& rightReference,
+void simpleSplitAlignment(const char* shorterSequence,
+			  const char* leftReference,
+			  const char* rightReference,
+			  size_t length,
 			  int& insertPosition,
 			  int& mismatchCount)
 {
 			/*
 			 * In this restricted alignment, we already know the length and number (1) of insertions/deletions.
-			 * We simply need to know where to put it. Do a linear scan through sequence counting the number of induced
-			 * errors before and after putting the insertion at each sequence.
-			 */
-
-			/*
-			 * Note that we could have a case, where both the alignment and the read have the unknonw
-			 * nucleotide ('N') and we don't want to reward cases where these characters match
+			 * We simply need to know where to put it. The errors for the insertion at position p are the
+			 * mismatches of shorterSequence[0,p) against the left reference plus those of
+			 * shorterSequence[p,length) against the right one.  Count them for p = 1 in one branch-free pass,
+			 * then move the insertion right one base at a time, which moves a single base from the right
+			 * alignment to the left one.
 			 */
-			vector<unsigned short> beforeErrors(seqan::length(shorterSequence));
-			for(int idx = seqan::length(shorterSequence) - 1; idx >= 0; idx -= 1){
-				unsigned short prevCount = 0;
-				/*
-				 * We guarentee idx >= 0, so cast to hide the compiler
-				 * warning here
-				 */
-				if(((size_t)idx) < seqan::length(shorterSequence) - 1){
-					prevCount = beforeErrors.at(idx + 1);
-				}
-				unsigned short currentMismatch = 0;
-				if(rightReference[idx] == 'N' || shorterSequence[idx] == 'N' || rightReference[idx] != shorterSequence[idx]){
-					currentMismatch = 1;
-				}
-				beforeErrors.at(idx) = prevCount + currentMismatch;
-			}
-
-
-			vector<unsigned short> afterErrors(seqan::length(shorterSequence));
-			for(size_t idx = 0; idx < seqan::length(shorterSequence) ; idx += 1){
-				unsigned short prevCount = 0;
-				if(idx > 0){
-					prevCount = afterErrors.at(idx - 1);
-				}
-				unsigned short currentMismatch = 0;
-				if(leftReference[idx] == 'N' || shorterSequence[idx] == 'N' || leftReference[idx] != shorterSequence[idx]){
-					currentMismatch = 1;
-				}
-				afterErrors.at(idx) = prevCount + currentMismatch;
-			}
-
-
-			mismatchCount = seqan::length(shorterSequence) + 1;
+			mismatchCount = length + 1;
 			insertPosition = -1;
 
 			/*
 			 * Technically, we could allow the insert position to be at the end or beginning of the sequence,
 			 * but we are disallowing it here
 			 */
-			for(size_t currentInsertPosition = 1; currentInsertPosition < seqan::length(shorterSequence); currentInsertPosition += 1){
-				size_t errorCount = beforeErrors.at(currentInsertPosition) + afterErrors.at(currentInsertPosition - 1);
-				if(((int)errorCount) < mismatchCount){
-					mismatchCount = (int)errorCount;
+			if(length < 2)
+				return;
+
+			int errorCount = split_mismatch(shorterSequence[0], leftReference[0]);
+			for(size_t idx = 1; idx < length; idx += 1){
+				errorCount += split_mismatch(shorterSequence[idx], rightReference[idx]);
+			}
+
+			mismatchCount = errorCount;
+			insertPosition = 1;
+			for(size_t currentInsertPosition = 2; currentInsertPosition < length; currentInsertPosition += 1){
+				size_t idx = currentInsertPosition - 1;
+				errorCount += (int)split_mismatch(shorterSequence[idx], leftReference[idx])
+					- (int)split_mismatch(shorterSequence[idx], rightReference[idx]);
+				if(errorCount < mismatchCount){
+					mismatchCount = errorCount;
 					insertPosition = currentInsertPosition;
 				}
 			}
 			return;
 }
 
+/*
+ * Scratch space for a stretch of reference sequence, on the stack unless
+ * the stretch is unusually long.
+ */
+class SplitBuffer
+{
+public:
+	SplitBuffer(size_t len) : _data(_local)
+	{
+		if (len > sizeof(_local))
+		{
+			_heap.resize(len);
+			_data = &_heap[0];
+		}
+	}
+	char* data() { return _data; }
+
+private:
+	char _local[1024];
+	vector<char> _heap;
+	char* _data;
+};
+
+/*
+ * Copies the bases [begin, end) of the packed reference into buf as
+ * characters, using chars to spell the Dna5 values; in color space buf is
+ * then converted to the end - begin - 1 colors between the bases.  Returns
+ * the number of characters in buf.
+ */
+static size_t reference_chars(const RefSequenceTable::Sequence& ref,
+			      size_t begin,
+			      size_t end,
+			      const char* chars,
+			      char* buf)
+{
+	for (size_t i = begin; i < end; ++i)
+		buf[i - begin] = chars[ordValue((Dna5)ref[i])];
+
+	size_t len = end - begin;
+	if (color && len > 0)
+	{
+		String<char> bases;
+		resize(bases, len);
+		memcpy(&bases[0], buf, len);
+		String<char> colors = convert_bp_to_color(bases, true);
+		len = seqan::length(colors);
+		if (len > 0)
+			memcpy(buf, &colors[0], len);
+	}
+	return len;
+}
+
+/*
+ * Spellings of the packed reference bases; insertions have always been
+ * searched against the reference as a DnaString, which reads N as A.
+ */
+static const char dna5_chars[] = "ACGTN";
+static const char dna_chars[] = "ACGTA";
 
 /**
  * Try to detect a small insertion.
@@ -2484,19 +2891,24 @@ void detect_small_insertion(RefSequenceTable& rt,
 		 * the actual read sequence
 		 */
 		int discrepancy = read_length - (rightHit.right() - leftHit.left());
-		DnaString genomic_sequence_temp = seqan::infix(*ref_str, leftHit.left() + begin_offset, rightHit.right() + end_offset);
-		String<char> genomic_sequence;
-		assign(genomic_sequence, genomic_sequence_temp);
+		size_t genomic_begin = leftHit.left() + begin_offset;
+		size_t genomic_end = rightHit.right() + end_offset;
+		if(genomic_end < genomic_begin || genomic_end > seqan::length(*ref_str))
+		  return;
 
-		if(color)
-		  genomic_sequence = convert_bp_to_color(genomic_sequence, true);
+		SplitBuffer genomic_sequence(genomic_end - genomic_begin);
+		size_t genomic_length = reference_chars(*ref_str, genomic_begin, genomic_end,
+							dna_chars, genomic_sequence.data());
+		if(genomic_length > read_length)
+		  return;
 
-		String<char> left_read_sequence = seqan::infix(read_sequence, 0, 0 + seqan::length(genomic_sequence));
-		String<char> right_read_sequence = seqan::infix(read_sequence, read_length - seqan::length(genomic_sequence), read_length);
+		const char* left_read_sequence = &read_sequence[0];
+		const char* right_read_sequence = left_read_sequence + read_length - genomic_length;
 
 		int bestInsertPosition = -1;
 		int minErrors = -1;
-		simpleSplitAlignment(genomic_sequence, left_read_sequence, right_read_sequence, bestInsertPosition, minErrors);
+		simpleSplitAlignment(genomic_sequence.data(), left_read_sequence, right_read_sequence,
+				     genomic_length, bestInsertPosition, minErrors);
 
 		/*
 		 * Need to decide if the insertion is suitably improves the alignment
@@ -2511,9 +2923,9 @@ void detect_small_insertion(RefSequenceTable& rt,
 			adjustment = -1;
 		}
 		if(minErrors <= (leftHit.edit_dist()+rightHit.edit_dist()+adjustment)){
-			String<char> insertedSequence = seqan::infix(left_read_sequence, bestInsertPosition, bestInsertPosition + discrepancy);
+			String<char> insertedSequence = seqan::infix(read_sequence, bestInsertPosition, bestInsertPosition + discrepancy);
 			if(color)
-			  insertedSequence = convert_color_to_bp(genomic_sequence_temp[bestInsertPosition - begin_offset + end_offset - 1], insertedSequence);
+			  insertedSequence = convert_color_to_bp(dna_chars[ordValue((Dna5)(*ref_str)[leftHit.left() + bestInsertPosition + end_offset - 1])], insertedSequence);
 			
 			insertions.insert(Insertion(leftHit.ref_id(),
 					leftHit.left() + bestInsertPosition - 1 + end_offset,
@@ -2558,32 +2970,28 @@ void detect_small_deletion(RefSequenceTable& rt,
 		if(leftHit.left() + begin_offset < 0)
 		  return;
 
-		size_t read_length = seqan::length(read_sequence);
-		if(rightHit.right() + read_length + begin_offset < 0 )
+		int read_length = seqan::length(read_sequence);
+		if(rightHit.right() - read_length + begin_offset < 0)
 		  return;
 
 		int discrepancy = (rightHit.right() - leftHit.left()) - read_length;
-		Dna5String leftGenomicSequence_temp = seqan::infix(*ref_str, leftHit.left() + begin_offset, leftHit.left() + read_length + end_offset);
-		Dna5String rightGenomicSequence_temp = seqan::infix(*ref_str, rightHit.right() - read_length + begin_offset, rightHit.right() + end_offset);
-
-		if (length(leftGenomicSequence_temp) < read_length || length(rightGenomicSequence_temp) < read_length)
+		size_t left_begin = leftHit.left() + begin_offset;
+		size_t left_end = leftHit.left() + read_length + end_offset;
+		size_t right_begin = rightHit.right() - read_length + begin_offset;
+		size_t right_end = rightHit.right() + end_offset;
+		if(left_end > seqan::length(*ref_str) || right_end > seqan::length(*ref_str))
 		  return;
 
-		String<char> leftGenomicSequence;
-		assign(leftGenomicSequence, leftGenomicSequence_temp);
-
-		String<char> rightGenomicSequence;
-		assign(rightGenomicSequence, rightGenomicSequence_temp);
-
-		if(color){
-		  leftGenomicSequence = convert_bp_to_color(leftGenomicSequence, true);
-		  rightGenomicSequence = convert_bp_to_color(rightGenomicSequence, true);
-		}
+		SplitBuffer leftGenomicSequence(left_end - left_begin);
+		SplitBuffer rightGenomicSequence(right_end - right_begin);
+		reference_chars(*ref_str, left_begin, left_end, dna5_chars, leftGenomicSequence.data());
+		reference_chars(*ref_str, right_begin, right_end, dna5_chars, rightGenomicSequence.data());
 
 		int bestInsertPosition = -1;
 		int minErrors = -1;
 
-		simpleSplitAlignment(read_sequence, leftGenomicSequence, rightGenomicSequence, bestInsertPosition, minErrors);
+		simpleSplitAlignment(&read_sequence[0], leftGenomicSequence.data(), rightGenomicSequence.data(),
+				     read_length, bestInsertPosition, minErrors);
 
 		/*
 		 * Need to decide if the deletion is suitably improves the alignment
@@ -2608,6 +3016,35 @@ void detect_small_deletion(RefSequenceTable& rt,
 	return;
 }
 
+/*
+ * A first or last segment hit placed for the indel sweep.  The key is the
+ * hit's outer end on the read's strand (negated for antisense hits, whose
+ * first segment lies to the right), so that for any pair the distance the
+ * read appears to span is the last segment's key minus the first's.
+ */
+struct IndelSweepHit
+{
+	IndelSweepHit(BowtieHit* h, bool first_segment)
+		: hit(h)
+	{
+		if (first_segment)
+			key = h->antisense_align() ? -(int64_t)h->right() : h->left();
+		else
+			key = h->antisense_align() ? -(int64_t)h->left() : h->right();
+	}
+
+	bool operator<(const IndelSweepHit& rhs) const
+	{
+		if (hit->ref_id() != rhs.hit->ref_id())
+			return hit->ref_id() < rhs.hit->ref_id();
+		if (hit->antisense_align() != rhs.hit->antisense_align())
+			return hit->antisense_align() < rhs.hit->antisense_align();
+		return key < rhs.key;
+	}
+
+	BowtieHit* hit;
+	int64_t key;
+};
 
 void find_insertions_and_deletions(RefSequenceTable& rt,
 		ReadStream& reads_file,
@@ -2651,7 +3088,7 @@ void find_insertions_and_deletions(RefSequenceTable& rt,
 	  }
 
 	/*
-	 * Work through all combinations of mappings for the first and last segment to see if any are indicative
+	 * Work through the mappings for the first and last segment to see if any are indicative
 	 * of a small insertions or deletion
 	 */
 	HitsForRead& left_segment_hits = hits_for_read[first_segment];
@@ -2679,25 +3116,54 @@ void find_insertions_and_deletions(RefSequenceTable& rt,
 	}
 
 	size_t read_length = seqan::length(fullRead);
-	for(size_t left_segment_index = 0; left_segment_index < left_segment_hits.hits.size(); left_segment_index++){
-		for(size_t right_segment_index = 0; right_segment_index < right_segment_hits.hits.size(); right_segment_index++){
-			BowtieHit* leftHit = &left_segment_hits.hits[left_segment_index];
-			BowtieHit* rightHit = &right_segment_hits.hits[right_segment_index];
-			/*
-			 * Now we have found a pair of segment hits to investigate. Need to ensure
-			 * that
-			 * 1. the alignment orientation is consistent
-			 * 2. the distance separation is in the appropriate range
-			 * 3. Both hits are aligned to the same contig
-			 */
-			if(leftHit->ref_id() != rightHit->ref_id()){
-				continue;
-			}
+	if(read_length == 0){
+		return;
+	}
+
+	/*
+	 * Sort both lists by contig, strand and key, so that the last segment hits
+	 * that can pair with a first segment hit are a single run: those on the same
+	 * contig and strand whose apparent length differs from the read's by at most
+	 * max_insertion_length shorter or max_deletion_length longer.
+	 */
+	vector<IndelSweepHit> first_hits;
+	vector<IndelSweepHit> last_hits;
+	first_hits.reserve(left_segment_hits.hits.size());
+	last_hits.reserve(right_segment_hits.hits.size());
+	for(size_t i = 0; i < left_segment_hits.hits.size(); i++){
+		first_hits.push_back(IndelSweepHit(&left_segment_hits.hits[i], true));
+	}
+	for(size_t i = 0; i < right_segment_hits.hits.size(); i++){
+		last_hits.push_back(IndelSweepHit(&right_segment_hits.hits[i], false));
+	}
+	sort(first_hits.begin(), first_hits.end());
+	sort(last_hits.begin(), last_hits.end());
 
-			if(leftHit->antisense_align() != rightHit->antisense_align()){
-				continue;
+	size_t window_begin = 0;
+	for(size_t f = 0; f < first_hits.size(); f++){
+		const IndelSweepHit& first = first_hits[f];
+		int64_t min_key = first.key + (int64_t)read_length - (int64_t)max_insertion_length;
+		int64_t max_key = first.key + (int64_t)read_length + (int64_t)max_deletion_length;
+
+		/*
+		 * The first segment hits ascend, so the window never moves left
+		 */
+		IndelSweepHit lower = first;
+		lower.key = min_key;
+		while(window_begin < last_hits.size() && last_hits[window_begin] < lower){
+			window_begin++;
+		}
+
+		for(size_t l = window_begin; l < last_hits.size(); l++){
+			const IndelSweepHit& last = last_hits[l];
+			if(last.hit->ref_id() != first.hit->ref_id() ||
+			   last.hit->antisense_align() != first.hit->antisense_align() ||
+			   last.key > max_key){
+				break;
 			}
 
+			BowtieHit* leftHit = first.hit;
+			BowtieHit* rightHit = last.hit;
 			seqan::String<char>* modifiedRead = &fullRead;
 			/*
 			 * If we are dealing with an antisense alignment, then the left
@@ -2731,35 +3197,97 @@ void find_insertions_and_deletions(RefSequenceTable& rt,
 }
 
 /*
+ * For each read, finds the leftmost placement in contig with the fewest
+ * mismatches, provided there are fewer than 3 (-1 otherwise).  As before,
+ * the placement ending at the last base of the contig is not tried.
+ * Reads of up to 15bp are matched bit-parallel: a shift-add automaton
+ * keeps one 4-bit mismatch counter per read position (16 would overflow), and all reads
+ * advance together in a single pass over the contig.  Longer reads are
+ * compared char by char.
  */
-int map_read_to_contig(const String<char>& contig, const String<char>& read)
+void map_reads_to_contig(const Dna5String& contig,
+			 const vector<String<char> >& reads,
+			 vector<int>& positions)
 {
-  int contig_len = length(contig);
-  int read_len = length(read);
+  static const int max_mismatch = 3;
+  static const size_t max_bit_parallel_len = 15;
+  static const char dna5_chars[] = "ACGTN";
 
-  int pos = -1;
-  int mismatch = 3;
+  int contig_len = length(contig);
+  size_t num_reads = reads.size();
+  positions.assign(num_reads, -1);
+  vector<int> best(num_reads, max_mismatch);
+
+  // mismatch masks: field j of mm_masks[r][c] is 1 unless read r has base
+  // c at position j
+  vector<uint64_t> mm_masks(num_reads * 5, 0);
+  vector<uint64_t> states(num_reads, 0);
+  vector<int> counter_shifts(num_reads, 0);
+  vector<bool> bit_parallel(num_reads, false);
+  bool any_bit_parallel = false;
+  for (size_t r = 0; r < num_reads; ++r)
+    {
+      size_t read_len = length(reads[r]);
+      if (read_len == 0 || read_len > max_bit_parallel_len)
+	continue;
+      bit_parallel[r] = any_bit_parallel = true;
+      counter_shifts[r] = 4 * (read_len - 1);
+      for (size_t j = 0; j < read_len; ++j)
+	for (int c = 0; c < 5; ++c)
+	  {
+	    if (reads[r][j] != dna5_chars[c])
+	      mm_masks[r * 5 + c] |= (uint64_t)1 << (4 * j);
+	  }
+    }
 
-  for (int i = 0; i < contig_len - read_len; ++i)
+  if (any_bit_parallel)
     {
-      int temp_mismatch = 0;
-      for (int j = 0; j < read_len; ++j)
+      for (int t = 0; t < contig_len - 1; ++t)
 	{
-	  if (contig[i+j] != read[j])
-	    ++temp_mismatch;
-
-	  if (temp_mismatch >= mismatch)
-	    break;
+	  int c = ordValue(contig[t]);
+	  for (size_t r = 0; r < num_reads; ++r)
+	    {
+	      if (!bit_parallel[r])
+		continue;
+	      int read_len = length(reads[r]);
+	      states[r] = (states[r] << 4) + mm_masks[r * 5 + c];
+	      if (t < read_len - 1 || best[r] == 0)
+		continue;
+	      int mismatch = (int)((states[r] >> counter_shifts[r]) & 0xF);
+	      if (mismatch < best[r])
+		{
+		  best[r] = mismatch;
+		  positions[r] = t - read_len + 1;
+		}
+	    }
 	}
+    }
 
-      if (temp_mismatch < mismatch)
+  for (size_t r = 0; r < num_reads; ++r)
+    {
+      const String<char>& read = reads[r];
+      int read_len = length(read);
+      if (bit_parallel[r])
+	continue;
+      for (int i = 0; i < contig_len - read_len; ++i)
 	{
-	  pos = i;
-	  mismatch = temp_mismatch;
+	  int temp_mismatch = 0;
+	  for (int j = 0; j < read_len; ++j)
+	    {
+	      if (dna5_chars[ordValue(contig[i+j])] != read[j])
+		++temp_mismatch;
+
+	      if (temp_mismatch >= best[r])
+		break;
+	    }
+
+	  if (temp_mismatch < best[r])
+	    {
+	      positions[r] = i;
+	      best[r] = temp_mismatch;
+	    }
 	}
     }
-
-  return pos;
 }
 
 void find_gaps(RefSequenceTable& rt,
@@ -2931,7 +3459,13 @@ void find_gaps(RefSequenceTable& rt,
             seqan::String<char> fwd_read = infix(fullRead, read_length - check_read_len, read_length);
             seqan::String<char> rev_read = infix(rcRead, 0, check_read_len);
 
-            int fwd_pos = map_read_to_contig(right_flanking_seq, fwd_read);
+            vector<seqan::String<char> > check_reads;
+            check_reads.push_back(fwd_read);
+            check_reads.push_back(rev_read);
+            vector<int> check_pos;
+            map_reads_to_contig(right_flanking_seq, check_reads, check_pos);
+
+            int fwd_pos = check_pos[0];
             if (fwd_pos >= 0)
         {
           BowtieHit hit(rightHit.ref_id(), rightHit.insert_id(),
@@ -2940,7 +3474,7 @@ void find_gaps(RefSequenceTable& rt,
           hits_for_read[last_segment].hits.push_back(hit);
         }
 
-            int rev_pos = map_read_to_contig(right_flanking_seq, rev_read);
+            int rev_pos = check_pos[1];
 
             if (rev_pos >= 0)
         {
@@ -3204,81 +3738,130 @@ void add_to_microexon_windows(uint32_t ref_id,
   
 }
 
+typedef map<RefSeg, vector<string>* >::const_iterator MicroexonWindowItr;
+
+// Searches every num_workers-th microexon window, starting at first_window,
+// for extendable junctions.  Each worker owns its extension table and its
+// junction set, so workers can run concurrently.
+struct MicroexonWindowWorker
+{
+  MicroexonWindowWorker(RefSequenceTable* _rt,
+			const vector<MicroexonWindowItr>* _windows,
+			size_t _first_window,
+			size_t _num_workers,
+			int _max_juncs,
+			int _half_splice_mer_len) :
+    rt(_rt),
+    windows(_windows),
+    first_window(_first_window),
+    num_workers(_num_workers),
+    max_juncs(_max_juncs),
+    half_splice_mer_len(_half_splice_mer_len) {}
+  
+  void operator()()
+  {
+    SparseMerExtensionTable window_exts;
+    for (size_t w = first_window; w < windows->size(); w += num_workers)
+      {
+	if (first_window == 0 && (w / num_workers + 1) % 100 == 0)
+	  fprintf(stderr, "\twindow %lu\n", (long unsigned int)(w + 1));
+	
+	MicroexonWindowItr itr = (*windows)[w];
+	const vector<string>& unaligned_segments = *itr->second;
+	
+	window_exts.clear();
+	for (size_t j = 0; j < unaligned_segments.size(); ++j)
+	  {
+	    store_read_extensions(window_exts,
+				  half_splice_mer_len,
+				  half_splice_mer_len,
+				  unaligned_segments[j],
+				  false);
+	  }
+	window_exts.finalize();
+	
+	vector<RefSeg> segs;
+	segs.push_back(itr->first);
+	RefSeg r = itr->first;
+	r.points_where = POINT_DIR_LEFT;
+	segs.push_back(r);
+	
+	juncs_from_ref_segs<RecordExtendableJuncs>(*rt, 
+						   segs, 
+						   juncs, 
+						   "GT", 
+						   "AG", 
+						   max_microexon_stretch, 
+						   min_coverage_intron_length, 
+						   max_juncs,
+						   false,
+						   half_splice_mer_len,
+						   RecordExtendableJuncs(&window_exts));
+      }
+  }
+  
+  RefSequenceTable* rt;
+  const vector<MicroexonWindowItr>* windows;
+  size_t first_window;
+  size_t num_workers;
+  int max_juncs;
+  int half_splice_mer_len;
+  
+  PotentialJuncs juncs;
+};
+
 void align_microexon_segs(RefSequenceTable& rt,
 			  std::set<Junction, skip_count_lt>& juncs,
 			  int max_juncs,
 			  int half_splice_mer_len)
 {
 	int num_segments = 0;
-	for (map<RefSeg, vector<string>* >::iterator itr = microexon_windows.begin(); 
+	vector<MicroexonWindowItr> windows;
+	for (MicroexonWindowItr itr = microexon_windows.begin(); 
 		 itr != microexon_windows.end(); ++itr)
 	{
 		vector<string>& unaligned_segments = *itr->second;
 		num_segments += unaligned_segments.size();
+		windows.push_back(itr);
 	}
 	
 	fprintf(stderr, "Aligning %d microexon segments in %lu windows\n",
 	       num_segments, (long unsigned int)microexon_windows.size());
 	
-	extensions.clear();
+	// Each window gets its own small extension table, so the genome-wide 
+	// one is no longer needed.
+	MerExtensionTable().swap(extensions);
 	
-	size_t splice_mer_len = 2 * half_splice_mer_len;
-	size_t mer_table_size = 1 << ((splice_mer_len)<<1);
+	size_t num_workers = max(1, min(num_cpus, (int)windows.size()));
+	vector<MicroexonWindowWorker> workers;
+	for (size_t i = 0; i < num_workers; ++i)
+	{
+		workers.push_back(MicroexonWindowWorker(&rt,
+							&windows,
+							i,
+							num_workers,
+							max_juncs,
+							half_splice_mer_len));
+	}
+	run_tasks(workers);
 	
-	extensions.resize(mer_table_size);
-
-	int window_num = 0;
-	for (map<RefSeg, vector<string>* >::iterator itr = microexon_windows.begin(); 
-		 itr != microexon_windows.end(); ++itr)
+	for (size_t i = 0; i < workers.size(); ++i)
 	{
-		window_num++;
-		if ((window_num % 100) == 0)
-			fprintf(stderr, "\twindow %d\n",window_num);
-		
-		
-		stringstream ss(stringstream::in | stringstream::out);
-
-		for (size_t j = 0; j < extensions.size(); ++j)
+		PotentialJuncs& worker_juncs = workers[i].juncs;
+		for (PotentialJuncs::iterator j = worker_juncs.begin(); j != worker_juncs.end(); ++j)
 		{
-			extensions[j].clear();
-		}
-		
-		vector<string>& unaligned_segments = *itr->second;
-		
-		for (size_t j = 0; j < unaligned_segments.size(); ++j)
-		{
-			stringstream ss(stringstream::in | stringstream::out);
-			string s;
-			//cerr << w.unaligned_segments[j];
-			ss << unaligned_segments[j];
-			ss >> s;
-
-			store_read_extensions(extensions,
-					      half_splice_mer_len,
-					      half_splice_mer_len,
-					      s,
-					      false);
+			juncs.insert(*j);
+			if (juncs.size() > (size_t)max_juncs)
+				juncs.erase(*(juncs.rbegin()));
 		}
-		
-		vector<RefSeg> segs;
-		segs.push_back(itr->first);
-		RefSeg r = itr->first;
-		r.points_where = POINT_DIR_LEFT;
-		segs.push_back(r);
-		
-		juncs_from_ref_segs<RecordExtendableJuncs>(rt, 
-							   segs, 
-							   juncs, 
-							   "GT", 
-							   "AG", 
-							   max_microexon_stretch, 
-							   min_coverage_intron_length, 
-							   max_juncs,
-							   false,
-							   half_splice_mer_len);
-		num_segments += unaligned_segments.size();
+	}
+	
+	for (MicroexonWindowItr itr = microexon_windows.begin(); 
+		 itr != microexon_windows.end(); ++itr)
+	{
 		delete itr->second;
 	}
+	
 	fprintf(stderr, "Checked %d segments against %lu windows for microexon junctions\n",
 	               num_segments, (long unsigned int)microexon_windows.size());
 	fprintf(stderr, "Found %ld potential microexon junctions\n", (long int)juncs.size());
@@ -3523,10 +4106,6 @@ bool process_next_hit_group(RefSequenceTable& rt,
   return result;
 }
 
-static const int UNCOVERED = 0;
-static const int LOOK_LEFT = 1;
-static const int LOOK_RIGHT = 2;
-
 uint8_t get_cov(const vector<uint8_t>& cov, uint32_t c)
 {
 	uint32_t b = c >> 2;
@@ -3538,55 +4117,182 @@ uint8_t get_cov(const vector<uint8_t>& cov, uint32_t c)
 	return v;
 }
 
-void build_coverage_map(ReadTable& it, RefSequenceTable& rt,
-    vector<FZPipe*>& seg_files, map<uint32_t, vector<bool> >& coverage_map) {
- if (!coverage_map.empty()) return;
- BowtieHitFactory hit_factory(it,rt);
-
- for (size_t f = 0; f < seg_files.size(); ++f)
-   {
-     //fprintf(stderr, "Adding hits from segment file %d to coverage map\n", (int)f);
-     seg_files[f]->rewind();
-     FILE* fp = seg_files[f]->file;
-     HitStream hs(fp, &hit_factory, false, false, false);
-     HitsForRead hit_group;
-     while (hs.next_read_hits(hit_group))
-     {
-       for (size_t h = 0; h < hit_group.hits.size(); ++h)
-         {
-           BowtieHit& bh = hit_group.hits[h];
-
-           pair<map<uint32_t, vector<bool> >::iterator, bool> ret =
-               coverage_map.insert(make_pair(bh.ref_id(), vector<bool>()));
-           vector<bool>& ref_cov = ret.first->second;
-
-           size_t right_extent = bh.right();
-
-           if (right_extent >= ref_cov.size())
-           {
-             ref_cov.resize(right_extent + 1, 0);
-           }
-
-           for (uint32_t c = (uint32_t)bh.left(); c < (uint32_t)bh.right(); ++c)
-           {
-             ref_cov[c] = true;
-             //if (ref_cov[c]<255) ref_cov[c]++;
-           }
-         }
-     } //while next_read_hits
-   }
+/**
+ * Per-base coverage of one reference sequence, packed 64 bases to a word.
+ * Covered ranges are set a word at a time and islands are found by
+ * scanning for the next set (or clear) bit with count-trailing-zeros,
+ * so nothing has to visit the bases one by one.
+ */
+class CoverageBitmap
+{
+public:
+  CoverageBitmap(size_t len = 0) : _size(0) { extend(len); }
+  
+  size_t size() const { return _size; }
+  
+  // Grows the map (with uncovered bases) to at least len bases
+  void extend(size_t len)
+  {
+    if (len > _size)
+      {
+	_size = len;
+	_words.resize((len + 63) >> 6, 0);
+      }
+  }
+  
+  bool operator[](size_t pos) const
+  {
+    return (_words[pos >> 6] >> (pos & 63)) & 1;
+  }
+  
+  // Marks [left, right) as covered; right must be <= size()
+  void set_range(size_t left, size_t right)
+  {
+    if (left >= right)
+      return;
+    size_t lw = left >> 6;
+    size_t rw = (right - 1) >> 6;
+    uint64_t lmask = 0xFFFFFFFFFFFFFFFFull << (left & 63);
+    uint64_t rmask = 0xFFFFFFFFFFFFFFFFull >> (63 - ((right - 1) & 63));
+    if (lw == rw)
+      {
+	_words[lw] |= lmask & rmask;
+	return;
+      }
+    _words[lw] |= lmask;
+    for (size_t w = lw + 1; w < rw; ++w)
+      _words[w] = 0xFFFFFFFFFFFFFFFFull;
+    _words[rw] |= rmask;
+  }
+  
+  // Returns the first position >= pos that is covered (or, if covered is
+  // false, uncovered), or size() if there is none
+  size_t find_next(size_t pos, bool covered) const
+  {
+    if (pos >= _size)
+      return _size;
+    size_t w = pos >> 6;
+    uint64_t bits = covered ? _words[w] : ~_words[w];
+    bits &= 0xFFFFFFFFFFFFFFFFull << (pos & 63);
+    while (!bits)
+      {
+	if (++w >= _words.size())
+	  return _size;
+	bits = covered ? _words[w] : ~_words[w];
+      }
+    return min((w << 6) + __builtin_ctzll(bits), _size);
+  }
+  
+private:
+  vector<uint64_t> _words;
+  size_t _size;
+};
+
+typedef map<uint32_t, CoverageBitmap> CoverageMap;
+
+// The bases [left, right] of ref_id covered by a hit
+struct CoveredRange
+{
+  CoveredRange(uint32_t _ref_id, uint32_t _left, uint32_t _right) :
+    ref_id(_ref_id), left(_left), right(_right) {}
+  uint32_t ref_id;
+  uint32_t left;
+  uint32_t right;
+};
+
+// Marks the bases covered by the hits in every num_workers-th segment file,
+// starting with first_file.  Parsing the hits is the expensive part, so the
+// workers only collect the covered ranges and mark them in the one shared
+// coverage map a batch at a time, under its lock.
+struct CoverageMapWorker
+{
+  static const size_t batch_size = 65536;
+
+  CoverageMapWorker(vector<FZPipe*>* _seg_files,
+		    size_t _first_file,
+		    size_t _num_workers,
+		    CoverageMap* _coverage_map,
+		    pthread_mutex_t* _coverage_lock) :
+    seg_files(_seg_files),
+    first_file(_first_file),
+    num_workers(_num_workers),
+    coverage_map(_coverage_map),
+    coverage_lock(_coverage_lock) {}
+  
+  void operator()()
+  {
+    // The factory adds to its tables as it goes, so each worker needs its
+    // own.  Reference ids are name hashes, so they match the caller's.
+    ReadTable it;
+    RefSequenceTable rt(false);
+    BowtieHitFactory hit_factory(it,rt);
+    vector<CoveredRange> ranges;
+    ranges.reserve(batch_size);
+    
+    for (size_t f = first_file; f < seg_files->size(); f += num_workers)
+      {
+	(*seg_files)[f]->rewind();
+	FILE* fp = (*seg_files)[f]->file;
+	HitStream hs(fp, &hit_factory, false, false, false);
+	HitsForRead hit_group;
+	while (hs.next_read_hits(hit_group))
+	  {
+	    for (size_t h = 0; h < hit_group.hits.size(); ++h)
+	      {
+		BowtieHit& bh = hit_group.hits[h];
+		ranges.push_back(CoveredRange(bh.ref_id(), bh.left(), bh.right()));
+	      }
+	    if (ranges.size() >= batch_size)
+	      mark_ranges(ranges);
+	  } //while next_read_hits
+      }
+    mark_ranges(ranges);
+  }
+  
+  void mark_ranges(vector<CoveredRange>& ranges)
+  {
+    pthread_mutex_lock(coverage_lock);
+    for (size_t i = 0; i < ranges.size(); ++i)
+      {
+	CoverageBitmap& ref_cov = (*coverage_map)[ranges[i].ref_id];
+	ref_cov.extend(ranges[i].right + 1);
+	ref_cov.set_range(ranges[i].left, ranges[i].right);
+      }
+    pthread_mutex_unlock(coverage_lock);
+    ranges.clear();
+  }
+  
+  vector<FZPipe*>* seg_files;
+  size_t first_file;
+  size_t num_workers;
+  CoverageMap* coverage_map;
+  pthread_mutex_t* coverage_lock;
+};
+
+void build_coverage_map(vector<FZPipe*>& seg_files, CoverageMap& coverage_map) {
+ if (!coverage_map.empty() || seg_files.empty()) return;
+ 
+ size_t num_workers = min((size_t)max(num_cpus, 1), seg_files.size());
+ pthread_mutex_t coverage_lock;
+ pthread_mutex_init(&coverage_lock, NULL);
+ vector<CoverageMapWorker> workers;
+ for (size_t i = 0; i < num_workers; ++i)
+   workers.push_back(CoverageMapWorker(&seg_files, i, num_workers,
+				       &coverage_map, &coverage_lock));
+ run_tasks(workers);
+ pthread_mutex_destroy(&coverage_lock);
 }
 
 void pair_covered_sites(ReadTable& it,
 			RefSequenceTable& rt,
 			vector<FZPipe*>& seg_files,
 			std::set<Junction, skip_count_lt>& cov_juncs,
-			map<uint32_t, vector<bool> >& coverage_map,
+			CoverageMap& coverage_map,
 			size_t half_splice_mer_len)
 {
   vector<RefSeg> expected_look_left_windows;
   vector<RefSeg> expected_look_right_windows;
-  build_coverage_map(it,rt, seg_files, coverage_map);
+  build_coverage_map(seg_files, coverage_map);
   
   static const int extend = 45;
   int num_islands = 0;
@@ -3595,43 +4301,42 @@ void pair_covered_sites(ReadTable& it,
   
   fprintf(stderr, "Recording coverage islands\n");
   size_t cov_bases = 0;
-  for (map<uint32_t, vector<bool> >::iterator itr = coverage_map.begin();
+  for (CoverageMap::iterator itr = coverage_map.begin();
        itr != coverage_map.end();
        ++itr)
     {
-      vector<bool>& cov = itr->second;
+      CoverageBitmap& cov = itr->second;
       
       size_t island_left_edge = 0;
-      for (size_t c = 1; c < cov.size(); ++c)
+      for (size_t c = cov.find_next(0, true); 
+	   c < cov.size(); 
+	   c = cov.find_next(c, true))
 	{
-	  if (cov[c])
+	  size_t island_end = cov.find_next(c, false);
+	  if (c > 0)
 	    {
-	      cov_bases++;
-	      if (!cov[c - 1])
-		{
-		  num_islands += 1;
-		  int edge = (int)c - extend;
-		  edge = max(edge, 0);
-		  island_left_edge = edge;
-		}
+	      num_islands += 1;
+	      int edge = (int)c - extend;
+	      edge = max(edge, 0);
+	      island_left_edge = edge;
 	    }
-	  else
+	  cov_bases += island_end - max(c, (size_t)1);
+	  c = island_end;
+	  
+	  if (island_end < cov.size())
 	    {
-	      if (cov[c - 1])
-		{
-		  expected_don_acc_windows.push_back(RefSeg(itr->first,
-							    POINT_DIR_LEFT,
-							    false, /* not important */
-							    READ_DONTCARE,
-							    island_left_edge,
-							    c + extend));
-		  expected_don_acc_windows.push_back(RefSeg(itr->first,
-							    POINT_DIR_RIGHT,
-							    false, /* not important */
-							    READ_DONTCARE,
-							    island_left_edge,
-							    c + extend));	
-		}
+	      expected_don_acc_windows.push_back(RefSeg(itr->first,
+							POINT_DIR_LEFT,
+							false, /* not important */
+							READ_DONTCARE,
+							island_left_edge,
+							island_end + extend));
+	      expected_don_acc_windows.push_back(RefSeg(itr->first,
+							POINT_DIR_RIGHT,
+							false, /* not important */
+							READ_DONTCARE,
+							island_left_edge,
+							island_end + extend));	
 	    }
 	}
     }
@@ -3673,7 +4378,7 @@ void capture_island_ends(ReadTable& it,
 			 //vector<FILE*>& seg_files,
 			 vector<FZPipe*>& seg_files,
 			 std::set<Junction, skip_count_lt>& cov_juncs,
-			  map<uint32_t, vector<bool> >& coverage_map,
+			 CoverageMap& coverage_map,
 			 size_t half_splice_mer_len)
 {
   //static int island_repeat_tolerance = 10;
@@ -3685,7 +4390,7 @@ void capture_island_ends(ReadTable& it,
 //#define DEBUG_RANGE_ONLY 1
 
 #ifndef DEBUG_CHECK_EXONS
-  build_coverage_map(it, rt, seg_files, coverage_map);
+  build_coverage_map(seg_files, coverage_map);
 #else
   //build coverage map here, so we can debug it
   #ifdef DEBUG_RANGE_ONLY
@@ -3725,20 +4430,9 @@ void capture_island_ends(ReadTable& it,
 		     hits.push_back(read_info);
 		   #endif
 
-		  pair<map<uint32_t, vector<bool> >::iterator, bool> ret = 
-		     coverage_map.insert(make_pair(bh.ref_id(), vector<bool>()));
-		  vector<bool>& ref_cov = ret.first->second;
-		  
-		  size_t right_extent = bh.right();
-		  
-		  if (right_extent >= ref_cov.size())
-		   {
-		   ref_cov.resize(right_extent + 1, 0);
-		   }
-		  for (uint32_t c = (uint32_t)bh.left(); c < (uint32_t)bh.right(); ++c)
-		   {
-		   ref_cov[c] = true;
-		   }
+		  CoverageBitmap& ref_cov = coverage_map[bh.ref_id()];
+		  ref_cov.extend(bh.right() + 1);
+		  ref_cov.set_range(bh.left(), bh.right());
 		}
 	  }
 	}
@@ -3755,44 +4449,43 @@ void capture_island_ends(ReadTable& it,
   
   int num_islands = 0;
   
-  for (map<uint32_t, vector<bool> >::iterator itr = coverage_map.begin();
+  for (CoverageMap::iterator itr = coverage_map.begin();
        itr != coverage_map.end();
        ++itr)
     {
       #ifdef B_DEBUG
       fprintf (stderr, "Finding pairings in ref seq %s\n", rt.get_name(itr->first));
       #endif
-      vector<bool>& cov = itr->second;
-      vector<bool> long_enough(cov.size());
-      
-      size_t last_uncovered = 0;
-      
-      static const uint8_t min_cov = 1;
+      CoverageBitmap& cov = itr->second;
+      CoverageBitmap long_enough(cov.size());
       
-      for (size_t c = 1; c < cov.size(); ++c)
+      // Keep the islands that are long enough to be exons.  The marked 
+      // range runs from the base after the last uncovered one up to and 
+      // including the first uncovered base after the island.
+      for (size_t c = cov.find_next(0, true); 
+	   c < cov.size(); 
+	   c = cov.find_next(c, true))
       {
-      uint8_t c_cov = cov[c]; //get_cov(cov, c);
-      if (c_cov < min_cov || c == (cov.size()) - 1)
+      size_t island_end = cov.find_next(c, false);
+      size_t last_uncovered = c > 0 ? c - 1 : 0;
+      c = island_end;
+      if (island_end == cov.size())
+        break;
+      
+      int putative_exon_length = (int)island_end - (int)last_uncovered;
+      if (putative_exon_length >= min_cov_length)
         {
-        int putative_exon_length = (int)c - (int)last_uncovered;
-        uint32_t last_pos_cov = cov[c - 1]; //get_cov(cov,c - 1);
-        if (last_pos_cov >= min_cov && putative_exon_length >= min_cov_length)
-          {
-          #ifdef B_DEBUG
-          fprintf(stderr, "cov. island: %d-%d\n", (int)(last_uncovered + 1), (int)c);
-          fprintf(stderr, "\t(putative exon length = %d, min_cov_length=%d)\n",putative_exon_length, min_cov_length);
-          #endif
-          covered_bases += (c + 1 - last_uncovered);
-          for (int l = (int)c; l > (int)last_uncovered; --l)
-            {
-              long_enough[l] = true;
-            }
-          }
-        last_uncovered = c;
+        #ifdef B_DEBUG
+        fprintf(stderr, "cov. island: %d-%d\n", (int)(last_uncovered + 1), (int)island_end);
+        fprintf(stderr, "\t(putative exon length = %d, min_cov_length=%d)\n",putative_exon_length, min_cov_length);
+        #endif
+        covered_bases += (island_end + 1 - last_uncovered);
+        long_enough.set_range(last_uncovered + 1, island_end + 1);
         }
       }
-      vector<bool>& ref_cov = long_enough;
-      vector<uint8_t> cov_state(ref_cov.size(), UNCOVERED);
+      CoverageBitmap& ref_cov = long_enough;
+      CoverageBitmap look_left(ref_cov.size());
+      CoverageBitmap look_right(ref_cov.size());
 
       // daehwan - print islands (exons)
       //if (check_exons)
@@ -3825,96 +4518,48 @@ void capture_island_ends(ReadTable& it,
 		}
 	//}
 #endif
-	for (size_t c = 1; c < ref_cov.size(); ++c)
+	for (size_t c = ref_cov.find_next(0, true); 
+	     c < ref_cov.size(); 
+	     c = ref_cov.find_next(c, true))
 	{
-	  if (ref_cov[c])
-		{
-		  long_enough_bases++;
-		  if (!ref_cov[c - 1])
-		  {
-		  num_islands += 1;
-		  
-		  for (int r = (int)c - extend; 
-		       r >= 0 && r < (int)c + repeat_tol && r < (int)cov_state.size(); 
-		       ++r)
-		    {
-		      cov_state[r] |= LOOK_LEFT;
-		    }
-		  }
-	    }
-	  else
+	  size_t island_end = ref_cov.find_next(c, false);
+	  long_enough_bases += island_end - max(c, (size_t)1);
+	  if (c > 0)
 	    {
-	      if (ref_cov[c - 1])
-		{
-		  for (int l = (int)c - repeat_tol; 
-		       l >= 0 && l < (int)c + extend && l < (int)cov_state.size(); 
-		       ++l)
-		    {
-		      cov_state[l] |= LOOK_RIGHT;
-		    }	
-		}
+	      num_islands += 1;
+	      if ((int)c - extend >= 0)
+		look_left.set_range(c - extend, min(c + repeat_tol, ref_cov.size()));
 	    }
+	  if (island_end < ref_cov.size() && (int)island_end - repeat_tol >= 0)
+	    look_right.set_range(island_end - repeat_tol, min(island_end + extend, ref_cov.size()));
+	  c = island_end;
 	}
       
-      RefSeg* curr_look_left = NULL;
-      RefSeg* curr_look_right = NULL;
-      
-	for (size_t c = 1; c < cov_state.size(); ++c)
+      for (int dir = 0; dir < 2; ++dir)
 	{
-	  if (cov_state[c] & LOOK_LEFT)
-	    {
-	      left_looking++;
-	      if (!(cov_state[c-1] & LOOK_LEFT))
-		{
-		  expected_look_left_windows.push_back(RefSeg(itr->first,
-							      POINT_DIR_LEFT,
-							      false, /* not important */
-							      READ_DONTCARE,
-							      c,
-							      c + 1));
-		  curr_look_left = &(expected_look_left_windows.back());
-		}
-	      else if (curr_look_left)
-		{
-		  curr_look_left->right++;
-		}
-	    }
-	  else
-	    {
-	      if ((cov_state[c-1] & LOOK_LEFT))
-		{
-		  curr_look_left = NULL;
-		}
-	    }
+	  const CoverageBitmap& looking = dir == 0 ? look_left : look_right;
+	  vector<RefSeg>& windows = dir == 0 ? expected_look_left_windows : expected_look_right_windows;
+	  int& num_looking = dir == 0 ? left_looking : right_looking;
 	  
-	  if (cov_state[c] & LOOK_RIGHT)
+	  // Each run of looking bases becomes a window, except for one 
+	  // starting at the first base of the sequence
+	  for (size_t c = looking.find_next(0, true); 
+	       c < looking.size(); 
+	       c = looking.find_next(c, true))
 	    {
-	      right_looking++;
-	      if (!(cov_state[c-1] & LOOK_RIGHT))
-		  {
-		    expected_look_right_windows.push_back(RefSeg(itr->first,
-							         POINT_DIR_RIGHT,
-							         false, /* not important */
-							         READ_DONTCARE,
-							         c,
-							         c + 1));
-
-		    curr_look_right = &(expected_look_right_windows.back());
-		  }
-	      else if (curr_look_right)
-		   {
-		     curr_look_right->right++;
-		   }
+	      size_t run_end = looking.find_next(c, false);
+	      num_looking += run_end - max(c, (size_t)1);
+	      if (c > 0)
+		windows.push_back(RefSeg(itr->first,
+					 dir == 0 ? POINT_DIR_LEFT : POINT_DIR_RIGHT,
+					 false, /* not important */
+					 READ_DONTCARE,
+					 c,
+					 run_end));
+	      c = run_end;
 	    }
-	  else
-	    {
-	      if ((cov_state[c-1] & LOOK_RIGHT))
-		   {
-		     curr_look_right = NULL;
-		   }
-	    }
-	 }
 	}
+    }
   
   fprintf(stderr, " Map covers %ld bases\n", covered_bases);
   fprintf(stderr, " Map covers %d bases in sufficiently long segments\n", long_enough_bases);
@@ -4011,7 +4656,8 @@ void print_juncs(RefSequenceTable& rt, std::set<Junction, skip_count_lt>& juncs,
   fprintf (stderr, "-- done --\n");
 }
 
-void driver(istream& ref_stream,
+void driver(const string& ref_file_name,
+	    istream& ref_stream,
 	    FILE* juncs_out,
 	    FILE* insertions_out,
 	    FILE* deletions_out,
@@ -4047,7 +4693,8 @@ void driver(istream& ref_stream,
   RefSequenceTable rt(true, true);
   
   fprintf (stderr, "Loading reference sequences...\n");
-  get_seqs(ref_stream, rt, true, false);
+  get_seqs(ref_stream, rt, true);
+  load_splice_motif_index(splice_motifs, ref_file_name, rt);
 	
   ReadTable it;
   BowtieHitFactory hit_factory(it,rt);
@@ -4124,7 +4771,7 @@ void driver(istream& ref_stream,
   
   copy(all_seg_files.begin(), all_seg_files.end(), back_inserter(all_map_files));
 #endif
-  map<uint32_t, vector<bool> > coverage_map;
+  CoverageMap coverage_map;
   if (!no_coverage_search || butterfly_search)
     {
       if (ium_reads != "")
@@ -4142,6 +4789,7 @@ void driver(istream& ref_stream,
 		    fprintf (stderr, "Can't open file %s for reading, skipping...\n",ium_read_files[ium].c_str());
 		    continue;
 		  }
+				  ium_file.spool();
 	        iums.push_back(ium_file);
 	      }
 
@@ -4405,6 +5053,9 @@ int main(int argc, char** argv)
 	      left_reads_map_file_name.c_str());
       exit(1);
     }
+  // the hit files are read more than once below, so decompress each of
+  // them a single time up front
+  left_reads_map_file.spool();
 
   vector<string> left_segment_file_names;
   vector<FZPipe> left_segment_files;
@@ -4422,11 +5073,15 @@ int main(int argc, char** argv)
           left_segment_file_names[i].c_str());
         exit(1);
         }
+      seg_file.spool();
       left_segment_files.push_back(seg_file);
 
       if (i == left_segment_file_names.size() - 1)
       {
-        left_segment_file_for_segment_search = FZPipe(left_segment_file_names[i], unzcmd);
+        // a second reader of the spill, which also serves segment maps
+        // that are still streaming in from their FIFOs
+        string no_unzcmd;
+        left_segment_file_for_segment_search = FZPipe(seg_file.filename, no_unzcmd);
         if (left_segment_file_for_segment_search.file == NULL)
           {
             fprintf(stderr, "Error: cannot open %s for reading\n",
@@ -4462,6 +5117,7 @@ int main(int argc, char** argv)
           right_reads_map_file_name.c_str());
         exit(1);
       }
+      right_reads_map_file.spool();
             
       vector<string> right_segment_file_names;
       tokenize(right_segment_file_list, ",",right_segment_file_names);
@@ -4477,11 +5133,13 @@ int main(int argc, char** argv)
             right_segment_file_names[i].c_str());
           exit(1);
         }
+      seg_file.spool();
       right_segment_files.push_back(seg_file);
 
 	  if (i == right_segment_file_names.size() - 1)
 	    {
-	      right_segment_file_for_segment_search = FZPipe(right_segment_file_names[i], unzcmd);
+	      string no_unzcmd;
+	      right_segment_file_for_segment_search = FZPipe(seg_file.filename, no_unzcmd);
 	      if (right_segment_file_for_segment_search.file == NULL)
 		{
 		  fprintf(stderr, "Error: cannot open %s for reading\n",
@@ -4494,7 +5152,8 @@ int main(int argc, char** argv)
   // min_cov_length=20;
   if (min_cov_length>segment_length-2) min_cov_length=segment_length-2;
   
-  driver(ref_stream, 
+  driver(ref_file_name,
+	 ref_stream, 
 	 juncs_file,
 	 insertions_file,
 	 deletions_file,
@@ -0,0 +1,316 @@
+/*
+ *  splice_motifs.cpp
+ *  TopHat
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "splice_motifs.h"
+
+static const char motif_index_magic[8] = {'T', 'H', 'M', 'O', 'T', 'I', 'F', '2'};
+
+static const char* motif_strs[NUM_SPLICE_MOTIFS] = {"GT", "AG", "CT", "AC", "GC", "AT"};
+
+int splice_motif_id(const string& dinuc)
+{
+  if (dinuc.length() != 2)
+    return -1;
+  char d[3] = {(char)toupper(dinuc[0]), (char)toupper(dinuc[1]), 0};
+  for (int m = 0; m < NUM_SPLICE_MOTIFS; ++m)
+    {
+      if (strcmp(d, motif_strs[m]) == 0)
+	return m;
+    }
+  return -1;
+}
+
+string splice_motif_index_name(const string& ref_fasta)
+{
+  return ref_fasta + ".motifs";
+}
+
+void SpliceMotifIndex::MotifPositions::push_back(uint32_t pos, uint32_t& prev)
+{
+  if (count % motif_block_size == 0)
+    {
+      block_starts.push_back(pos);
+      block_offsets.push_back(gaps.size());
+    }
+  else
+    {
+      uint32_t gap = pos - prev;
+      while (gap >= 0x80)
+	{
+	  gaps.push_back((uint8_t)(gap | 0x80));
+	  gap >>= 7;
+	}
+      gaps.push_back((uint8_t)gap);
+    }
+  prev = pos;
+  ++count;
+}
+
+void SpliceMotifIndex::add_ref(uint32_t ref_id,
+			       const string& name,
+			       const RefSequenceTable::Sequence& seq)
+{
+  // Dinucleotide code (5 * first + second, Dna5 ordinals) -> motif, or -1
+  static int dinuc_motif[25];
+  static bool dinuc_motif_init = false;
+  if (!dinuc_motif_init)
+    {
+      static const char* dna5 = "ACGTN";
+      for (int i = 0; i < 25; ++i)
+	{
+	  string d;
+	  d.push_back(dna5[i / 5]);
+	  d.push_back(dna5[i % 5]);
+	  dinuc_motif[i] = splice_motif_id(d);
+	}
+      dinuc_motif_init = true;
+    }
+
+  RefMotifs& ref = _refs[ref_id];
+  ref = RefMotifs();
+  ref.name = name;
+  ref.len = seqan::length(seq);
+
+  // Single pass over the packed sequence with a rolling dinucleotide code
+  uint32_t prev[NUM_SPLICE_MOTIFS] = {0,};
+  typedef seqan::Iterator<const RefSequenceTable::Sequence>::Type SeqIter;
+  SeqIter it = seqan::begin(seq);
+  SeqIter seq_end = seqan::end(seq);
+  if (it == seq_end)
+    return;
+
+  int last = seqan::ordValue((seqan::Dna5)*it);
+  uint32_t pos = 0;
+  for (++it; it != seq_end; ++it, ++pos)
+    {
+      int curr = seqan::ordValue((seqan::Dna5)*it);
+      int m = dinuc_motif[last * 5 + curr];
+      if (m >= 0)
+	ref.motifs[m].push_back(pos, prev[m]);
+      last = curr;
+    }
+  _dirty = true;
+}
+
+bool SpliceMotifIndex::has_ref(uint32_t ref_id, uint32_t len) const
+{
+  map<uint32_t, RefMotifs>::const_iterator itr = _refs.find(ref_id);
+  return itr != _refs.end() && itr->second.len == len;
+}
+
+void SpliceMotifIndex::set_source(uint64_t fasta_size, int64_t fasta_mtime)
+{
+  if (same_source(fasta_size, fasta_mtime))
+    return;
+  _fasta_size = fasta_size;
+  _fasta_mtime = fasta_mtime;
+  _dirty = true;
+}
+
+void SpliceMotifIndex::find(uint32_t ref_id,
+			    int motif,
+			    uint32_t left,
+			    uint32_t right,
+			    vector<uint32_t>& out) const
+{
+  map<uint32_t, RefMotifs>::const_iterator itr = _refs.find(ref_id);
+  if (itr == _refs.end() || motif < 0 || motif >= NUM_SPLICE_MOTIFS || left >= right)
+    return;
+
+  const MotifPositions& mp = itr->second.motifs[motif];
+  if (mp.count == 0)
+    return;
+
+  // Start decoding from the last block beginning at or before left
+  size_t block = upper_bound(mp.block_starts.begin(), mp.block_starts.end(), left) -
+    mp.block_starts.begin();
+  if (block > 0)
+    --block;
+
+  for (; block < mp.block_starts.size(); ++block)
+    {
+      uint32_t pos = mp.block_starts[block];
+      if (pos >= right)
+	return;
+      if (pos >= left)
+	out.push_back(pos);
+
+      size_t in_block = min((size_t)motif_block_size,
+			    (size_t)mp.count - block * motif_block_size);
+      const uint8_t* g = mp.gaps.empty() ? NULL : &mp.gaps[0] + mp.block_offsets[block];
+      for (size_t i = 1; i < in_block; ++i)
+	{
+	  uint32_t gap = 0;
+	  int shift = 0;
+	  uint8_t b;
+	  do
+	    {
+	      b = *g++;
+	      gap |= (uint32_t)(b & 0x7F) << shift;
+	      shift += 7;
+	    } while (b & 0x80);
+	  pos += gap;
+	  if (pos >= right)
+	    return;
+	  if (pos >= left)
+	    out.push_back(pos);
+	}
+    }
+}
+
+template <class T>
+static bool write_vec(FILE* f, const vector<T>& v)
+{
+  uint32_t n = v.size();
+  if (fwrite(&n, sizeof(n), 1, f) != 1)
+    return false;
+  return n == 0 || fwrite(&v[0], sizeof(T), n, f) == n;
+}
+
+template <class T>
+static bool read_vec(FILE* f, vector<T>& v)
+{
+  uint32_t n = 0;
+  if (fread(&n, sizeof(n), 1, f) != 1)
+    return false;
+  v.resize(n);
+  return n == 0 || fread(&v[0], sizeof(T), n, f) == n;
+}
+
+bool SpliceMotifIndex::save(const string& fname) const
+{
+  // Write to a temporary name of this process and rename, so concurrent
+  // runs never see (or clobber) a partially written index.
+  char tmp_fname[4096];
+  snprintf(tmp_fname, sizeof(tmp_fname), "%s.%d", fname.c_str(), (int)getpid());
+  FILE* f = fopen(tmp_fname, "wb");
+  if (!f)
+    return false;
+
+  bool ok = fwrite(motif_index_magic, 1, sizeof(motif_index_magic), f) == sizeof(motif_index_magic) &&
+    fwrite(&_fasta_size, sizeof(_fasta_size), 1, f) == 1 &&
+    fwrite(&_fasta_mtime, sizeof(_fasta_mtime), 1, f) == 1;
+  uint32_t num_refs = _refs.size();
+  ok = ok && fwrite(&num_refs, sizeof(num_refs), 1, f) == 1;
+  for (map<uint32_t, RefMotifs>::const_iterator itr = _refs.begin();
+       ok && itr != _refs.end(); ++itr)
+    {
+      const RefMotifs& ref = itr->second;
+      uint32_t name_len = ref.name.length();
+      ok = fwrite(&name_len, sizeof(name_len), 1, f) == 1 &&
+	fwrite(ref.name.c_str(), 1, name_len, f) == name_len &&
+	fwrite(&ref.len, sizeof(ref.len), 1, f) == 1;
+      for (int m = 0; ok && m < NUM_SPLICE_MOTIFS; ++m)
+	{
+	  const MotifPositions& mp = ref.motifs[m];
+	  ok = fwrite(&mp.count, sizeof(mp.count), 1, f) == 1 &&
+	    write_vec(f, mp.block_starts) &&
+	    write_vec(f, mp.block_offsets) &&
+	    write_vec(f, mp.gaps);
+	}
+    }
+
+  if (fclose(f) != 0)
+    ok = false;
+  if (!ok || rename(tmp_fname, fname.c_str()) != 0)
+    {
+      remove(tmp_fname);
+      return false;
+    }
+  return true;
+}
+
+bool SpliceMotifIndex::load(const string& fname)
+{
+  FILE* f = fopen(fname.c_str(), "rb");
+  if (!f)
+    return false;
+
+  clear();
+  char magic[sizeof(motif_index_magic)];
+  uint32_t num_refs = 0;
+  bool ok = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+    memcmp(magic, motif_index_magic, sizeof(magic)) == 0 &&
+    fread(&_fasta_size, sizeof(_fasta_size), 1, f) == 1 &&
+    fread(&_fasta_mtime, sizeof(_fasta_mtime), 1, f) == 1 &&
+    fread(&num_refs, sizeof(num_refs), 1, f) == 1;
+  for (uint32_t r = 0; ok && r < num_refs; ++r)
+    {
+      uint32_t name_len = 0;
+      ok = fread(&name_len, sizeof(name_len), 1, f) == 1;
+      if (!ok)
+	break;
+      vector<char> name(name_len + 1, 0);
+      RefMotifs ref;
+      ok = fread(&name[0], 1, name_len, f) == name_len &&
+	fread(&ref.len, sizeof(ref.len), 1, f) == 1;
+      ref.name = &name[0];
+      for (int m = 0; ok && m < NUM_SPLICE_MOTIFS; ++m)
+	{
+	  MotifPositions& mp = ref.motifs[m];
+	  ok = fread(&mp.count, sizeof(mp.count), 1, f) == 1 &&
+	    read_vec(f, mp.block_starts) &&
+	    read_vec(f, mp.block_offsets) &&
+	    read_vec(f, mp.gaps);
+	}
+      if (ok)
+	_refs[RefSequenceTable::hash_string(ref.name.c_str())] = ref;
+    }
+  fclose(f);
+
+  if (!ok)
+    clear();
+  _dirty = false;
+  return ok;
+}
+
+void load_splice_motif_index(SpliceMotifIndex& index,
+			     const string& ref_fasta,
+			     const RefSequenceTable& rt)
+{
+  string fname = splice_motif_index_name(ref_fasta);
+  index.load(fname);
+
+  // Same-length sequences may still have been edited, so the index is
+  // only reused for the very FASTA file it was built from
+  struct stat st;
+  uint64_t fasta_size = 0;
+  int64_t fasta_mtime = 0;
+  if (stat(ref_fasta.c_str(), &st) == 0)
+    {
+      fasta_size = st.st_size;
+      fasta_mtime = st.st_mtime;
+    }
+  if (!index.same_source(fasta_size, fasta_mtime))
+    index.clear();
+  index.set_source(fasta_size, fasta_mtime);
+
+  for (RefSequenceTable::const_iterator itr = rt.begin(); itr != rt.end(); ++itr)
+    {
+      const RefSequenceTable::SequenceInfo& info = itr->second;
+      if (!info.seq || !info.name)
+	continue;
+      if (!index.has_ref(itr->first, seqan::length(*info.seq)))
+	index.add_ref(itr->first, info.name, *info.seq);
+    }
+
+  if (index.dirty())
+    {
+      if (!index.save(fname))
+	fprintf(stderr, "Warning: could not save splice motif index %s\n", fname.c_str());
+    }
+}
@@ -0,0 +1,125 @@
+#ifndef SPLICE_MOTIFS_H
+#define SPLICE_MOTIFS_H
+/*
+ *  splice_motifs.h
+ *  TopHat
+ *
+ *  A per-genome index of the positions of splice-site dinucleotides, so the
+ *  junction searchers can do range queries instead of rescanning the
+ *  reference for "GT"/"AG" (and their reverse complements) every time.
+ *
+ */
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "bwt_map.h"
+
+using namespace std;
+
+enum eSPLICE_MOTIF
+  {
+    MOTIF_GT = 0,
+    MOTIF_AG,
+    MOTIF_CT,
+    MOTIF_AC,
+    MOTIF_GC,
+    MOTIF_AT,
+
+    NUM_SPLICE_MOTIFS
+  };
+
+// Returns the eSPLICE_MOTIF for a two character motif such as "GT",
+// or -1 if the motif isn't indexed.
+int splice_motif_id(const string& dinuc);
+
+/*
+ * Sorted positions (0-based, of the first base) of each motif in each
+ * reference sequence.  Positions are stored as LEB128-encoded gaps in
+ * blocks of motif_block_size entries, with the absolute position and byte
+ * offset of each block kept alongside so a range query only has to decode
+ * from the enclosing block.  The on-disk format is the same arrays, so
+ * loading is a straight read.
+ */
+class SpliceMotifIndex
+{
+public:
+  static const size_t motif_block_size = 64;
+
+  SpliceMotifIndex() : _fasta_size(0), _fasta_mtime(0), _dirty(false) {}
+
+  // Scans seq and (re)builds the positions of every motif for ref_id.
+  void add_ref(uint32_t ref_id,
+	       const string& name,
+	       const RefSequenceTable::Sequence& seq);
+
+  // True if the index has ref_id, built from a sequence of length len.
+  bool has_ref(uint32_t ref_id, uint32_t len) const;
+
+  // Size and modification time of the FASTA file the index was built
+  // from; an index of a different file must be rebuilt from scratch.
+  void set_source(uint64_t fasta_size, int64_t fasta_mtime);
+  bool same_source(uint64_t fasta_size, int64_t fasta_mtime) const
+  {
+    return _fasta_size == fasta_size && _fasta_mtime == fasta_mtime;
+  }
+  bool has_ref(uint32_t ref_id) const
+  {
+    return _refs.find(ref_id) != _refs.end();
+  }
+
+  // Appends the positions of motif in [left, right) on ref_id to out.
+  void find(uint32_t ref_id,
+	    int motif,
+	    uint32_t left,
+	    uint32_t right,
+	    vector<uint32_t>& out) const;
+
+  bool load(const string& fname);
+  bool save(const string& fname) const;
+  bool dirty() const { return _dirty; }
+
+  void clear() { _refs.clear(); _fasta_size = 0; _fasta_mtime = 0; _dirty = false; }
+
+private:
+  struct MotifPositions
+  {
+    MotifPositions() : count(0) {}
+    uint32_t count;
+    vector<uint32_t> block_starts;   // absolute position of each block's first entry
+    vector<uint32_t> block_offsets;  // offset in gaps of each block's second entry
+    vector<uint8_t> gaps;
+
+    void push_back(uint32_t pos, uint32_t& prev);
+  };
+
+  struct RefMotifs
+  {
+    RefMotifs() : len(0) {}
+    string name;
+    uint32_t len;
+    MotifPositions motifs[NUM_SPLICE_MOTIFS];
+  };
+
+  map<uint32_t, RefMotifs> _refs;
+  uint64_t _fasta_size;
+  int64_t _fasta_mtime;
+  bool _dirty;
+};
+
+/*
+ * Loads the motif index saved next to the reference FASTA file
+ * (ref_fasta + ".motifs"), builds entries for any sequence in rt that is
+ * missing or stale, and saves the index back if anything was rebuilt.
+ * The whole index is stale if ref_fasta has changed size or mtime.
+ * Failing to save is not an error, the index is simply rebuilt next time.
+ */
+void load_splice_motif_index(SpliceMotifIndex& index,
+			     const string& ref_fasta,
+			     const RefSequenceTable& rt);
+
+string splice_motif_index_name(const string& ref_fasta);
+
+#endif
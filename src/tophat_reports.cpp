@@ -33,6 +33,7 @@
 #include "common.h"
 #include "bwt_map.h"
 #include "junctions.h"
+#include "junction_store.h"
 #include "insertions.h"
 #include "deletions.h"
 #include "align_status.h"
@@ -47,16 +48,45 @@ using namespace std;
 using namespace seqan;
 using std::set;
 
+// Reference sequences for --qual-scoring, NULL when it is off
+static RefSequenceTable* qual_ref_seqs = NULL;
+
+// Reads the next group of hits from hs, scoring them for --qual-scoring
+void next_read_hits(HitStream& hs, HitsForRead& hit_group)
+{
+  hs.next_read_hits(hit_group);
+  if (qual_ref_seqs)
+    score_hit_quals(hit_group, *qual_ref_seqs);
+}
+
+// Like next_read_hits, but skips the groups before --read-ids and ends the
+// stream (insert_id 0) after it
+void next_range_hits(HitStream& hs, HitsForRead& hit_group)
+{
+  do
+    next_read_hits(hs, hit_group);
+  while (hit_group.insert_id != 0 && hit_group.insert_id < read_id_first);
+  if (hit_group.insert_id > read_id_last)
+    {
+      hit_group.insert_id = 0;
+      hit_group.hits.clear();
+    }
+}
+
+// batch is the scratch HitBatch of the hits' stream, refilled for each
+// hit group
 void read_best_alignments(const HitsForRead& hits_for_read,
+			      HitBatch& batch,
 			      FragmentAlignmentGrade& best_grade,
 			      HitsForRead& best_hits,
 			      const JunctionSet& gtf_junctions)
 {
   const vector<BowtieHit>& hits = hits_for_read.hits;
+  batch.assign(hits_for_read, &gtf_junctions);
   for (size_t i = 0; i < hits.size(); ++i)
     {
-      if (hits[i].edit_dist()>max_read_mismatches) continue;
-      FragmentAlignmentGrade g(hits[i], gtf_junctions);
+      if (batch.edit_dists[i]>max_read_mismatches) continue;
+      FragmentAlignmentGrade g(batch, i);
       // Is the new status better than the current best one?
       if (best_grade < g)
       {
@@ -74,6 +104,8 @@ void read_best_alignments(const HitsForRead& hits_for_read,
 
 void pair_best_alignments(const HitsForRead& left_hits,
                             const HitsForRead& right_hits,
+                            HitBatch& left_batch,
+                            HitBatch& right_batch,
                             InsertAlignmentGrade& best_grade,
                             HitsForRead& left_best_hits,
                             HitsForRead& right_best_hits)
@@ -88,19 +120,23 @@ void pair_best_alignments(const HitsForRead& left_hits,
     const vector<BowtieHit>& left = left_hits.hits;
     const vector<BowtieHit>& right = right_hits.hits;
     
+    left_batch.assign(left_hits);
+    right_batch.assign(right_hits);
+    
     for (size_t i = 0; i < left.size(); ++i)
 	{
-        if (left[i].edit_dist()>max_read_mismatches) continue;
+        if (left_batch.edit_dists[i]>max_read_mismatches) continue;
 
         const BowtieHit& lh = left[i];
         for (size_t j = 0; j < right.size(); ++j)
 		{
             const BowtieHit& rh = right[j];
             
-            if (lh.ref_id() != rh.ref_id())
+            if (left_batch.ref_ids[i] != right_batch.ref_ids[j])
                 continue;
-            if (right[j].edit_dist()>max_read_mismatches) continue;
-            InsertAlignmentGrade g(lh, rh, min_mate_inner_dist, max_mate_inner_dist);
+            if (right_batch.edit_dists[j]>max_read_mismatches) continue;
+            InsertAlignmentGrade g(left_batch, i, right_batch, j, 
+                                   min_mate_inner_dist, max_mate_inner_dist);
             
             // Is the new status better than the current best one?
             if (best_grade < g)
@@ -613,9 +649,11 @@ void get_junctions_from_best_hits(HitStream& left_hs,
 {
 	HitsForRead curr_left_hit_group;
 	HitsForRead curr_right_hit_group;
+	HitBatch left_batch;
+	HitBatch right_batch;
     
-	left_hs.next_read_hits(curr_left_hit_group);
-	right_hs.next_read_hits(curr_right_hit_group);
+	next_read_hits(left_hs, curr_left_hit_group);
+	next_read_hits(right_hs, curr_right_hit_group);
     
 	uint32_t curr_left_obs_order = it.observation_order(curr_left_hit_group.insert_id);
 	uint32_t curr_right_obs_order = it.observation_order(curr_right_hit_group.insert_id);
@@ -633,11 +671,11 @@ void get_junctions_from_best_hits(HitStream& left_hs,
 			FragmentAlignmentGrade grade;
             
 			// Process hits for left singleton, select best alignments
-			read_best_alignments(curr_left_hit_group, grade, best_hits, gtf_junctions);
+			read_best_alignments(curr_left_hit_group, left_batch, grade, best_hits, gtf_junctions);
 			update_junctions(best_hits, junctions);
             
 			// Get next hit group
-			left_hs.next_read_hits(curr_left_hit_group);
+			next_read_hits(left_hs, curr_left_hit_group);
 			curr_left_obs_order = it.observation_order(curr_left_hit_group.insert_id);
 		}
         
@@ -650,11 +688,11 @@ void get_junctions_from_best_hits(HitStream& left_hs,
 			FragmentAlignmentGrade grade;
             
 			// Process hit for right singleton, select best alignments
-			read_best_alignments(curr_right_hit_group,grade, best_hits, gtf_junctions);
+			read_best_alignments(curr_right_hit_group, right_batch, grade, best_hits, gtf_junctions);
 			update_junctions(best_hits, junctions);
             
 			// Get next hit group
-			right_hs.next_read_hits(curr_right_hit_group);
+			next_read_hits(right_hs, curr_right_hit_group);
 			curr_right_obs_order = it.observation_order(curr_right_hit_group.insert_id);
 		}
         
@@ -669,7 +707,7 @@ void get_junctions_from_best_hits(HitStream& left_hs,
 				right_best_hits.insert_id = curr_right_obs_order;
                 
 				FragmentAlignmentGrade grade;
-				read_best_alignments(curr_right_hit_group, grade, right_best_hits, gtf_junctions);
+				read_best_alignments(curr_right_hit_group, right_batch, grade, right_best_hits, gtf_junctions);
 				update_junctions(right_best_hits, junctions);
 			}
 			else if (curr_right_hit_group.hits.empty())
@@ -679,7 +717,7 @@ void get_junctions_from_best_hits(HitStream& left_hs,
                 
 				FragmentAlignmentGrade grade;
 				// Process hits for left singleton, select best alignments
-				read_best_alignments(curr_left_hit_group, grade, left_best_hits, gtf_junctions);
+				read_best_alignments(curr_left_hit_group, left_batch, grade, left_best_hits, gtf_junctions);
 				update_junctions(left_best_hits, junctions);
 			}
 			else
@@ -694,6 +732,8 @@ void get_junctions_from_best_hits(HitStream& left_hs,
 				InsertAlignmentGrade grade;
 				pair_best_alignments(curr_left_hit_group,
                                        curr_right_hit_group,
+                                       left_batch,
+                                       right_batch,
                                        grade,
                                        left_best_hits,
                                        right_best_hits);
@@ -702,10 +742,10 @@ void get_junctions_from_best_hits(HitStream& left_hs,
 				update_junctions(right_best_hits, junctions);
 			}
             
-			left_hs.next_read_hits(curr_left_hit_group);
+			next_read_hits(left_hs, curr_left_hit_group);
 			curr_left_obs_order = it.observation_order(curr_left_hit_group.insert_id);
             
-			right_hs.next_read_hits(curr_right_hit_group);
+			next_read_hits(right_hs, curr_right_hit_group);
 			curr_right_obs_order = it.observation_order(curr_right_hit_group.insert_id);
 		}
 	}
@@ -714,22 +754,43 @@ void get_junctions_from_best_hits(HitStream& left_hs,
 }
 
 
-void driver(GBamWriter& bam_writer,
-	    string& left_map_fname,
-	    FLineReader& left_reads,
-	    string& right_map_fname,
-	    FLineReader& right_reads,
-	    FILE* junctions_out,
-	    FILE* insertions_out,
-	    FILE* deletions_out,
-	    FILE* left_um_out,
-	    FILE* right_um_out
-	    )
+// Drops the junctions that no accepted alignment spans with 8bp on each side
+void filter_final_junctions(JunctionSet& final_junctions)
+{
+	//small_overhangs = 0;
+	for (JunctionSet::iterator i = final_junctions.begin(); i != final_junctions.end();)
+	  {
+	    if (i->second.supporting_hits == 0 || i->second.left_extent < 8 ||	i->second.right_extent < 8)
+	      {
+		final_junctions.erase(i++);
+	      }
+	    else
+	      {
+		++i;
+	      }
+	  }
+}
+
+// Loads the reference sequences for --qual-scoring into ref_seqs; returns
+// whether the hit streams must keep the read qualities for the scoring
+bool load_qual_ref_seqs(RefSequenceTable& ref_seqs)
+{
+  if (qual_scoring == QUAL_SCORING_NONE)
+    return false;
+  if (reference_fasta.empty())
+    err_die("Error: --qual-scoring requires --reference-fasta\n");
+  ifstream ref_stream(reference_fasta.c_str());
+  if (!ref_stream.good())
+    err_die("Error: cannot open %s for reading\n", reference_fasta.c_str());
+  get_seqs(ref_stream, ref_seqs);
+  qual_ref_seqs = &ref_seqs;
+  fprintf(stderr, "Loaded reference sequences for quality scoring from %s\n", reference_fasta.c_str());
+  return true;
+}
+
+// Loads the --gtf-juncs junctions, which are always accepted
+void load_gtf_junctions(RefSequenceTable& rt, JunctionSet& gtf_junctions)
 {
-  ReadTable it;
-  RefSequenceTable rt(sam_header, true);
-    srandom(1);
-  JunctionSet gtf_junctions;
   if (!gtf_juncs.empty())
     {
       char splice_buf[2048];
@@ -765,33 +826,67 @@ void driver(GBamWriter& bam_writer,
         }
       fprintf(stderr, "Loaded %d GFF junctions from %s.\n", (int)(gtf_junctions.size()), gtf_juncs.c_str());
     }
+}
+
+void driver(GBamWriter& bam_writer,
+	    string& left_map_fname,
+	    FLineReader& left_reads,
+	    string& right_map_fname,
+	    FLineReader& right_reads,
+	    FILE* junctions_out,
+	    FILE* insertions_out,
+	    FILE* deletions_out,
+	    FILE* left_um_out,
+	    FILE* right_um_out
+	    )
+{
+  ReadTable it;
+  RefSequenceTable rt(sam_header, true);
+  // Hits are looked up here by the ids of rt, both being name hashes
+  RefSequenceTable ref_seqs(true, true);
+  bool keep_quals = load_qual_ref_seqs(ref_seqs);
+  srandom(1);
+  JunctionSet gtf_junctions;
+  load_gtf_junctions(rt, gtf_junctions);
 
   BAMHitFactory hit_factory(it,rt);
 	JunctionSet junctions;
+	if (!accepted_juncs.empty())
 	{
-	  HitStream l_hs(left_map_fname, &hit_factory, false, true, true, true);
-	  HitStream r_hs(right_map_fname, &hit_factory, false, true, true, true);
-	  get_junctions_from_best_hits(l_hs, r_hs, it, junctions, gtf_junctions);
-	  //this resets the streams
-	 }
-
-	HitStream left_hs(left_map_fname, &hit_factory, false, true, true, true);
-	HitStream right_hs(right_map_fname, &hit_factory, false, true, true, true);
-    
-	size_t num_unfiltered_juncs = junctions.size();
-	fprintf(stderr, "Loaded %lu junctions\n", (long unsigned int) num_unfiltered_juncs);
+	  // filtered over all reads by an earlier --filter-juncs-only run
+	  if (!read_junction_store(accepted_juncs, junctions))
+	    err_die("Error: %s is not a junction store\n", accepted_juncs.c_str());
+	  fprintf(stderr, "Loaded %lu filtered junctions\n", (long unsigned int)junctions.size());
+	}
+	else
+	{
+	  {
+	    HitStream l_hs(left_map_fname, &hit_factory, false, true, true, true, keep_quals);
+	    HitStream r_hs(right_map_fname, &hit_factory, false, true, true, true, keep_quals);
+	    get_junctions_from_best_hits(l_hs, r_hs, it, junctions, gtf_junctions);
+	    //this resets the streams
+	  }
+	  size_t num_unfiltered_juncs = junctions.size();
+	  fprintf(stderr, "Loaded %lu junctions\n", (long unsigned int) num_unfiltered_juncs);
+
+	  // Read hits, extract junctions, and toss the ones that arent strongly enough supported.
+	  filter_junctions(junctions, gtf_junctions);
+	}
+
+	HitStream left_hs(left_map_fname, &hit_factory, false, true, true, true, keep_quals);
+	HitStream right_hs(right_map_fname, &hit_factory, false, true, true, true, keep_quals);
     
 	HitsForRead curr_left_hit_group;
 	HitsForRead curr_right_hit_group;
+	HitBatch left_batch;
+	HitBatch right_batch;
 
-	left_hs.next_read_hits(curr_left_hit_group);
-	right_hs.next_read_hits(curr_right_hit_group);
+	next_range_hits(left_hs, curr_left_hit_group);
+	next_range_hits(right_hs, curr_right_hit_group);
 
 	uint32_t curr_left_obs_order = it.observation_order(curr_left_hit_group.insert_id);
 	uint32_t curr_right_obs_order = it.observation_order(curr_right_hit_group.insert_id);
 
-	// Read hits, extract junctions, and toss the ones that arent strongly enough supported.
-	filter_junctions(junctions, gtf_junctions);
 	//size_t num_juncs_after_filter = junctions.size();
 	//fprintf(stderr, "Filtered %lu junctions\n",
 	//     num_unfiltered_juncs - num_juncs_after_filter);
@@ -818,6 +913,13 @@ void driver(GBamWriter& bam_writer,
 	// While we still have unreported hits...
   Read l_read;
   Read r_read;
+  if (read_id_first > 1)
+    {
+      // the reads before the range are reported by another run
+      get_read_from_stream(read_id_first - 1, left_reads, reads_format, false, l_read, NULL);
+      if (right_reads.fhandle())
+        get_read_from_stream(read_id_first - 1, right_reads, reads_format, false, r_read, NULL);
+    }
 	while(curr_left_obs_order != VMAXINT32 ||
 	      curr_right_obs_order != VMAXINT32)
     {
@@ -842,7 +944,7 @@ void driver(GBamWriter& bam_writer,
             exclude_hits_on_filtered_junctions(junctions, curr_left_hit_group);
             
             // Process hits for left singleton, select best alignments
-            read_best_alignments(curr_left_hit_group, grade, best_hits, gtf_junctions);
+            read_best_alignments(curr_left_hit_group, left_batch, grade, best_hits, gtf_junctions);
             if (best_hits.hits.size()>0 && best_hits.hits.size() <= max_multihits)
             {
                 update_junctions(best_hits, final_junctions);
@@ -858,7 +960,7 @@ void driver(GBamWriter& bam_writer,
             }
             
             // Get next hit group
-            left_hs.next_read_hits(curr_left_hit_group);
+            next_range_hits(left_hs, curr_left_hit_group);
             curr_left_obs_order = it.observation_order(curr_left_hit_group.insert_id);
         } //left singletons 
         
@@ -883,7 +985,7 @@ void driver(GBamWriter& bam_writer,
             exclude_hits_on_filtered_junctions(junctions, curr_right_hit_group);
             
             // Process hit for right singleton, select best alignments
-            read_best_alignments(curr_right_hit_group, grade, best_hits, gtf_junctions);
+            read_best_alignments(curr_right_hit_group, right_batch, grade, best_hits, gtf_junctions);
             
             if (best_hits.hits.size()>0 && best_hits.hits.size() <= max_multihits)
             {
@@ -900,7 +1002,7 @@ void driver(GBamWriter& bam_writer,
             }
             
             // Get next hit group
-            right_hs.next_read_hits(curr_right_hit_group);
+            next_range_hits(right_hs, curr_right_hit_group);
             curr_right_obs_order = it.observation_order(curr_right_hit_group.insert_id);
         }
         
@@ -925,7 +1027,7 @@ void driver(GBamWriter& bam_writer,
                 right_best_hits.insert_id = curr_right_obs_order;
                 
                 FragmentAlignmentGrade grade;
-                read_best_alignments(curr_right_hit_group, grade, right_best_hits, gtf_junctions);
+                read_best_alignments(curr_right_hit_group, right_batch, grade, right_best_hits, gtf_junctions);
                 
                 if (right_best_hits.hits.size()>0 && right_best_hits.hits.size() <= max_multihits)
                 {
@@ -953,7 +1055,7 @@ void driver(GBamWriter& bam_writer,
                                   l_read.seq.c_str(), l_read.qual.c_str());
                 FragmentAlignmentGrade grade;
                 // Process hits for left singleton, select best alignments
-                read_best_alignments(curr_left_hit_group, grade, left_best_hits, gtf_junctions);
+                read_best_alignments(curr_left_hit_group, left_batch, grade, left_best_hits, gtf_junctions);
                 
                 if (left_best_hits.hits.size()>0 && left_best_hits.hits.size() <= max_multihits)
                 {
@@ -979,6 +1081,8 @@ void driver(GBamWriter& bam_writer,
                 InsertAlignmentGrade grade;
                 pair_best_alignments(curr_left_hit_group,
                                        curr_right_hit_group,
+                                       left_batch,
+                                       right_batch,
                                        grade,
                                        left_best_hits,
                                        right_best_hits);
@@ -1003,23 +1107,25 @@ void driver(GBamWriter& bam_writer,
                 }
             }
             
-            left_hs.next_read_hits(curr_left_hit_group);
+            next_range_hits(left_hs, curr_left_hit_group);
             curr_left_obs_order = it.observation_order(curr_left_hit_group.insert_id);
             
-            right_hs.next_read_hits(curr_right_hit_group);
+            next_range_hits(right_hs, curr_right_hit_group);
             curr_right_obs_order = it.observation_order(curr_right_hit_group.insert_id);
         }
         
     } //while we still have unreported hits..
   //print the remaining unmapped reads at the end of each reads' stream
-	get_read_from_stream(VMAXINT32,
+  //(or of the --read-ids range)
+  uint32_t reads_end = read_id_last == VMAXINT32 ? VMAXINT32 : read_id_last + 1;
+	get_read_from_stream(reads_end,
                          left_reads,
                          reads_format,
                          false,
                          l_read,
                          left_um_out);
 	if (right_reads.fhandle())
-	  get_read_from_stream(VMAXINT32,
+	  get_read_from_stream(reads_end,
 	                         right_reads,
 	                         reads_format,
 	                         false,
@@ -1027,18 +1133,10 @@ void driver(GBamWriter& bam_writer,
 	                         right_um_out);
 	fprintf (stderr, "done.\n");
     
-	//small_overhangs = 0;
-	for (JunctionSet::iterator i = final_junctions.begin(); i != final_junctions.end();)
-	  {
-	    if (i->second.supporting_hits == 0 || i->second.left_extent < 8 ||	i->second.right_extent < 8)
-	      {
-		final_junctions.erase(i++);
-	      }
-	    else
-	      {
-		++i;
-	      }
-	  }
+	// Over a --read-ids range the support and extents of a junction are
+	// only partial, so it is left to --merge-chunks to filter them
+	if (read_id_first == 0 && read_id_last == VMAXINT32)
+	  filter_final_junctions(final_junctions);
 
 //	if (small_overhangs > 0)
 //		fprintf(stderr, "Warning: %lu small overhang junctions!\n", small_overhangs);
@@ -1046,6 +1144,14 @@ void driver(GBamWriter& bam_writer,
 	fprintf (stderr, "Printing junction BED track...");
 	print_junctions(junctions_out, final_junctions, rt);
 	fprintf (stderr, "done\n");
+
+	if (!junction_store.empty())
+	  {
+	    fprintf (stderr, "Writing junction store...");
+	    if (!write_junction_store(junction_store, final_junctions, rt))
+	      err_die("Error: could not write junction store %s\n", junction_store.c_str());
+	    fprintf (stderr, "done\n");
+	  }
     
 	fprintf (stderr, "Printing insertions...");
 	print_insertions(insertions_out, final_insertions,rt);
@@ -1060,9 +1166,118 @@ void driver(GBamWriter& bam_writer,
 	fprintf(stderr, "Found %lu junctions from happy spliced reads\n", (long unsigned int)final_junctions.size());
 }
 
+/*
+ * --filter-juncs-only: the junction pass of driver() over all reads; the
+ * filtered junctions go to the --accepted-juncs store, from which the runs
+ * over read ID ranges pick them up.
+ */
+void filter_driver(string& left_map_fname, string& right_map_fname)
+{
+  ReadTable it;
+  RefSequenceTable rt(sam_header, true);
+  RefSequenceTable ref_seqs(true, true);
+  bool keep_quals = load_qual_ref_seqs(ref_seqs);
+  srandom(1);
+  JunctionSet gtf_junctions;
+  load_gtf_junctions(rt, gtf_junctions);
+
+  BAMHitFactory hit_factory(it,rt);
+  JunctionSet junctions;
+  HitStream l_hs(left_map_fname, &hit_factory, false, true, true, true, keep_quals);
+  HitStream r_hs(right_map_fname, &hit_factory, false, true, true, true, keep_quals);
+  get_junctions_from_best_hits(l_hs, r_hs, it, junctions, gtf_junctions);
+  fprintf(stderr, "Loaded %lu junctions\n", (long unsigned int)junctions.size());
+
+  filter_junctions(junctions, gtf_junctions);
+  if (!write_junction_store(accepted_juncs, junctions, rt))
+    err_die("Error: could not write junction store %s\n", accepted_juncs.c_str());
+}
+
+// Reads an insertions or deletions track back, adding up the read counts
+// of the entries several tracks have in common
+template <class TIndelSet, class TIndel>
+void read_indel_counts(const string& fname,
+		       RefSequenceTable& rt,
+		       TIndelSet& indels,
+		       TIndel (*make_indel)(uint32_t, char*, char*, char*))
+{
+  FILE* f = fopen(fname.c_str(), "r");
+  if (f == NULL)
+    err_die("Error: cannot open %s for reading\n", fname.c_str());
+  char buf[2048];
+  while (fgets(buf, sizeof(buf), f))
+    {
+      if (strncmp(buf, "track ", 6) == 0)
+	continue;
+      char* nl = strrchr(buf, '\n');
+      if (nl) *nl = 0;
+      char* line = buf;
+      char* ref_name = get_token(&line, "\t");
+      char* left = get_token(&line, "\t");
+      char* right = get_token(&line, "\t");
+      char* seq = get_token(&line, "\t");
+      char* count = get_token(&line, "\t");
+      if (!ref_name || !left || !right || !seq || !count)
+	err_die("Error: malformed record in %s\n", fname.c_str());
+      uint32_t ref_id = rt.get_id(ref_name, NULL, 0);
+      indels[make_indel(ref_id, left, right, seq)] += atoi(count);
+    }
+  fclose(f);
+}
+
+Insertion make_insertion(uint32_t ref_id, char* left, char* right, char* seq)
+{
+  return Insertion(ref_id, atoi(left), seq);
+}
+
+Deletion make_deletion(uint32_t ref_id, char* left, char* right, char* seq)
+{
+  // print_deletions() writes 1-based left coordinates
+  return Deletion(ref_id, atoi(left) - 1, atoi(right), false);
+}
+
+/*
+ * --merge-chunks: combines the junction stores, insertions and deletions of
+ * the runs over read ID ranges into the tracks a single run would print,
+ * filtering the junctions by their merged support.
+ */
+void merge_chunk_reports(const vector<string>& juncs_fnames,
+			 const vector<string>& insertions_fnames,
+			 const vector<string>& deletions_fnames,
+			 FILE* junctions_out,
+			 FILE* insertions_out,
+			 FILE* deletions_out)
+{
+  RefSequenceTable rt(sam_header, true);
+
+  JunctionSet final_junctions;
+  for (size_t i = 0; i < juncs_fnames.size(); ++i)
+    {
+      if (!read_junction_store(juncs_fnames[i], final_junctions))
+	err_die("Error: %s is not a junction store\n", juncs_fnames[i].c_str());
+    }
+  filter_final_junctions(final_junctions);
+
+  InsertionSet final_insertions;
+  for (size_t i = 0; i < insertions_fnames.size(); ++i)
+    read_indel_counts(insertions_fnames[i], rt, final_insertions, make_insertion);
+  DeletionSet final_deletions;
+  for (size_t i = 0; i < deletions_fnames.size(); ++i)
+    read_indel_counts(deletions_fnames[i], rt, final_deletions, make_deletion);
+
+  print_junctions(junctions_out, final_junctions, rt);
+  if (!junction_store.empty() &&
+      !write_junction_store(junction_store, final_junctions, rt))
+    err_die("Error: could not write junction store %s\n", junction_store.c_str());
+  print_insertions(insertions_out, final_insertions, rt);
+  print_deletions(deletions_out, final_deletions, rt);
+  fprintf(stderr, "Found %lu junctions from happy spliced reads\n", (long unsigned int)final_junctions.size());
+}
+
 void print_usage()
 {
 	fprintf(stderr, "Usage:   tophat_reports <junctions.bed> <insertions.vcf> <deletions.vcf> <accepted_hits.sam> <left_map1,...,left_mapN> <left_reads.fq>  [right_map1,...,right_mapN] [right_reads.fq]\n");
+	fprintf(stderr, "         tophat_reports --merge-chunks <junctions.bed> <insertions.vcf> <deletions.vcf> <juncs1.jstore,...> <insertions1.vcf,...> <deletions1.vcf,...>\n");
     
 	//	fprintf(stderr, "Usage:   tophat_reports <coverage.wig> <junctions.bed> <accepted_hits.sam> <map1.bwtout> [splice_map1.sbwtout]\n");
 }
@@ -1105,6 +1320,30 @@ int main(int argc, char** argv)
         print_usage();
         return 1;
 	}
+
+    if (merge_chunks)
+    {
+        if (optind + 3 > argc)
+        {
+            print_usage();
+            return 1;
+        }
+        vector<string> juncs_fnames, insertions_fnames, deletions_fnames;
+        tokenize(argv[optind++], ",", juncs_fnames);
+        tokenize(argv[optind++], ",", insertions_fnames);
+        tokenize(argv[optind++], ",", deletions_fnames);
+        FILE* junctions_file = fopen(junctions_file_name.c_str(), "w");
+        FILE* insertions_file = fopen(insertions_file_name.c_str(), "w");
+        FILE* deletions_file = fopen(deletions_file_name.c_str(), "w");
+        if (!junctions_file || !insertions_file || !deletions_file)
+            err_die("Error: cannot open the output tracks for writing\n");
+        merge_chunk_reports(juncs_fnames, insertions_fnames, deletions_fnames,
+                            junctions_file, insertions_file, deletions_file);
+        fclose(junctions_file);
+        fclose(insertions_file);
+        fclose(deletions_file);
+        return 0;
+    }
     
 	string accepted_hits_file_name = argv[optind++];
     
@@ -1121,6 +1360,17 @@ int main(int argc, char** argv)
         print_usage();
 		return 1;
 	}
+
+    if (filter_juncs_only)
+    {
+        if (accepted_juncs.empty())
+            err_die("Error: --filter-juncs-only requires --accepted-juncs\n");
+        string right_map_filename;
+        if (optind + 1 < argc)
+            right_map_filename = argv[optind + 1];
+        filter_driver(left_map_filename, right_map_filename);
+        return 0;
+    }
     //FZPipe left_map_file;
     //string unbamcmd=getBam2SamCmd(left_map_filename);
     //left_map_file.openRead(left_map_filename, unbamcmd);
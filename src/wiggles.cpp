@@ -14,6 +14,8 @@
 #include <stdio.h>
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <pthread.h>
 #include "wiggles.h"
 
 using namespace std;
@@ -54,66 +56,274 @@ void print_wiggle_for_ref(FILE* coverage_out,
 	}
 }
 
-void driver(FILE* map_file, FILE* coverage_file)
-{	
-    ReadTable it;
-    RefSequenceTable rt(true);
-	
-    SAMHitFactory hit_factory(it,rt);
-	
-	char bwt_buf[2048];
-	bwt_buf[0] = 0;
-	
-	uint32_t last_ref = 0;
-	
-	vector<unsigned int> DoC;
-	
-	print_wiggle_header(coverage_file);
-	
-	while (map_file && !feof(map_file))
+void CoverageDiffs::add_block(uint32_t left, uint32_t right)
+{
+	if (right + 1 > _diffs.size())
+		_diffs.resize(right + 1, 0);
+	_diffs[left]++;
+	_diffs[right]--;
+	if (right > _len)
+		_len = right;
+}
+
+bool CoverageDiffs::add_alignment(const bam1_t* b)
+{
+	if (b->core.tid < 0 || (b->core.flag & BAM_FUNMAP) || b->core.n_cigar == 0)
+		return false;
+
+	const uint32_t* cigar = bam1_cigar(b);
+	for (int c = 0; c < b->core.n_cigar; ++c)
 	{
-		fgets(bwt_buf, 2048, map_file);
-		// Chomp the newline
-		char* nl = strrchr(bwt_buf, '\n');
-		if (nl) *nl = 0;
-		
-		// Get a new record from the tab-delimited Bowtie map
-		BowtieHit bh;
-		
-		if (hit_factory.get_hit_from_buf(bwt_buf, bh, false))
+		if ((cigar[c] & BAM_CIGAR_MASK) == BAM_CREF_SKIP &&
+			(int)(cigar[c] >> BAM_CIGAR_SHIFT) > max_report_intron_length)
+			return false;
+	}
+
+	uint32_t j = b->core.pos;
+	for (int c = 0; c < b->core.n_cigar; ++c)
+	{
+		uint32_t len = cigar[c] >> BAM_CIGAR_SHIFT;
+		switch (cigar[c] & BAM_CIGAR_MASK)
 		{
-			if (bh.ref_id() != last_ref)
+			case BAM_CMATCH:
+				add_block(j, j + len);
+				j += len;
+				break;
+			case BAM_CREF_SKIP:
+			case BAM_CDEL:
+				j += len;
+				break;
+			default:
+				break;
+		}
+	}
+	if (j > _len)
+	{
+		// a trailing deletion or skip still counts towards the track
+		_len = j;
+		if (_diffs.size() < _len + 1)
+			_diffs.resize(_len + 1, 0);
+	}
+	return true;
+}
+
+static void append_wiggle_line(string& out,
+							   const string& ref_name,
+							   size_t left,
+							   size_t right,
+							   int depth)
+{
+	char buf[64];
+	int n = sprintf(buf, "\t%d\t%d\t%d\n", (int)left, (int)right, depth);
+	out += ref_name;
+	out.append(buf, n);
+}
+
+void CoverageDiffs::print(string& out, const string& ref_name) const
+{
+	int depth = 0;
+	int last_doc = 0; // Last DoC value we wrote
+	size_t last_pos = 0; // Postition where the last written DoC came from
+	for (size_t i = 0; i < _len; ++i)
+	{
+		depth += _diffs[i];
+		if (last_doc != depth)
+		{
+			size_t j = last_pos;
+			while (i - j > 10000000)
 			{
-				if (last_ref != 0)
-				{
-					// print wiggle
-					
-					string ref_name = rt.get_name(last_ref);
-					print_wiggle_for_ref(coverage_file,
-											  ref_name,
-										 DoC);
-				}
-				DoC.clear();
+				append_wiggle_line(out, ref_name, j, j + 10000000, last_doc);
+				j += 10000000;
 			}
-			
-			last_ref = bh.ref_id();
-			add_hit_to_coverage(bh, DoC);
+			if (i > 0)
+				append_wiggle_line(out, ref_name, j, i, last_doc);
+			last_pos = i;
+			last_doc = depth;
 		}
 	}
-	
-	if (last_ref != 0)
+	if (last_doc)
+		append_wiggle_line(out, ref_name, last_pos, _len - 1, last_doc);
+}
+
+// Reads the whole file in order, writing each reference as soon as the
+// next one starts.  Used for SAM and unindexed BAM files.
+void coverage_from_stream(samfile_t* map_file, FILE* coverage_file)
+{
+	bam_header_t* header = map_file->header;
+	bam1_t* b = bam_init1();
+	CoverageDiffs coverage;
+	int last_tid = -1;
+	string out;
+
+	while (samread(map_file, b) > 0)
+	{
+		if (b->core.tid < 0)
+			continue;
+		if (b->core.tid != last_tid)
+		{
+			if (last_tid >= 0)
+			{
+				out.clear();
+				coverage.print(out, header->target_name[last_tid]);
+				fwrite(out.data(), 1, out.size(), coverage_file);
+			}
+			coverage.reset();
+			last_tid = b->core.tid;
+		}
+		coverage.add_alignment(b);
+	}
+
+	if (last_tid >= 0)
 	{
-		string ref_name = rt.get_name(last_ref);
-		print_wiggle_for_ref(coverage_file,
-							 ref_name,
-							 DoC);
-		
+		out.clear();
+		coverage.print(out, header->target_name[last_tid]);
+		fwrite(out.data(), 1, out.size(), coverage_file);
 	}
+	bam_destroy1(b);
+}
+
+static int add_fetched_alignment(const bam1_t* b, void* coverage)
+{
+	((CoverageDiffs*)coverage)->add_alignment(b);
+	return 0;
+}
+
+/*
+ * Shared state for computing the references of an indexed BAM file in
+ * parallel.  Workers claim the next reference, fetch its alignments
+ * through the index with their own file handle, and leave the bedGraph
+ * text in its slot; whichever worker completes the next reference in
+ * order writes out every finished slot, so output is streamed in header
+ * order and only finished-but-unwritten references are held in memory.
+ */
+struct IndexedCoverage
+{
+	IndexedCoverage(const string& fname,
+					const bam_header_t* hdr,
+					const bam_index_t* index,
+					FILE* out_file) :
+		map_fname(fname), header(hdr), idx(index), coverage_file(out_file),
+		next_tid(0), next_to_write(0),
+		done(hdr->n_targets, false), outs(hdr->n_targets)
+	{
+		pthread_mutex_init(&lock, NULL);
+	}
+
+	~IndexedCoverage()
+	{
+		pthread_mutex_destroy(&lock);
+	}
+
+	string map_fname;
+	const bam_header_t* header;
+	const bam_index_t* idx;
+	FILE* coverage_file;
+
+	pthread_mutex_t lock;
+	int next_tid;
+	int next_to_write;
+	vector<bool> done;
+	vector<string> outs;
+};
+
+struct CoverageWorker
+{
+	CoverageWorker(IndexedCoverage* s) : shared(s) {}
+
+	void operator()()
+	{
+		bamFile fp = bam_open(shared->map_fname.c_str(), "r");
+		if (fp == NULL)
+			err_die("Error: cannot open BAM file %s for reading\n",
+					shared->map_fname.c_str());
+
+		const bam_header_t* header = shared->header;
+		CoverageDiffs coverage;
+		while (true)
+		{
+			pthread_mutex_lock(&shared->lock);
+			int tid = shared->next_tid++;
+			pthread_mutex_unlock(&shared->lock);
+			if (tid >= header->n_targets)
+				break;
+
+			string out;
+			coverage.reset();
+			bam_fetch(fp, shared->idx, tid, 0, header->target_len[tid],
+					  &coverage, add_fetched_alignment);
+			coverage.print(out, header->target_name[tid]);
+
+			pthread_mutex_lock(&shared->lock);
+			shared->outs[tid].swap(out);
+			shared->done[tid] = true;
+			while (shared->next_to_write < header->n_targets &&
+				   shared->done[shared->next_to_write])
+			{
+				string& o = shared->outs[shared->next_to_write];
+				fwrite(o.data(), 1, o.size(), shared->coverage_file);
+				string().swap(o);
+				++shared->next_to_write;
+			}
+			pthread_mutex_unlock(&shared->lock);
+		}
+		bam_close(fp);
+	}
+
+	IndexedCoverage* shared;
+};
+
+void coverage_from_index(const string& map_filename,
+						 const bam_header_t* header,
+						 const bam_index_t* idx,
+						 FILE* coverage_file)
+{
+	IndexedCoverage shared(map_filename, header, idx, coverage_file);
+	int num_workers = max(1, min(num_cpus, (int)header->n_targets));
+	vector<CoverageWorker> workers(num_workers, CoverageWorker(&shared));
+	run_tasks(workers);
+}
+
+void driver(const string& map_filename, FILE* coverage_file)
+{
+	bool is_bam = getFext(map_filename) == "bam";
+	samfile_t* map_file = samopen(map_filename.c_str(), is_bam ? "rb" : "r", 0);
+	if (map_file == NULL)
+		err_die("Error: cannot open map file %s for reading\n",
+				map_filename.c_str());
+	if (map_file->header == NULL || map_file->header->n_targets == 0)
+		err_die("Error: no @SQ lines in the header of %s\n",
+				map_filename.c_str());
+
+	print_wiggle_header(coverage_file);
+
+	// A coordinate-sorted BAM file with an index is split by reference
+	bam_index_t* idx = NULL;
+	if (is_bam)
+	{
+		// check first, bam_index_load() complains about a missing index
+		FILE* bai = fopen((map_filename + ".bai").c_str(), "rb");
+		if (bai)
+		{
+			fclose(bai);
+			idx = bam_index_load(map_filename.c_str());
+		}
+	}
+
+	if (idx)
+	{
+		coverage_from_index(map_filename, map_file->header, idx, coverage_file);
+		bam_index_destroy(idx);
+	}
+	else
+	{
+		coverage_from_stream(map_file, coverage_file);
+	}
+	samclose(map_file);
 }
 
 void print_usage()
 {
-    fprintf(stderr, "Usage:   wiggles <accepted_hits.sam> <coverage.wig>\n");
+    fprintf(stderr, "Usage:   wiggles <accepted_hits.sam|accepted_hits.bam> <coverage.wig>\n");
 }
 
 
@@ -142,14 +352,6 @@ int main(int argc, char** argv)
 	
     string coverage_file_name = argv[optind++];
 	
-	FILE* map_file = fopen(map_filename.c_str(), "r");
-	if (!map_file)
-	{
-		fprintf(stderr, "Error: cannot open map file %s for reading\n",
-				map_filename.c_str());
-		exit(1);
-	}
-	
     // Open the approppriate files
 	
     FILE* coverage_file = fopen((coverage_file_name).c_str(), "w");
@@ -160,7 +362,7 @@ int main(int argc, char** argv)
         exit(1);
     }
 
-    driver(map_file, coverage_file);
+    driver(map_filename, coverage_file);
 	
     return 0;
 }
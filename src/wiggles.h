@@ -18,5 +18,41 @@ void print_wiggle_for_ref(FILE* coverage_out,
 						  const string& ref_name,
 						  const vector<unsigned int>& DoC);
 
+/*
+ * Depth of coverage over one reference sequence, kept as a difference
+ * array: each aligned block adds +1 where it starts and -1 just past its
+ * end, and the depths are recovered with a prefix sum when the track is
+ * written.  Adding an alignment costs O(blocks) instead of O(bases).
+ */
+class CoverageDiffs
+{
+public:
+	CoverageDiffs() : _len(0) {}
+
+	// Starts over on a new reference; the array only grows as far as the
+	// alignments reach, so keep its capacity from the last one
+	void reset()
+	{
+		_diffs.clear();
+		_len = 0;
+	}
+
+	void add_block(uint32_t left, uint32_t right);
+
+	// Adds the matched blocks of a mapped alignment; returns false if the
+	// record is unmapped or would be rejected by the hit factories.
+	bool add_alignment(const bam1_t* b);
+
+	// Appends the bedGraph lines for ref_name to out, in the same format
+	// as print_wiggle_for_ref() on the summed depths.
+	void print(string& out, const string& ref_name) const;
+
+	size_t len() const { return _len; }
+
+private:
+	vector<int> _diffs;
+	size_t _len; // end of the rightmost alignment
+};
+
 
 #endif